@@ -6,14 +6,22 @@ precision highp float;
 ///////////////////////////////////////////////////////////////////////////////
 // Material
 ///////////////////////////////////////////////////////////////////////////////
-uniform vec3 material_color;
-uniform float material_reflectivity;
-uniform float material_metalness;
-uniform float material_fresnel;
-uniform float material_shininess;
-uniform float material_emission;
-
-uniform int has_emission_texture;
+layout(std140) uniform Material
+{
+	vec3 material_color;
+	float material_reflectivity;
+	float material_metalness;
+	float material_fresnel;
+	float material_shininess;
+	float material_emission;
+	int has_color_texture;
+	int has_reflectivity_texture;
+	int has_metalness_texture;
+	int has_fresnel_texture;
+	int has_shininess_texture;
+	int has_emission_texture;
+};
+
 layout(binding = 5) uniform sampler2D emissiveMap;
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,277 @@
+#include "AssetLoader.h"
+#include <GL/glew.h>
+#include <stb_image.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <memory>
+
+namespace labhelper
+{
+///////////////////////////////////////////////////////////////////////////////
+// Decode an .hdr image top row first. The loader keeps stb_image flipping
+// images, so the rows are flipped back.
+///////////////////////////////////////////////////////////////////////////////
+static HdrImage decodeHdrImage(const std::string& filename)
+{
+	HdrImage image;
+	int components;
+	image.data = stbi_loadf(filename.c_str(), &image.width, &image.height, &components, 3);
+	if(image.data == nullptr)
+	{
+		std::cout << "Failed to load image: " << filename << ".\n";
+		exit(1);
+	}
+	const size_t row = size_t(image.width) * 3;
+	for(int y = 0; y < image.height / 2; y++)
+	{
+		float* top = image.data + y * row;
+		std::swap_ranges(top, top + row, image.data + (image.height - 1 - y) * row);
+	}
+	return image;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A function that calls done the count:th time it is called, from whichever
+// thread that happens on
+///////////////////////////////////////////////////////////////////////////////
+static std::function<void()> countdown(int count, std::function<void()> done)
+{
+	auto remaining = std::make_shared<std::atomic<int>>(count);
+	return [remaining, done]() {
+		if(--*remaining == 0)
+			done();
+	};
+}
+
+AssetLoader::AssetLoader(unsigned number_of_threads)
+{
+	stbi_set_flip_vertically_on_load(true);
+	if(number_of_threads == 0)
+		number_of_threads = std::max(1u, std::thread::hardware_concurrency());
+	for(unsigned i = 0; i < number_of_threads; i++)
+		workers.emplace_back([this]() { work(); });
+}
+
+AssetLoader::~AssetLoader()
+{
+	finish();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	jobs_available.notify_all();
+	for(auto& worker : workers)
+		worker.join();
+}
+
+void AssetLoader::work()
+{
+	for(;;)
+	{
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			jobs_available.wait(lock, [this]() { return stopping || !jobs.empty(); });
+			if(jobs.empty())
+				return;
+			job = std::move(jobs.front());
+			jobs.pop_front();
+		}
+		job();
+	}
+}
+
+void AssetLoader::addJob(std::function<void()> job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back(std::move(job));
+	}
+	jobs_available.notify_one();
+}
+
+void AssetLoader::addUpload(std::function<void()> upload)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		uploads.push_back(std::move(upload));
+	}
+	uploads_available.notify_all();
+}
+
+void AssetLoader::beginAsset()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	unfinished++;
+}
+
+void AssetLoader::endAsset(const std::string& filename)
+{
+	std::cout << ("Loaded " + filename + ".\n") << std::flush;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		unfinished--;
+	}
+	uploads_available.notify_all();
+}
+
+std::shared_future<Model*> AssetLoader::loadModel(const std::string& filename, bool upload_to_gpu)
+{
+	auto promise = std::make_shared<std::promise<Model*>>();
+	std::shared_future<Model*> future = promise->get_future().share();
+	beginAsset();
+	addJob([this, filename, upload_to_gpu, promise]() {
+		Model* model = readModelFromOBJ(filename);
+		std::vector<Texture*> textures;
+		for(Material& material : model->m_materials)
+		{
+			for(int i = 0; i < number_of_material_textures; i++)
+			{
+				if((material.*material_textures[i]).valid)
+					textures.push_back(&(material.*material_textures[i]));
+			}
+		}
+		// Textures are decoded as jobs of their own, and the model is done
+		// when the last of them is
+		auto decoded = countdown(int(textures.size()) + 1, [this, filename, upload_to_gpu, promise, model]() {
+			if(!upload_to_gpu)
+			{
+				promise->set_value(model);
+				endAsset(filename);
+				return;
+			}
+			addUpload([this, filename, promise, model]() {
+				uploadModel(model);
+				promise->set_value(model);
+				endAsset(filename);
+			});
+		});
+		for(Texture* texture : textures)
+		{
+			addJob([texture, upload_to_gpu, decoded]() {
+				texture->decode(upload_to_gpu);
+				decoded();
+			});
+		}
+		decoded();
+	});
+	return future;
+}
+
+std::shared_future<HdrImage> AssetLoader::loadHdrImage(const std::string& filename)
+{
+	auto promise = std::make_shared<std::promise<HdrImage>>();
+	std::shared_future<HdrImage> future = promise->get_future().share();
+	beginAsset();
+	addJob([this, filename, promise]() {
+		promise->set_value(decodeHdrImage(filename));
+		endAsset(filename);
+	});
+	return future;
+}
+
+std::shared_future<uint32_t> AssetLoader::loadHdrTexture(const std::string& filename)
+{
+	auto promise = std::make_shared<std::promise<uint32_t>>();
+	std::shared_future<uint32_t> future = promise->get_future().share();
+	beginAsset();
+	addJob([this, filename, promise]() {
+		HdrImage image = decodeHdrImage(filename);
+		addUpload([this, filename, promise, image]() {
+			GLuint texture;
+			glGenTextures(1, &texture);
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.data);
+			stbi_image_free(image.data);
+			promise->set_value(texture);
+			endAsset(filename);
+		});
+	});
+	return future;
+}
+
+std::shared_future<uint32_t> AssetLoader::loadHdrMipmapTexture(const std::vector<std::string>& filenames)
+{
+	auto promise = std::make_shared<std::promise<uint32_t>>();
+	std::shared_future<uint32_t> future = promise->get_future().share();
+	if(filenames.empty())
+	{
+		promise->set_value(0);
+		return future;
+	}
+	beginAsset();
+	// The levels are decoded in parallel, and uploaded together
+	auto levels = std::make_shared<std::vector<HdrImage>>(filenames.size());
+	auto decoded = countdown(int(filenames.size()), [this, filenames, promise, levels]() {
+		addUpload([this, filenames, promise, levels]() {
+			GLuint texture;
+			glGenTextures(1, &texture);
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+			for(size_t i = 0; i < levels->size(); i++)
+			{
+				const HdrImage& image = (*levels)[i];
+				glTexImage2D(GL_TEXTURE_2D, GLint(i), GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT,
+				             image.data);
+				if(i == 0)
+				{
+					glGenerateMipmap(GL_TEXTURE_2D);
+				}
+				stbi_image_free(image.data);
+			}
+			promise->set_value(texture);
+			endAsset(filenames[0]);
+		});
+	});
+	for(size_t i = 0; i < filenames.size(); i++)
+	{
+		const std::string filename = filenames[i];
+		addJob([filename, levels, i, decoded]() {
+			(*levels)[i] = decodeHdrImage(filename);
+			decoded();
+		});
+	}
+	return future;
+}
+
+bool AssetLoader::upload(double budget_ms)
+{
+	const auto start = std::chrono::steady_clock::now();
+	for(;;)
+	{
+		std::function<void()> next;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if(uploads.empty())
+				return unfinished == 0;
+			next = std::move(uploads.front());
+			uploads.pop_front();
+		}
+		next();
+		if(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() >= budget_ms)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return unfinished == 0;
+		}
+	}
+}
+
+void AssetLoader::finish()
+{
+	while(!upload(std::numeric_limits<double>::infinity()))
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		uploads_available.wait(lock, [this]() { return !uploads.empty() || unfinished == 0; });
+	}
+}
+} // namespace labhelper
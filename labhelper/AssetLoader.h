@@ -0,0 +1,87 @@
+#pragma once
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Model.h"
+
+namespace labhelper
+{
+//////////////////////////////////////////////////////////////////////////////
+// A decoded .hdr image with three floats per pixel, top row first. data is
+// allocated by stb_image, and is freed with stbi_image_free().
+//////////////////////////////////////////////////////////////////////////////
+struct HdrImage
+{
+	int width = 0, height = 0;
+	float* data = nullptr;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Loads many assets at once, so that startup takes about as long as the
+// slowest asset rather than the sum of them. Each load function queues an
+// asset and returns a future for it right away. OBJ parsing and image
+// decoding run on worker threads, a job per model and per texture, and the
+// GL uploads are left to upload() or finish() on the thread with the GL
+// context. A future is ready once its asset is completely loaded.
+//
+//	labhelper::AssetLoader loader;
+//	auto ship = loader.loadModel("../scenes/NewShip.obj");
+//	auto environment = loader.loadHdrTexture("../scenes/envmaps/001.hdr");
+//	loader.finish();
+//	fighterModel = ship.get();
+//
+// The workers decode images with stb_image's global flip setting, which the
+// loader sets to flip (like init_window_SDL), so nothing else should change
+// it while assets are loading. Load each file only once.
+//////////////////////////////////////////////////////////////////////////////
+class AssetLoader
+{
+public:
+	// Uses one worker per hardware thread for 0
+	explicit AssetLoader(unsigned number_of_threads = 0);
+	// Finishes loading everything that is queued
+	~AssetLoader();
+
+	// A model, as loadModelFromOBJ() would load it
+	std::shared_future<Model*> loadModel(const std::string& filename, bool upload_to_gpu = true);
+	// An image on the CPU only
+	std::shared_future<HdrImage> loadHdrImage(const std::string& filename);
+	// The GL texture of an image, like the labs' loadHdrTexture()
+	std::shared_future<uint32_t> loadHdrTexture(const std::string& filename);
+	// A GL texture with one file per mip level, from the largest, like the
+	// labs' loadHdrMipmapTexture()
+	std::shared_future<uint32_t> loadHdrMipmapTexture(const std::vector<std::string>& filenames);
+
+	// Do the GL uploads of the assets that have been decoded, until about
+	// budget_ms milliseconds have passed, e.g. once per frame to load while
+	// rendering. At least one asset is uploaded if there is any. Returns
+	// true once everything that has been queued is loaded.
+	bool upload(double budget_ms);
+	// Wait for and upload everything that has been queued
+	void finish();
+
+private:
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable jobs_available;
+	std::condition_variable uploads_available;
+	// Parsing and decoding for the workers, and uploads for the GL thread
+	std::deque<std::function<void()>> jobs;
+	std::deque<std::function<void()>> uploads;
+	// Assets that have been queued but are not loaded yet
+	int unfinished = 0;
+	bool stopping = false;
+
+	void work();
+	void addJob(std::function<void()> job);
+	void addUpload(std::function<void()> upload);
+	void beginAsset();
+	void endAsset(const std::string& filename);
+};
+} // namespace labhelper
@@ -1,60 +1,184 @@
 #include "Model.h"
+#include "ModelCache.h"
 #include <iostream>
 #define TINYOBJLOADER_IMPLEMENTATION // define this in only *one* .cc
 #include <tiny_obj_loader.h>
-//#include <experimental/tinyobj_loader_opt.h>
 #include <algorithm>
+#include <cstring>
+#include <fstream>
 #include <sstream>
 #include <iomanip>
+#include <map>
+#include <thread>
+#include <tuple>
 #include <GL/glew.h>
 #include <stb_image.h>
 
 namespace labhelper
 {
-bool Texture::load(const std::string& _directory, const std::string& _filename, int _components)
+// Model caches store the textures in this order
+Texture Material::*const material_textures[number_of_material_textures] = {
+	&Material::m_color_texture,     &Material::m_reflectivity_texture, &Material::m_shininess_texture,
+	&Material::m_metalness_texture, &Material::m_fresnel_texture,      &Material::m_emission_texture
+};
+const int material_texture_components[number_of_material_textures] = { 4, 1, 1, 1, 1, 4 };
+
+///////////////////////////////////////////////////////////////////////////
+// The texture registry, by file and number of components. It holds weak
+// references, so that images are freed with the last texture using them.
+///////////////////////////////////////////////////////////////////////////
+static std::mutex texture_registry_mutex;
+static std::map<std::pair<std::string, int>, std::weak_ptr<TextureImage>> texture_registry;
+static bool keep_texture_data = false;
+
+void setKeepTextureData(bool keep)
+{
+	keep_texture_data = keep;
+}
+
+TextureArray::~TextureArray()
+{
+	glDeleteTextures(1, &gl_id);
+}
+
+TextureImage::~TextureImage()
+{
+	if(data != nullptr)
+		stbi_image_free(data);
+	if(gl_id != 0)
+		glDeleteTextures(1, &gl_id);
+}
+
+bool Texture::load(const std::string& _directory, const std::string& _filename, int _components, bool upload_to_gpu)
+{
+	setFile(_directory, _filename, _components);
+	decode(upload_to_gpu);
+	if(upload_to_gpu)
+		upload();
+	return true;
+}
+
+void Texture::setFile(const std::string& _directory, const std::string& _filename, int _components)
 {
 	filename = _filename;
 	directory = _directory;
+	components = _components;
 	valid = true;
-	int components;
-	data = stbi_load((directory + filename).c_str(), &width, &height, &components, _components);
-	if(data == nullptr)
+	std::lock_guard<std::mutex> lock(texture_registry_mutex);
+	std::weak_ptr<TextureImage>& registered = texture_registry[std::make_pair(directory + filename, components)];
+	image = registered.lock();
+	if(!image)
 	{
-		std::cout << "ERROR: loadModelFromOBJ(): Failed to load texture: " << filename << " in " << _directory
-		          << "\n";
-		exit(1);
+		image = std::make_shared<TextureImage>();
+		registered = image;
 	}
-	glGenTextures(1, &gl_id);
-	glBindTexture(GL_TEXTURE_2D, gl_id);
-	GLenum format, internal_format;
-	if(_components == 1)
+}
+
+bool Texture::decode(bool upload_to_gpu)
+{
+	std::lock_guard<std::mutex> lock(image->mutex);
+	if(upload_to_gpu && image->gl_id == 0 && image->compressed.levels.empty())
 	{
-		format = GL_R;
-		internal_format = GL_R8;
+		if(!loadCompressedTexture(directory + filename, components, image->compressed))
+		{
+			std::cout << "ERROR: loadModelFromOBJ(): Failed to load texture: " << filename << " in " << directory
+			          << "\n";
+			exit(1);
+		}
+		image->width = image->compressed.width;
+		image->height = image->compressed.height;
 	}
-	else if(_components == 3)
+	if((keep_texture_data || !upload_to_gpu) && image->data == nullptr)
 	{
-		format = GL_RGB;
-		internal_format = GL_RGB;
+		int file_components;
+		image->data = stbi_load((directory + filename).c_str(), &image->width, &image->height, &file_components,
+		                        components);
+		if(image->data == nullptr)
+		{
+			std::cout << "ERROR: loadModelFromOBJ(): Failed to load texture: " << filename << " in " << directory
+			          << "\n";
+			exit(1);
+		}
 	}
-	else if(_components == 4)
+	width = image->width;
+	height = image->height;
+	return true;
+}
+
+// The sampling of the textures of materials, both of the arrays and of
+// the views of their layers
+static void setMaterialTextureSampling(GLenum target)
+{
+	glTexParameterf(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameterf(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameterf(target, GL_TEXTURE_MAX_ANISOTROPY_EXT, 16);
+}
+
+void Texture::upload()
+{
+	uploadTextures(std::vector<Texture*>(1, this));
+}
+
+void uploadTextures(const std::vector<Texture*>& textures)
+{
+	// The images that are not on the GPU yet, by size and format. Images
+	// are only uploaded on the thread with the GL context, after they have
+	// been decoded, so nothing else changes them meanwhile.
+	typedef std::tuple<uint32_t, int, int, size_t> ArrayFormat;
+	std::map<ArrayFormat, std::vector<TextureImage*>> arrays;
+	for(Texture* texture : textures)
 	{
-		format = GL_RGBA;
-		internal_format = GL_RGBA;
+		TextureImage* image = texture->image.get();
+		std::lock_guard<std::mutex> lock(image->mutex);
+		if(image->gl_id != 0)
+			continue;
+		const CompressedTexture& compressed = image->compressed;
+		std::vector<TextureImage*>& layers =
+		    arrays[std::make_tuple(compressed.format, compressed.width, compressed.height, compressed.levels.size())];
+		if(std::find(layers.begin(), layers.end(), image) == layers.end())
+			layers.push_back(image);
 	}
-	else
+	for(auto& format_layers : arrays)
 	{
-		std::cout << "Texture loading not implemented for this number of compenents.\n";
-		exit(1);
+		const std::vector<TextureImage*>& layers = format_layers.second;
+		const CompressedTexture& first = layers[0]->compressed;
+		if(first.levels.empty())
+		{
+			// Nothing to upload, e.g. a texture that failed to bake
+			for(TextureImage* image : layers)
+			{
+				glGenTextures(1, &image->gl_id);
+				glBindTexture(GL_TEXTURE_2D, image->gl_id);
+				setMaterialTextureSampling(GL_TEXTURE_2D);
+			}
+			continue;
+		}
+		auto array = std::make_shared<TextureArray>();
+		glGenTextures(1, &array->gl_id);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, array->gl_id);
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, GLsizei(first.levels.size()), first.format, first.width, first.height,
+		               GLsizei(layers.size()));
+		setMaterialTextureSampling(GL_TEXTURE_2D_ARRAY);
+		for(size_t layer = 0; layer < layers.size(); layer++)
+		{
+			TextureImage* image = layers[layer];
+			std::lock_guard<std::mutex> lock(image->mutex);
+			uploadCompressedTextureLayer(image->compressed, int(layer));
+			glGenTextures(1, &image->gl_id);
+			glTextureView(image->gl_id, GL_TEXTURE_2D, array->gl_id, first.format, 0,
+			              GLuint(first.levels.size()), GLuint(layer), 1);
+			glBindTexture(GL_TEXTURE_2D, image->gl_id);
+			setMaterialTextureSampling(GL_TEXTURE_2D);
+			image->array = array;
+			image->layer = int(layer);
+			// The GPU has the only copy now
+			image->compressed = CompressedTexture();
+		}
 	}
-	glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 16);
-	return true;
+	for(Texture* texture : textures)
+		texture->gl_id = texture->image->gl_id;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -62,65 +186,424 @@ bool Texture::load(const std::string& _directory, const std::string& _filename,
 ///////////////////////////////////////////////////////////////////////////
 Model::~Model()
 {
-	for(auto& material : m_materials)
-	{
-		if(material.m_color_texture.valid)
-			glDeleteTextures(1, &material.m_color_texture.gl_id);
-		if(material.m_reflectivity_texture.valid)
-			glDeleteTextures(1, &material.m_reflectivity_texture.gl_id);
-		if(material.m_shininess_texture.valid)
-			glDeleteTextures(1, &material.m_shininess_texture.gl_id);
-		if(material.m_metalness_texture.valid)
-			glDeleteTextures(1, &material.m_metalness_texture.gl_id);
-		if(material.m_fresnel_texture.valid)
-			glDeleteTextures(1, &material.m_fresnel_texture.gl_id);
-		if(material.m_emission_texture.valid)
-			glDeleteTextures(1, &material.m_emission_texture.gl_id);
-	}
+	// Models that were never uploaded own no GL objects. Textures are freed
+	// by the registry when no model uses them any more.
+	if(m_vaob == 0)
+		return;
 	glDeleteBuffers(1, &m_positions_bo);
 	glDeleteBuffers(1, &m_normals_bo);
 	glDeleteBuffers(1, &m_texture_coordinates_bo);
+	glDeleteBuffers(1, &m_draw_state.m_materials_ubo);
+	const BatchedDrawState& batched = m_draw_state.m_batched;
+	glDeleteBuffers(1, &batched.m_materials_ssbo);
+	glDeleteBuffers(1, &batched.m_commands_bo);
+	glDeleteBuffers(1, &batched.m_material_indices_bo);
+	if(!batched.m_textures.empty())
+		glDeleteTextures(GLsizei(batched.m_textures.size()), batched.m_textures.data());
 }
 
-Model* loadModelFromOBJ(std::string path)
+///////////////////////////////////////////////////////////////////////////
+// Multi-threaded OBJ parsing. The file is read into memory and split into
+// line aligned chunks, which are parsed in parallel into vertex arrays and
+// faces. The chunks are then merged using prefix sums of their vertex
+// counts, and the shapes are built by replaying the group, object and
+// material statements in file order the way tinyobj::LoadObj does, so the
+// result is the same as with tinyobj. Tags ('t') are not used by Model and
+// are skipped.
+///////////////////////////////////////////////////////////////////////////
+
+// Chunks smaller than this are not worth a thread of their own
+static const size_t min_obj_chunk_size = 1 << 20;
+
+// A statement that affects which shape, name or material faces get, and
+// the number of faces of the chunk that come before it
+struct OBJStatement
+{
+	enum Type
+	{
+		UseMaterial,
+		MaterialLibrary,
+		Group,
+		Object
+	};
+	Type type;
+	size_t face;
+	std::string name;
+};
+
+struct OBJChunk
+{
+	char* begin;
+	char* end;
+	std::vector<tinyobj::real_t> v, vn, vt;
+	// The corners of all faces, face i being corners[face_begin[i]] to
+	// corners[face_begin[i + 1]]
+	std::vector<tinyobj::index_t> corners;
+	std::vector<size_t> face_begin;
+	// Negative indices count back from the vertices of this chunk until the
+	// chunks are merged. These are the corners that have them, with a bit
+	// set for each such index.
+	std::vector<std::pair<size_t, int>> relative_corners;
+	std::vector<OBJStatement> statements;
+	// Where the vertices of this chunk start in the merged arrays
+	int v_offset = 0, vn_offset = 0, vt_offset = 0;
+};
+
+enum
+{
+	RelativeVertex = 1,
+	RelativeNormal = 2,
+	RelativeTexcoord = 4
+};
+
+// Run f(0) ... f(n - 1) on a thread each
+template<typename F>
+static void parallelFor(size_t n, const F& f)
+{
+	std::vector<std::thread> threads;
+	for(size_t i = 1; i < n; i++)
+		threads.emplace_back([&f, i]() { f(i); });
+	if(n > 0)
+		f(0);
+	for(auto& thread : threads)
+		thread.join();
+}
+
+static int fixOBJIndex(int index, int count, int relative_bit, int& relative)
+{
+	if(index > 0)
+		return index - 1;
+	if(index == 0)
+		return 0;
+	relative |= relative_bit;
+	return count + index;
+}
+
+// Parse i, i/j, i//k or i/j/k, like tinyobj's parseTriple
+static tinyobj::index_t parseOBJCorner(const char** token, const OBJChunk& chunk, int& relative)
+{
+	tinyobj::index_t corner;
+	corner.vertex_index = fixOBJIndex(atoi(*token), int(chunk.v.size() / 3), RelativeVertex, relative);
+	corner.normal_index = -1;
+	corner.texcoord_index = -1;
+	(*token) += strcspn(*token, "/ \t\r");
+	if((*token)[0] != '/')
+		return corner;
+	(*token)++;
+	if((*token)[0] != '/')
+	{
+		corner.texcoord_index = fixOBJIndex(atoi(*token), int(chunk.vt.size() / 2), RelativeTexcoord, relative);
+		(*token) += strcspn(*token, "/ \t\r");
+		if((*token)[0] != '/')
+			return corner;
+	}
+	(*token)++;
+	corner.normal_index = fixOBJIndex(atoi(*token), int(chunk.vn.size() / 3), RelativeNormal, relative);
+	(*token) += strcspn(*token, "/ \t\r");
+	return corner;
+}
+
+// The first whitespace separated word of a line, like sscanf("%s")
+static std::string firstWord(const char* token)
+{
+	token += strspn(token, " \t\n\v\f\r");
+	return std::string(token, strcspn(token, " \t\n\v\f\r"));
+}
+
+static void parseOBJChunk(OBJChunk& chunk)
+{
+	chunk.face_begin.push_back(0);
+	for(char* line = chunk.begin; line < chunk.end;)
+	{
+		// Lines end with '\n', '\r' or both, and are terminated in place
+		char* line_end = line + strcspn(line, "\r\n");
+		if(line_end < chunk.end)
+			*line_end = '\0';
+		const char* token = line;
+		line = line_end + 1;
+
+		token += strspn(token, " \t");
+		if(token[0] == '\0' || token[0] == '#')
+			continue;
+
+		if(token[0] == 'v' && IS_SPACE(token[1]))
+		{
+			token += 2;
+			tinyobj::real_t x, y, z;
+			tinyobj::parseReal3(&x, &y, &z, &token);
+			chunk.v.push_back(x);
+			chunk.v.push_back(y);
+			chunk.v.push_back(z);
+		}
+		else if(token[0] == 'v' && token[1] == 'n' && IS_SPACE(token[2]))
+		{
+			token += 3;
+			tinyobj::real_t x, y, z;
+			tinyobj::parseReal3(&x, &y, &z, &token);
+			chunk.vn.push_back(x);
+			chunk.vn.push_back(y);
+			chunk.vn.push_back(z);
+		}
+		else if(token[0] == 'v' && token[1] == 't' && IS_SPACE(token[2]))
+		{
+			token += 3;
+			tinyobj::real_t x, y;
+			tinyobj::parseReal2(&x, &y, &token);
+			chunk.vt.push_back(x);
+			chunk.vt.push_back(y);
+		}
+		else if(token[0] == 'f' && IS_SPACE(token[1]))
+		{
+			token += 2;
+			token += strspn(token, " \t");
+			while(!IS_NEW_LINE(token[0]))
+			{
+				int relative = 0;
+				chunk.corners.push_back(parseOBJCorner(&token, chunk, relative));
+				if(relative != 0)
+					chunk.relative_corners.push_back(std::make_pair(chunk.corners.size() - 1, relative));
+				token += strspn(token, " \t\r");
+			}
+			chunk.face_begin.push_back(chunk.corners.size());
+		}
+		else if(strncmp(token, "usemtl", 6) == 0 && IS_SPACE(token[6]))
+		{
+			OBJStatement statement = { OBJStatement::UseMaterial, chunk.face_begin.size() - 1, firstWord(token + 7) };
+			chunk.statements.push_back(statement);
+		}
+		else if(strncmp(token, "mtllib", 6) == 0 && IS_SPACE(token[6]))
+		{
+			OBJStatement statement = { OBJStatement::MaterialLibrary, chunk.face_begin.size() - 1, token + 7 };
+			chunk.statements.push_back(statement);
+		}
+		else if(token[0] == 'g' && IS_SPACE(token[1]))
+		{
+			// The name is the second word, and the rest is ignored
+			token += 1;
+			token += strspn(token, " \t\r");
+			OBJStatement statement = { OBJStatement::Group, chunk.face_begin.size() - 1,
+				                       std::string(token, strcspn(token, " \t\r")) };
+			chunk.statements.push_back(statement);
+		}
+		else if(token[0] == 'o' && IS_SPACE(token[1]))
+		{
+			OBJStatement statement = { OBJStatement::Object, chunk.face_begin.size() - 1, firstWord(token + 2) };
+			chunk.statements.push_back(statement);
+		}
+	}
+}
+
+// A run of consecutive faces of a chunk
+struct OBJFaceRange
+{
+	const OBJChunk* chunk;
+	size_t begin, end;
+};
+
+// Triangulate the faces of a face group into shape, like tinyobj's
+// exportFaceGroupToShape
+static bool exportOBJFaces(tinyobj::shape_t& shape, const std::vector<OBJFaceRange>& face_group, int material,
+                           const std::string& name)
+{
+	if(face_group.empty())
+		return false;
+	for(const OBJFaceRange& range : face_group)
+	{
+		const OBJChunk& chunk = *range.chunk;
+		for(size_t f = range.begin; f < range.end; f++)
+		{
+			const tinyobj::index_t* face = &chunk.corners[chunk.face_begin[f]];
+			const size_t n = chunk.face_begin[f + 1] - chunk.face_begin[f];
+			for(size_t k = 2; k < n; k++)
+			{
+				shape.mesh.indices.push_back(face[0]);
+				shape.mesh.indices.push_back(face[k - 1]);
+				shape.mesh.indices.push_back(face[k]);
+				shape.mesh.num_face_vertices.push_back(3);
+				shape.mesh.material_ids.push_back(material);
+			}
+		}
+	}
+	shape.name = name;
+	return true;
+}
+
+static bool parseOBJ(const std::string& path, const std::string& directory, tinyobj::attrib_t* attrib,
+                     std::vector<tinyobj::shape_t>* shapes, std::vector<tinyobj::material_t>* materials,
+                     std::string* err)
 {
 	///////////////////////////////////////////////////////////////////////
-	// Separate filename into directory, base filename and extension
-	// NOTE: This can be made a LOT simpler as soon as compilers properly
-	//		 support std::filesystem (C++17)
+	// Read the whole file, with a terminating zero
 	///////////////////////////////////////////////////////////////////////
-	size_t separator = path.find_last_of("\\/");
-	std::string filename, extension, directory;
-	if(separator != std::string::npos)
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if(!file)
 	{
-		filename = path.substr(separator + 1, path.size() - separator - 1);
-		directory = path.substr(0, separator + 1);
+		*err = "Cannot open file [" + path + "]\n";
+		return false;
 	}
-	else
+	std::vector<char> text(size_t(file.tellg()) + 1, '\0');
+	file.seekg(0);
+	file.read(text.data(), text.size() - 1);
+	if(!file)
 	{
-		filename = path;
-		directory = "./";
+		*err = "Cannot read file [" + path + "]\n";
+		return false;
 	}
-	separator = filename.find_last_of(".");
-	if(separator == std::string::npos)
+
+	///////////////////////////////////////////////////////////////////////
+	// Split it into chunks that start at the beginning of a line, and parse
+	// them in parallel
+	///////////////////////////////////////////////////////////////////////
+	const size_t size = text.size() - 1;
+	size_t number_of_chunks = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+	                                           size / min_obj_chunk_size + 1);
+	std::vector<OBJChunk> chunks(number_of_chunks);
+	char* const text_end = text.data() + size;
+	char* begin = text.data();
+	for(size_t i = 0; i < number_of_chunks; i++)
 	{
-		std::cout << "Fatal: loadModelFromOBJ(): Expecting filename ending in '.obj'\n";
-		exit(1);
+		char* end = text.data() + size * (i + 1) / number_of_chunks;
+		if(end < begin)
+			end = begin;
+		end += strcspn(end, "\r\n");
+		end = std::min(end + 1, text_end);
+		chunks[i].begin = begin;
+		chunks[i].end = end;
+		begin = end;
 	}
-	extension = filename.substr(separator, filename.size() - separator);
-	filename = filename.substr(0, separator);
+	parallelFor(number_of_chunks, [&chunks](size_t i) { parseOBJChunk(chunks[i]); });
 
 	///////////////////////////////////////////////////////////////////////
-	// Parse the OBJ file using tinyobj
+	// Merge the vertex arrays and make the negative indices absolute
+	///////////////////////////////////////////////////////////////////////
+	for(size_t i = 1; i < number_of_chunks; i++)
+	{
+		chunks[i].v_offset = chunks[i - 1].v_offset + int(chunks[i - 1].v.size() / 3);
+		chunks[i].vn_offset = chunks[i - 1].vn_offset + int(chunks[i - 1].vn.size() / 3);
+		chunks[i].vt_offset = chunks[i - 1].vt_offset + int(chunks[i - 1].vt.size() / 2);
+	}
+	const OBJChunk& last = chunks.back();
+	attrib->vertices.resize(size_t(last.v_offset) * 3 + last.v.size());
+	attrib->normals.resize(size_t(last.vn_offset) * 3 + last.vn.size());
+	attrib->texcoords.resize(size_t(last.vt_offset) * 2 + last.vt.size());
+	parallelFor(number_of_chunks, [&chunks, attrib](size_t i) {
+		OBJChunk& chunk = chunks[i];
+		std::copy(chunk.v.begin(), chunk.v.end(), attrib->vertices.begin() + size_t(chunk.v_offset) * 3);
+		std::copy(chunk.vn.begin(), chunk.vn.end(), attrib->normals.begin() + size_t(chunk.vn_offset) * 3);
+		std::copy(chunk.vt.begin(), chunk.vt.end(), attrib->texcoords.begin() + size_t(chunk.vt_offset) * 2);
+		std::vector<tinyobj::real_t>().swap(chunk.v);
+		std::vector<tinyobj::real_t>().swap(chunk.vn);
+		std::vector<tinyobj::real_t>().swap(chunk.vt);
+		for(const auto& relative : chunk.relative_corners)
+		{
+			tinyobj::index_t& corner = chunk.corners[relative.first];
+			if(relative.second & RelativeVertex)
+				corner.vertex_index += chunk.v_offset;
+			if(relative.second & RelativeNormal)
+				corner.normal_index += chunk.vn_offset;
+			if(relative.second & RelativeTexcoord)
+				corner.texcoord_index += chunk.vt_offset;
+		}
+	});
+
+	///////////////////////////////////////////////////////////////////////
+	// Build the shapes from the statements in file order
+	///////////////////////////////////////////////////////////////////////
+	tinyobj::MaterialFileReader material_reader(directory);
+	std::map<std::string, int> material_map;
+	int material = -1;
+	std::string name;
+	tinyobj::shape_t shape;
+	std::vector<OBJFaceRange> face_group;
+	for(const OBJChunk& chunk : chunks)
+	{
+		size_t face = 0;
+		for(size_t s = 0; s <= chunk.statements.size(); s++)
+		{
+			// The faces up to the statement belong to the current face group
+			const size_t next_face = s < chunk.statements.size() ? chunk.statements[s].face : chunk.face_begin.size() - 1;
+			if(next_face > face)
+			{
+				OBJFaceRange range = { &chunk, face, next_face };
+				face_group.push_back(range);
+				face = next_face;
+			}
+			if(s == chunk.statements.size())
+				break;
+
+			const OBJStatement& statement = chunk.statements[s];
+			switch(statement.type)
+			{
+			case OBJStatement::UseMaterial:
+			{
+				auto found = material_map.find(statement.name);
+				const int new_material = found != material_map.end() ? found->second : -1;
+				if(new_material != material)
+				{
+					exportOBJFaces(shape, face_group, material, name);
+					face_group.clear();
+					material = new_material;
+				}
+				break;
+			}
+			case OBJStatement::MaterialLibrary:
+			{
+				std::vector<std::string> filenames;
+				tinyobj::SplitString(statement.name, ' ', filenames);
+				if(filenames.empty())
+				{
+					*err += "WARN: Looks like empty filename for mtllib. Use default material. \n";
+					break;
+				}
+				bool found = false;
+				for(size_t i = 0; i < filenames.size() && !found; i++)
+				{
+					std::string mtl_err;
+					found = material_reader(filenames[i], materials, &material_map, &mtl_err);
+					*err += mtl_err;
+				}
+				if(!found)
+				{
+					*err += "WARN: Failed to load material file(s). Use default material.\n";
+				}
+				break;
+			}
+			case OBJStatement::Group:
+			case OBJStatement::Object:
+				if(exportOBJFaces(shape, face_group, material, name))
+				{
+					shapes->push_back(std::move(shape));
+				}
+				shape = tinyobj::shape_t();
+				face_group.clear();
+				name = statement.name;
+				break;
+			}
+		}
+	}
+	// Faces that were exported by a usemtl on the last lines still make
+	// a shape
+	if(exportOBJFaces(shape, face_group, material, name) || !shape.mesh.indices.empty())
+	{
+		shapes->push_back(std::move(shape));
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Parse an OBJ file into a model. Textures are named, but not decoded.
+///////////////////////////////////////////////////////////////////////////
+static void loadOBJ(const std::string& path, const std::string& directory, Model* model)
+{
+	///////////////////////////////////////////////////////////////////////
+	// Parse the OBJ file into tinyobj's datastructures
 	///////////////////////////////////////////////////////////////////////
-	std::cout << "Loading " << path << "..." << std::flush;
 	tinyobj::attrib_t attrib;
 	std::vector<tinyobj::shape_t> shapes;
 	std::vector<tinyobj::material_t> materials;
 	std::string err;
 	// Expect '.mtl' file in the same directory and triangulate meshes
-	bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err,
-	                            (directory + filename + extension).c_str(), directory.c_str(), true);
+	bool ret = parseOBJ(path, directory, &attrib, &shapes, &materials, &err);
 	if(!err.empty())
 	{ // `err` may contain warning message.
 		std::cerr << err << std::endl;
@@ -129,9 +612,6 @@ Model* loadModelFromOBJ(std::string path)
 	{
 		exit(1);
 	}
-	Model* model = new Model;
-	model->m_name = filename;
-	model->m_filename = path;
 
 	///////////////////////////////////////////////////////////////////////
 	// Transform all materials into our datastructure
@@ -143,32 +623,32 @@ Model* loadModelFromOBJ(std::string path)
 		material.m_color = glm::vec3(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
 		if(m.diffuse_texname != "")
 		{
-			material.m_color_texture.load(directory, m.diffuse_texname, 4);
+			material.m_color_texture.setFile(directory, m.diffuse_texname, 4);
 		}
 		material.m_reflectivity = m.specular[0];
 		if(m.specular_texname != "")
 		{
-			material.m_reflectivity_texture.load(directory, m.specular_texname, 1);
+			material.m_reflectivity_texture.setFile(directory, m.specular_texname, 1);
 		}
 		material.m_metalness = m.metallic;
 		if(m.metallic_texname != "")
 		{
-			material.m_metalness_texture.load(directory, m.metallic_texname, 1);
+			material.m_metalness_texture.setFile(directory, m.metallic_texname, 1);
 		}
 		material.m_fresnel = m.sheen;
 		if(m.sheen_texname != "")
 		{
-			material.m_fresnel_texture.load(directory, m.sheen_texname, 1);
+			material.m_fresnel_texture.setFile(directory, m.sheen_texname, 1);
 		}
 		material.m_shininess = m.roughness;
 		if(m.roughness_texname != "")
 		{
-			material.m_shininess_texture.load(directory, m.roughness_texname, 1);
+			material.m_shininess_texture.setFile(directory, m.roughness_texname, 1);
 		}
 		material.m_emission = m.emission[0];
 		if(m.emissive_texname != "")
 		{
-			material.m_emission_texture.load(directory, m.emissive_texname, 4);
+			material.m_emission_texture.setFile(directory, m.emissive_texname, 4);
 		}
 		material.m_transparency = m.transmittance[0];
 		model->m_materials.push_back(material);
@@ -316,10 +796,67 @@ Model* loadModelFromOBJ(std::string path)
 			model->m_meshes.back().m_name = shape.name;
 		}
 	}
+}
+
+Model* readModelFromOBJ(std::string path)
+{
+	///////////////////////////////////////////////////////////////////////
+	// Separate filename into directory, base filename and extension
+	// NOTE: This can be made a LOT simpler as soon as compilers properly
+	//		 support std::filesystem (C++17)
+	///////////////////////////////////////////////////////////////////////
+	size_t separator = path.find_last_of("\\/");
+	std::string filename, extension, directory;
+	if(separator != std::string::npos)
+	{
+		filename = path.substr(separator + 1, path.size() - separator - 1);
+		directory = path.substr(0, separator + 1);
+	}
+	else
+	{
+		filename = path;
+		directory = "./";
+	}
+	separator = filename.find_last_of(".");
+	if(separator == std::string::npos)
+	{
+		std::cout << "Fatal: readModelFromOBJ(): Expecting filename ending in '.obj'\n";
+		exit(1);
+	}
+	extension = filename.substr(separator, filename.size() - separator);
+	filename = filename.substr(0, separator);
+
+	Model* model = new Model;
+	model->m_name = filename;
+	model->m_filename = path;
 
 	///////////////////////////////////////////////////////////////////////
-	// Upload to GPU
+	// Use the compiled copy of the model if it is up to date, and otherwise
+	// parse the OBJ file and compile it for the next time
 	///////////////////////////////////////////////////////////////////////
+	const std::string obj_path = directory + filename + extension;
+	if(!loadModelFromCache(obj_path, directory, model))
+	{
+		loadOBJ(obj_path, directory, model);
+		saveModelToCache(model, obj_path, directory);
+	}
+
+	return model;
+}
+
+void uploadModel(Model* model)
+{
+	std::vector<Texture*> textures;
+	for(Material& material : model->m_materials)
+	{
+		for(int i = 0; i < number_of_material_textures; i++)
+		{
+			Texture& texture = material.*material_textures[i];
+			if(texture.valid)
+				textures.push_back(&texture);
+		}
+	}
+	uploadTextures(textures);
 	glGenVertexArrays(1, &model->m_vaob);
 	glBindVertexArray(model->m_vaob);
 	glGenBuffers(1, &model->m_positions_bo);
@@ -340,7 +877,23 @@ Model* loadModelFromOBJ(std::string path)
 	             &model->m_texture_coordinates[0].x, GL_STATIC_DRAW);
 	glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
 	glEnableVertexAttribArray(2);
+}
 
+Model* loadModelFromOBJ(std::string path, bool upload_to_gpu)
+{
+	std::cout << "Loading " << path << "..." << std::flush;
+	Model* model = readModelFromOBJ(path);
+	for(Material& material : model->m_materials)
+	{
+		for(int i = 0; i < number_of_material_textures; i++)
+		{
+			Texture& texture = material.*material_textures[i];
+			if(texture.valid)
+				texture.decode(upload_to_gpu);
+		}
+	}
+	if(upload_to_gpu)
+		uploadModel(model);
 	std::cout << "done.\n";
 	return model;
 }
@@ -462,65 +1015,523 @@ void freeModel(Model* model)
 		delete model;
 }
 
-///////////////////////////////////////////////////////////////////////
-// Loop through all Meshes in the Model and render them
-///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+// A material in the std140 layout of the Material uniform block (see
+// render() in Model.h)
+///////////////////////////////////////////////////////////////////////////
+struct MaterialBlock
+{
+	glm::vec3 color;
+	float reflectivity;
+	float metalness;
+	float fresnel;
+	float shininess;
+	float emission;
+	int32_t has_texture[number_of_material_textures];
+};
+static_assert(sizeof(MaterialBlock) == 56, "MaterialBlock does not match the std140 layout");
+
+// The texture unit of each of material_textures, which are in the order of
+// the cache rather than that of the units
+static const GLuint material_texture_units[number_of_material_textures] = { 0, 1, 4, 2, 3, 5 };
+
+static MaterialBlock materialBlock(const Material& material)
+{
+	MaterialBlock block;
+	block.color = material.m_color;
+	block.reflectivity = material.m_reflectivity;
+	block.metalness = material.m_metalness;
+	block.fresnel = material.m_fresnel;
+	block.shininess = material.m_shininess;
+	block.emission = material.m_emission;
+	for(int i = 0; i < number_of_material_textures; i++)
+		block.has_texture[material_texture_units[i]] = (material.*material_textures[i]).valid ? 1 : 0;
+	return block;
+}
+
+// The texture of each unit of each material, or zero where there is none
+static std::vector<uint32_t> materialTextureIds(const Model* model)
+{
+	std::vector<uint32_t> ids(model->m_materials.size() * number_of_material_textures);
+	for(size_t i = 0; i < model->m_materials.size(); i++)
+	{
+		for(int j = 0; j < number_of_material_textures; j++)
+		{
+			const Texture& texture = model->m_materials[i].*material_textures[j];
+			ids[i * number_of_material_textures + material_texture_units[j]] = texture.valid ? texture.gl_id : 0;
+		}
+	}
+	return ids;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Group the meshes of a model by material. Materials that use the same
+// textures are sorted next to each other so that the textures are bound
+// once, and the meshes of a material by where they start so that the
+// ranges of adjacent ones can be merged.
+///////////////////////////////////////////////////////////////////////////
+static void groupMeshes(const Model* model)
+{
+	DrawState& state = model->m_draw_state;
+	const std::vector<uint32_t> texture_ids = materialTextureIds(model);
+	std::vector<const Mesh*> meshes;
+	state.m_grouped_material_indices.clear();
+	for(const Mesh& mesh : model->m_meshes)
+	{
+		state.m_grouped_material_indices.push_back(mesh.m_material_idx);
+		if(mesh.m_number_of_vertices > 0)
+			meshes.push_back(&mesh);
+	}
+	std::sort(meshes.begin(), meshes.end(), [&texture_ids](const Mesh* a, const Mesh* b) {
+		if(a->m_material_idx != b->m_material_idx)
+		{
+			const uint32_t* a_textures = &texture_ids[a->m_material_idx * number_of_material_textures];
+			const uint32_t* b_textures = &texture_ids[b->m_material_idx * number_of_material_textures];
+			if(!std::equal(a_textures, a_textures + number_of_material_textures, b_textures))
+			{
+				return std::lexicographical_compare(a_textures, a_textures + number_of_material_textures,
+				                                    b_textures, b_textures + number_of_material_textures);
+			}
+			return a->m_material_idx < b->m_material_idx;
+		}
+		return a->m_start_index < b->m_start_index;
+	});
+	state.m_grouping++;
+	state.m_groups.clear();
+	state.m_firsts.clear();
+	state.m_counts.clear();
+	for(const Mesh* mesh : meshes)
+	{
+		if(state.m_groups.empty() || state.m_groups.back().m_material_idx != mesh->m_material_idx)
+		{
+			MaterialGroup group = { mesh->m_material_idx, uint32_t(state.m_firsts.size()), 0 };
+			state.m_groups.push_back(group);
+		}
+		MaterialGroup& group = state.m_groups.back();
+		if(group.m_number_of_ranges > 0
+		   && uint32_t(state.m_firsts.back() + state.m_counts.back()) == mesh->m_start_index)
+		{
+			state.m_counts.back() += int32_t(mesh->m_number_of_vertices);
+			continue;
+		}
+		state.m_firsts.push_back(int32_t(mesh->m_start_index));
+		state.m_counts.push_back(int32_t(mesh->m_number_of_vertices));
+		group.m_number_of_ranges++;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Bring the draw state of a model up to date with its meshes and
+// materials. This only compares a few bytes per mesh and material unless
+// something has changed, such as a material edited in a GUI.
+///////////////////////////////////////////////////////////////////////////
+static void updateGroups(const Model* model)
+{
+	const DrawState& state = model->m_draw_state;
+	bool regroup = state.m_grouped_material_indices.size() != model->m_meshes.size();
+	for(size_t i = 0; !regroup && i < model->m_meshes.size(); i++)
+		regroup = state.m_grouped_material_indices[i] != model->m_meshes[i].m_material_idx;
+	if(regroup)
+		groupMeshes(model);
+}
+
+static void updateMaterialBlocks(const Model* model)
+{
+	DrawState& state = model->m_draw_state;
+	const size_t number_of_materials = model->m_materials.size();
+	if(state.m_materials_ubo == 0 || state.m_material_blocks.size() != number_of_materials * sizeof(MaterialBlock))
+	{
+		// Slots are bound whole with glBindBufferRange, so they have to be
+		// aligned, and at least as large as the block, whose size drivers
+		// may round up to a vec4
+		GLint alignment = 256;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		alignment = std::max(alignment, GLint(sizeof(glm::vec4)));
+		state.m_material_slot_size = uint32_t((sizeof(MaterialBlock) + alignment - 1) / alignment * alignment);
+		state.m_material_blocks.resize(number_of_materials * sizeof(MaterialBlock));
+		std::vector<uint8_t> slots(std::max<size_t>(number_of_materials, 1) * state.m_material_slot_size);
+		for(size_t i = 0; i < number_of_materials; i++)
+		{
+			const MaterialBlock block = materialBlock(model->m_materials[i]);
+			memcpy(&state.m_material_blocks[i * sizeof(MaterialBlock)], &block, sizeof(block));
+			memcpy(&slots[i * state.m_material_slot_size], &block, sizeof(block));
+		}
+		if(state.m_materials_ubo == 0)
+			glGenBuffers(1, &state.m_materials_ubo);
+		glBindBuffer(GL_UNIFORM_BUFFER, state.m_materials_ubo);
+		glBufferData(GL_UNIFORM_BUFFER, slots.size(), slots.data(), GL_DYNAMIC_DRAW);
+		return;
+	}
+	bool bound = false;
+	for(size_t i = 0; i < number_of_materials; i++)
+	{
+		const MaterialBlock block = materialBlock(model->m_materials[i]);
+		uint8_t* current = &state.m_material_blocks[i * sizeof(MaterialBlock)];
+		if(memcmp(current, &block, sizeof(block)) == 0)
+			continue;
+		memcpy(current, &block, sizeof(block));
+		if(!bound)
+		{
+			glBindBuffer(GL_UNIFORM_BUFFER, state.m_materials_ubo);
+			bound = true;
+		}
+		glBufferSubData(GL_UNIFORM_BUFFER, i * state.m_material_slot_size, sizeof(block), &block);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Submit a material as separate uniforms, for programs without the
+// Material block. The locations are looked up once per render().
+///////////////////////////////////////////////////////////////////////////
+struct MaterialUniforms
+{
+	GLint color, reflectivity, metalness, fresnel, shininess, emission;
+	GLint has_texture[number_of_material_textures];
+	// Compatibility with the old shading model of lab3
+	GLint diffuse_color, emissive_color, has_diffuse_texture;
+};
+
+static MaterialUniforms getMaterialUniforms(GLuint program)
+{
+	static const char* has_texture_names[number_of_material_textures] = {
+		"has_color_texture",   "has_reflectivity_texture", "has_metalness_texture",
+		"has_fresnel_texture", "has_shininess_texture",    "has_emission_texture"
+	};
+	MaterialUniforms uniforms;
+	uniforms.color = glGetUniformLocation(program, "material_color");
+	uniforms.reflectivity = glGetUniformLocation(program, "material_reflectivity");
+	uniforms.metalness = glGetUniformLocation(program, "material_metalness");
+	uniforms.fresnel = glGetUniformLocation(program, "material_fresnel");
+	uniforms.shininess = glGetUniformLocation(program, "material_shininess");
+	uniforms.emission = glGetUniformLocation(program, "material_emission");
+	for(int i = 0; i < number_of_material_textures; i++)
+		uniforms.has_texture[i] = glGetUniformLocation(program, has_texture_names[i]);
+	uniforms.diffuse_color = glGetUniformLocation(program, "material_diffuse_color");
+	uniforms.emissive_color = glGetUniformLocation(program, "material_emissive_color");
+	uniforms.has_diffuse_texture = glGetUniformLocation(program, "has_diffuse_texture");
+	return uniforms;
+}
+
+static void setMaterialUniforms(const MaterialUniforms& uniforms, const MaterialBlock& block)
+{
+	glUniform3fv(uniforms.color, 1, &block.color.x);
+	glUniform1f(uniforms.reflectivity, block.reflectivity);
+	glUniform1f(uniforms.metalness, block.metalness);
+	glUniform1f(uniforms.fresnel, block.fresnel);
+	glUniform1f(uniforms.shininess, block.shininess);
+	glUniform1f(uniforms.emission, block.emission);
+	for(int i = 0; i < number_of_material_textures; i++)
+		glUniform1i(uniforms.has_texture[i], block.has_texture[i]);
+	glUniform3fv(uniforms.diffuse_color, 1, &block.color.x);
+	glUniform3fv(uniforms.emissive_color, 1, &block.color.x);
+	glUniform1i(uniforms.has_diffuse_texture, block.has_texture[0]);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A material in the std430 layout of MaterialData in the Materials buffer
+// (see render() in Model.h)
+///////////////////////////////////////////////////////////////////////////
+struct BatchedMaterial
+{
+	glm::vec3 color;
+	float reflectivity;
+	float metalness;
+	float fresnel;
+	float shininess;
+	float emission;
+	int32_t texture_layer[number_of_material_textures];
+	// Structs with a vec3 are aligned to 16 bytes in arrays
+	int32_t padding[2];
+};
+static_assert(sizeof(BatchedMaterial) == 64, "BatchedMaterial does not match the std430 layout");
+
+// Set the values of a material, leaving the texture layers as they are
+static void setBatchedMaterial(BatchedMaterial& batched, const Material& material)
+{
+	batched.color = material.m_color;
+	batched.reflectivity = material.m_reflectivity;
+	batched.metalness = material.m_metalness;
+	batched.fresnel = material.m_fresnel;
+	batched.shininess = material.m_shininess;
+	batched.emission = material.m_emission;
+}
+
+struct DrawArraysIndirectCommand
+{
+	GLuint count;
+	GLuint instance_count;
+	GLuint first;
+	GLuint base_instance;
+};
+
+// A 2D array view of a texture that is not a layer of a TextureArray, such
+// as a render target that has been assigned to a material, or zero if it is
+// not immutable, as views can only be made of immutable textures
+static GLuint createTextureView(GLuint texture)
+{
+	GLint immutable = 0, format = 0, levels = 0;
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_IMMUTABLE_FORMAT, &immutable);
+	if(!immutable)
+		return 0;
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+	glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_IMMUTABLE_LEVELS, &levels);
+	GLuint view;
+	glGenTextures(1, &view);
+	glTextureView(view, GL_TEXTURE_2D_ARRAY, texture, format, 0, levels, 0, 1);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, view);
+	setMaterialTextureSampling(GL_TEXTURE_2D_ARRAY);
+	return view;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Build the batched draw state of a model (see BatchedDrawState in
+// Model.h) from its groups and textures
+///////////////////////////////////////////////////////////////////////////
+static void batchModel(const Model* model)
+{
+	const DrawState& state = model->m_draw_state;
+	BatchedDrawState& batched = model->m_draw_state.m_batched;
+	const size_t number_of_materials = model->m_materials.size();
+	batched.m_grouping = state.m_grouping;
+	batched.m_texture_ids = materialTextureIds(model);
+	if(!batched.m_textures.empty())
+	{
+		glDeleteTextures(GLsizei(batched.m_textures.size()), batched.m_textures.data());
+		batched.m_textures.clear();
+	}
+
+	// The layer of each texture of each material, and the texture to bind
+	// for it. Textures are bound as the arrays they are layers of, so
+	// nothing is copied. Other textures get a view each.
+	std::vector<int32_t> layers(batched.m_texture_ids.size(), -1);
+	std::vector<GLuint> bindings(batched.m_texture_ids.size(), 0);
+	std::map<GLuint, GLuint> views;
+	for(size_t i = 0; i < number_of_materials; i++)
+	{
+		for(int j = 0; j < number_of_material_textures; j++)
+		{
+			const Texture& texture = model->m_materials[i].*material_textures[j];
+			const size_t index = i * number_of_material_textures + material_texture_units[j];
+			if(!texture.valid)
+				continue;
+			if(texture.image && texture.image->array && texture.image->gl_id == texture.gl_id)
+			{
+				layers[index] = texture.image->layer;
+				bindings[index] = texture.image->array->gl_id;
+				continue;
+			}
+			auto view = views.find(texture.gl_id);
+			if(view == views.end())
+			{
+				view = views.insert(std::make_pair(texture.gl_id, createTextureView(texture.gl_id))).first;
+				if(view->second != 0)
+				{
+					batched.m_textures.push_back(view->second);
+				}
+				else
+				{
+					std::cout << "Texture " << texture.gl_id << " of " << model->m_filename
+					          << " is not immutable, so it can not be drawn in a batch.\n";
+				}
+			}
+			if(view->second != 0)
+			{
+				layers[index] = 0;
+				bindings[index] = view->second;
+			}
+		}
+	}
+
+	batched.m_materials.resize(number_of_materials * sizeof(BatchedMaterial));
+	for(size_t i = 0; i < number_of_materials; i++)
+	{
+		BatchedMaterial material = {};
+		setBatchedMaterial(material, model->m_materials[i]);
+		std::copy(&layers[i * number_of_material_textures], &layers[(i + 1) * number_of_material_textures],
+		          material.texture_layer);
+		memcpy(&batched.m_materials[i * sizeof(BatchedMaterial)], &material, sizeof(material));
+	}
+	if(batched.m_materials_ssbo == 0)
+		glGenBuffers(1, &batched.m_materials_ssbo);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, batched.m_materials_ssbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(batched.m_materials.size(), sizeof(BatchedMaterial)),
+	             batched.m_materials.empty() ? nullptr : batched.m_materials.data(), GL_DYNAMIC_DRAW);
+
+	// A command per vertex range, in the order of the groups. A batch ends
+	// where a group needs another texture on a unit than the batch has.
+	std::vector<DrawArraysIndirectCommand> commands;
+	batched.m_batches.clear();
+	for(const MaterialGroup& group : state.m_groups)
+	{
+		const GLuint* textures = &bindings[group.m_material_idx * number_of_material_textures];
+		bool fits = !batched.m_batches.empty();
+		for(int unit = 0; fits && unit < number_of_material_textures; unit++)
+		{
+			const GLuint batch_texture = batched.m_batches.back().m_textures[unit];
+			fits = textures[unit] == 0 || batch_texture == 0 || batch_texture == textures[unit];
+		}
+		if(!fits)
+		{
+			IndirectBatch batch = {};
+			batch.m_first_command = uint32_t(commands.size());
+			batched.m_batches.push_back(batch);
+		}
+		IndirectBatch& batch = batched.m_batches.back();
+		for(int unit = 0; unit < number_of_material_textures; unit++)
+		{
+			if(textures[unit] != 0)
+				batch.m_textures[unit] = textures[unit];
+		}
+		for(uint32_t range = group.m_first_range; range < group.m_first_range + group.m_number_of_ranges; range++)
+		{
+			DrawArraysIndirectCommand command = { GLuint(state.m_counts[range]), 1, GLuint(state.m_firsts[range]),
+				                                  group.m_material_idx };
+			commands.push_back(command);
+			batch.m_number_of_commands++;
+		}
+	}
+	if(batched.m_commands_bo == 0)
+		glGenBuffers(1, &batched.m_commands_bo);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, batched.m_commands_bo);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawArraysIndirectCommand),
+	             commands.empty() ? nullptr : commands.data(), GL_STATIC_DRAW);
+
+	// The base instance of a command selects its material index
+	std::vector<int32_t> material_indices(std::max<size_t>(number_of_materials, 1));
+	for(size_t i = 0; i < material_indices.size(); i++)
+		material_indices[i] = int32_t(i);
+	glBindVertexArray(model->m_vaob);
+	if(batched.m_material_indices_bo == 0)
+		glGenBuffers(1, &batched.m_material_indices_bo);
+	glBindBuffer(GL_ARRAY_BUFFER, batched.m_material_indices_bo);
+	glBufferData(GL_ARRAY_BUFFER, material_indices.size() * sizeof(int32_t), material_indices.data(),
+	             GL_STATIC_DRAW);
+	glVertexAttribIPointer(material_index_location, 1, GL_INT, 0, 0);
+	glVertexAttribDivisor(material_index_location, 1);
+	glEnableVertexAttribArray(material_index_location);
+}
+
+static void renderBatched(const Model* model)
+{
+	const DrawState& state = model->m_draw_state;
+	BatchedDrawState& batched = model->m_draw_state.m_batched;
+	if(batched.m_grouping != state.m_grouping || batched.m_texture_ids != materialTextureIds(model)
+	   || batched.m_materials.size() != model->m_materials.size() * sizeof(BatchedMaterial))
+	{
+		batchModel(model);
+	}
+	else
+	{
+		// Upload the materials that have changed
+		bool bound = false;
+		for(size_t i = 0; i < model->m_materials.size(); i++)
+		{
+			uint8_t* current = &batched.m_materials[i * sizeof(BatchedMaterial)];
+			BatchedMaterial material;
+			memcpy(&material, current, sizeof(material));
+			setBatchedMaterial(material, model->m_materials[i]);
+			if(memcmp(current, &material, sizeof(material)) == 0)
+				continue;
+			memcpy(current, &material, sizeof(material));
+			if(!bound)
+			{
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, batched.m_materials_ssbo);
+				bound = true;
+			}
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * sizeof(material), sizeof(material), &material);
+		}
+	}
+
+	glBindVertexArray(model->m_vaob);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, material_block_binding, batched.m_materials_ssbo);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, batched.m_commands_bo);
+	GLuint bound_textures[number_of_material_textures] = {};
+	for(const IndirectBatch& batch : batched.m_batches)
+	{
+		for(int unit = 0; unit < number_of_material_textures; unit++)
+		{
+			if(batch.m_textures[unit] != 0 && bound_textures[unit] != batch.m_textures[unit])
+			{
+				glBindTextures(unit, 1, &batch.m_textures[unit]);
+				bound_textures[unit] = batch.m_textures[unit];
+			}
+		}
+		glMultiDrawArraysIndirect(
+		    GL_TRIANGLES, reinterpret_cast<const void*>(batch.m_first_command * sizeof(DrawArraysIndirectCommand)),
+		    GLsizei(batch.m_number_of_commands), 0);
+	}
+}
+
 void render(const Model* model, const bool submitMaterials)
 {
+	updateGroups(model);
+	const DrawState& state = model->m_draw_state;
 	glBindVertexArray(model->m_vaob);
-	for(auto& mesh : model->m_meshes)
-	{
-		if(submitMaterials)
-		{
-			const Material& material = model->m_materials[mesh.m_material_idx];
-
-			bool has_color_texture = material.m_color_texture.valid;
-			bool has_reflectivity_texture = material.m_reflectivity_texture.valid;
-			bool has_metalness_texture = material.m_metalness_texture.valid;
-			bool has_fresnel_texture = material.m_fresnel_texture.valid;
-			bool has_shininess_texture = material.m_shininess_texture.valid;
-			bool has_emission_texture = material.m_emission_texture.valid;
-			if(has_color_texture)
-				glBindTextures(0, 1, &material.m_color_texture.gl_id);
-			if(has_reflectivity_texture)
-				glBindTextures(1, 1, &material.m_reflectivity_texture.gl_id);
-			if(has_metalness_texture)
-				glBindTextures(2, 1, &material.m_metalness_texture.gl_id);
-			if(has_fresnel_texture)
-				glBindTextures(3, 1, &material.m_fresnel_texture.gl_id);
-			if(has_shininess_texture)
-				glBindTextures(4, 1, &material.m_shininess_texture.gl_id);
-			if(has_emission_texture)
-				glBindTextures(5, 1, &material.m_emission_texture.gl_id);
-			GLint current_program = 0;
-			glGetIntegerv(GL_CURRENT_PROGRAM, &current_program);
-			glUniform1i(glGetUniformLocation(current_program, "has_color_texture"), has_color_texture);
-			glUniform1i(glGetUniformLocation(current_program, "has_diffuse_texture"),
-			            has_color_texture ? 1 : 0); // FIXME
-			glUniform1i(glGetUniformLocation(current_program, "has_reflectivity_texture"),
-			            has_reflectivity_texture);
-			glUniform1i(glGetUniformLocation(current_program, "has_metalness_texture"), has_metalness_texture);
-			glUniform1i(glGetUniformLocation(current_program, "has_fresnel_texture"), has_fresnel_texture);
-			glUniform1i(glGetUniformLocation(current_program, "has_shininess_texture"), has_shininess_texture);
-			glUniform1i(glGetUniformLocation(current_program, "has_emission_texture"),
-			            has_emission_texture ? 1 : 0);
-			glUniform3fv(glGetUniformLocation(current_program, "material_color"), 1, &material.m_color.x);
-			glUniform3fv(glGetUniformLocation(current_program, "material_diffuse_color"), 1,
-			             &material.m_color.x); //FIXME: Compatibility with old shading model of lab3.
-			glUniform3fv(glGetUniformLocation(current_program, "material_emissive_color"), 1,
-			             &material.m_color.x); //FIXME: Compatibility with old shading model of lab3.
-			glUniform1i(glGetUniformLocation(current_program, "has_diffuse_texture"),
-			            has_color_texture); //FIXME: Compatibility with old shading model of lab3.
-			glUniform1fv(glGetUniformLocation(current_program, "material_reflectivity"), 1,
-			             &material.m_reflectivity);
-			glUniform1fv(glGetUniformLocation(current_program, "material_metalness"), 1,
-			             &material.m_metalness);
-			glUniform1fv(glGetUniformLocation(current_program, "material_fresnel"), 1, &material.m_fresnel);
-			glUniform1fv(glGetUniformLocation(current_program, "material_shininess"), 1,
-			             &material.m_shininess);
-			glUniform1fv(glGetUniformLocation(current_program, "material_emission"), 1, &material.m_emission);
-		}
-		glDrawArrays(GL_TRIANGLES, mesh.m_start_index, (GLsizei)mesh.m_number_of_vertices);
+	if(!submitMaterials)
+	{
+		glMultiDrawArrays(GL_TRIANGLES, state.m_firsts.data(), state.m_counts.data(), GLsizei(state.m_firsts.size()));
+		return;
+	}
+
+	GLint current_program = 0;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &current_program);
+	if(GLEW_VERSION_4_3)
+	{
+		const GLuint buffer_index = glGetProgramResourceIndex(current_program, GL_SHADER_STORAGE_BLOCK, "Materials");
+		if(buffer_index != GL_INVALID_INDEX)
+		{
+			glShaderStorageBlockBinding(current_program, buffer_index, material_block_binding);
+			renderBatched(model);
+			return;
+		}
+	}
+
+	updateMaterialBlocks(model);
+	const GLuint block_index = glGetUniformBlockIndex(current_program, "Material");
+	const bool has_block = block_index != GL_INVALID_INDEX;
+	MaterialUniforms uniforms;
+	if(has_block)
+		glUniformBlockBinding(current_program, block_index, material_block_binding);
+	else
+		uniforms = getMaterialUniforms(current_program);
+
+	// The textures this call has bound, to not bind them again
+	GLuint bound_textures[number_of_material_textures] = {};
+	for(const MaterialGroup& group : state.m_groups)
+	{
+		const Material& material = model->m_materials[group.m_material_idx];
+		for(int i = 0; i < number_of_material_textures; i++)
+		{
+			const Texture& texture = material.*material_textures[i];
+			const GLuint unit = material_texture_units[i];
+			if(texture.valid && bound_textures[unit] != texture.gl_id)
+			{
+				glBindTextures(unit, 1, &texture.gl_id);
+				bound_textures[unit] = texture.gl_id;
+			}
+		}
+		if(has_block)
+		{
+			glBindBufferRange(GL_UNIFORM_BUFFER, material_block_binding, state.m_materials_ubo,
+			                  GLintptr(group.m_material_idx) * state.m_material_slot_size,
+			                  state.m_material_slot_size);
+		}
+		else
+		{
+			MaterialBlock block;
+			memcpy(&block, &state.m_material_blocks[group.m_material_idx * sizeof(MaterialBlock)], sizeof(block));
+			setMaterialUniforms(uniforms, block);
+		}
+		if(group.m_number_of_ranges == 1)
+		{
+			glDrawArrays(GL_TRIANGLES, state.m_firsts[group.m_first_range], state.m_counts[group.m_first_range]);
+		}
+		else
+		{
+			glMultiDrawArrays(GL_TRIANGLES, &state.m_firsts[group.m_first_range],
+			                  &state.m_counts[group.m_first_range], GLsizei(group.m_number_of_ranges));
+		}
 	}
 }
 } // namespace labhelper
@@ -1,20 +1,92 @@
 #pragma once
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <glm/glm.hpp>
 
 namespace labhelper
 {
+//////////////////////////////////////////////////////////////////////////////
+// An image with all its mip levels, block compressed for the GPU (see
+// loadCompressedTexture() in ModelCache.h)
+//////////////////////////////////////////////////////////////////////////////
+struct CompressedTexture
+{
+	// The GL internal format
+	uint32_t format = 0;
+	int width = 0, height = 0;
+	// From the full size down to 1x1
+	std::vector<std::vector<uint8_t>> levels;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// The decoded pixels and GL texture of an image file. Textures that load the
+// same file with the same number of components share one of these through
+// a process-wide registry, which only counts the Textures that reference
+// it, so the image is freed along with the last of them. Images that are
+// uploaded are not decoded into pixels at all unless
+// setKeepTextureData(true) has been called, as the GPU gets compressed mip
+// levels from the texture cache instead.
+//
+// On the GPU, images of the same size and format that are uploaded together
+// are the layers of one GL_TEXTURE_2D_ARRAY, which is the only copy of
+// their pixels. gl_id is a GL_TEXTURE_2D view of the layer of an image, and
+// render() can draw all materials whose textures share arrays at once.
+//////////////////////////////////////////////////////////////////////////////
+struct TextureArray
+{
+	uint32_t gl_id = 0;
+	~TextureArray();
+};
+
+struct TextureImage
+{
+	std::mutex mutex;
+	int width = 0, height = 0;
+	uint8_t* data = nullptr;
+	// Only held from decoding until the image has been uploaded
+	CompressedTexture compressed;
+	uint32_t gl_id = 0;
+	// Shared by the images in it, and freed with the last of them
+	std::shared_ptr<TextureArray> array;
+	int layer = 0;
+	~TextureImage();
+};
+
+// Whether to also decode the pixels of textures that are uploaded, for code
+// that samples them on the CPU. Set it before loading models.
+void setKeepTextureData(bool keep);
+
 struct Texture
 {
 	bool valid = false;
 	uint32_t gl_id = 0;
 	std::string filename;
 	std::string directory;
-	int width, height;
-	uint8_t* data = nullptr;
-	bool load(const std::string& directory, const std::string& filename, int nof_components);
+	int width = 0, height = 0;
+	int components = 0;
+	std::shared_ptr<TextureImage> image;
+	bool load(const std::string& directory, const std::string& filename, int nof_components, bool upload_to_gpu = true);
+	// The steps of load(), for splitting it over threads: setFile() only
+	// names the image, decode() reads what is needed that has not been read
+	// yet: the compressed mip levels if it is going to be uploaded, and the
+	// pixels if it is not or they are kept. upload() creates the GL texture
+	// unless it already exists, in an array of its own (see
+	// uploadTextures()).
+	void setFile(const std::string& directory, const std::string& filename, int nof_components);
+	bool decode(bool upload_to_gpu = true);
+	void upload();
+	// The pixels, or null if they have been freed after uploading
+	const uint8_t* data() const
+	{
+		return image ? image->data : nullptr;
+	}
 };
+
+// Upload the decoded images of several textures, putting the images that
+// have the same size and format in the same texture array
+void uploadTextures(const std::vector<Texture*>& textures);
 //////////////////////////////////////////////////////////////////////////////
 // This material class implements a subset of the suggested PBR extension
 // to the OBJ/MTL format, explained at:
@@ -41,6 +113,12 @@ struct Material
 	Texture m_emission_texture;
 };
 
+// The textures of a material, to handle them all alike, and the number of
+// components each is loaded with
+const int number_of_material_textures = 6;
+extern Texture Material::*const material_textures[number_of_material_textures];
+extern const int material_texture_components[number_of_material_textures];
+
 struct Mesh
 {
 	std::string m_name;
@@ -50,6 +128,71 @@ struct Mesh
 	uint32_t m_number_of_vertices;
 };
 
+// Meshes that share a material, which render() draws together
+struct MaterialGroup
+{
+	uint32_t m_material_idx;
+	// The vertex ranges of the meshes, in DrawState::m_firsts and m_counts
+	uint32_t m_first_range;
+	uint32_t m_number_of_ranges;
+};
+
+// A glMultiDrawArraysIndirect() of consecutive commands, and the textures
+// to bind to units 0 to 5 for it (zero where any will do)
+struct IndirectBatch
+{
+	uint32_t m_first_command;
+	uint32_t m_number_of_commands;
+	uint32_t m_textures[number_of_material_textures];
+};
+
+// What render() keeps of a model for programs that take the materials from
+// the Materials buffer. There is a draw command per vertex range, with the
+// material index as its base instance. The textures are bound as the
+// TextureArrays that they are layers of, so a model whose textures of each
+// unit are in one array, as they are when they have the same size and
+// format and were loaded with the model, is a single draw. The draw is split
+// where the array of a unit changes. Textures that are not in an array, such
+// as render targets assigned to materials, get a 2D array view of their own
+// if they are immutable, and are left out otherwise.
+struct BatchedDrawState
+{
+	// The grouping and the texture of each unit of each material that this
+	// was built for
+	uint32_t m_grouping = 0;
+	std::vector<uint32_t> m_texture_ids;
+	std::vector<IndirectBatch> m_batches;
+	// The materials as they are in the material buffer
+	std::vector<uint8_t> m_materials;
+	uint32_t m_materials_ssbo = 0;
+	uint32_t m_commands_bo = 0;
+	// 0 to the number of materials, the per instance material index
+	uint32_t m_material_indices_bo = 0;
+	// The views of textures that are not in arrays
+	std::vector<uint32_t> m_textures;
+};
+
+// What render() keeps of a model between frames. The meshes are grouped by
+// material, with the ranges of adjacent meshes merged and the groups sorted
+// by their textures, and the materials are packed into a uniform buffer with
+// a slot per material. Both are redone when render() finds that a mesh has
+// changed material or that a material has changed.
+struct DrawState
+{
+	std::vector<MaterialGroup> m_groups;
+	std::vector<int32_t> m_firsts;
+	std::vector<int32_t> m_counts;
+	// The material of each mesh when the meshes were grouped
+	std::vector<uint32_t> m_grouped_material_indices;
+	// The materials as they are in the uniform buffer
+	std::vector<uint8_t> m_material_blocks;
+	uint32_t m_materials_ubo = 0;
+	uint32_t m_material_slot_size = 0;
+	// Counts the times the meshes have been grouped
+	uint32_t m_grouping = 0;
+	BatchedDrawState m_batched;
+};
+
 class Model
 {
 public:
@@ -66,16 +209,78 @@ public:
 	std::vector<glm::vec3> m_positions;
 	std::vector<glm::vec3> m_normals;
 	std::vector<glm::vec2> m_texture_coordinates;
-	// Buffers on GPU
-	uint32_t m_positions_bo;
-	uint32_t m_normals_bo;
-	uint32_t m_texture_coordinates_bo;
+	// Buffers on GPU (zero if the model was loaded without uploading)
+	uint32_t m_positions_bo = 0;
+	uint32_t m_normals_bo = 0;
+	uint32_t m_texture_coordinates_bo = 0;
 	// Vertex Array Object
-	uint32_t m_vaob;
+	uint32_t m_vaob = 0;
+	// Updated by render()
+	mutable DrawState m_draw_state;
 };
 
-Model* loadModelFromOBJ(std::string filename);
+// Set upload_to_gpu to false to only keep the model on the CPU, e.g. in
+// processes that have no GL context.
+Model* loadModelFromOBJ(std::string filename, bool upload_to_gpu = true);
+// The steps of loadModelFromOBJ(), for loading several assets at once (see
+// AssetLoader.h). readModelFromOBJ() reads the geometry and materials and
+// names the textures without decoding them. uploadModel() creates the GL
+// buffers and textures, on the thread that has the GL context.
+Model* readModelFromOBJ(std::string filename);
+void uploadModel(Model* model);
 void saveModelToOBJ(Model* model, std::string filename);
 void freeModel(Model* model);
+// Draw a model with the current program. The materials are submitted as the
+// uniform block
+//
+//	layout(std140) uniform Material
+//	{
+//		vec3 material_color;
+//		float material_reflectivity;
+//		float material_metalness;
+//		float material_fresnel;
+//		float material_shininess;
+//		float material_emission;
+//		int has_color_texture;
+//		int has_reflectivity_texture;
+//		int has_metalness_texture;
+//		int has_fresnel_texture;
+//		int has_shininess_texture;
+//		int has_emission_texture;
+//	};
+//
+// bound to material_block_binding, or as separate uniforms with the same
+// names to programs without the block. The textures go to units 0 to 5, in
+// the order of the has_*_texture flags.
+//
+// Programs that instead declare the shader storage block
+//
+//	struct MaterialData
+//	{
+//		vec3 color;
+//		float reflectivity;
+//		float metalness;
+//		float fresnel;
+//		float shininess;
+//		float emission;
+//		// The layer of each texture, or -1 where there is none
+//		int color_layer;
+//		int reflectivity_layer;
+//		int metalness_layer;
+//		int fresnel_layer;
+//		int shininess_layer;
+//		int emission_layer;
+//	};
+//	layout(std430) readonly buffer Materials
+//	{
+//		MaterialData materials[];
+//	};
+//
+// get a whole model in as few glMultiDrawArraysIndirect() calls as its
+// textures allow (see BatchedDrawState), which needs OpenGL 4.3. They take
+// the index into materials from the per instance integer attribute at
+// material_index_location, and sample the textures as sampler2DArray.
+const uint32_t material_block_binding = 0;
+const uint32_t material_index_location = 3;
 void render(const Model* model, const bool submitMaterials = true);
 } // namespace labhelper
\ No newline at end of file
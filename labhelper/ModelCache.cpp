@@ -0,0 +1,711 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include "ModelCache.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <GL/glew.h>
+#include <stb_image.h>
+#define STB_DXT_IMPLEMENTATION
+// The default of this version of stb_dxt takes the wrong number of arguments
+#define STBD_MEMSET memset
+#include <stb_dxt.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace labhelper
+{
+// Bump when the layout changes, to rebuild all caches
+static const char cache_magic[8] = { 'L', 'H', 'M', 'O', 'D', 'E', 'L', '1' };
+static const size_t cache_alignment = 64;
+
+///////////////////////////////////////////////////////////////////////////////
+// Size and modification time of a file, to tell whether it has changed
+///////////////////////////////////////////////////////////////////////////////
+struct FileStamp
+{
+	// Files that do not exist have the largest size
+	uint64_t size = ~uint64_t(0);
+	int64_t modified = 0;
+	bool operator==(const FileStamp& other) const
+	{
+		return size == other.size && modified == other.modified;
+	}
+};
+
+static bool fileStamp(const std::string& filename, FileStamp& stamp)
+{
+#ifdef _WIN32
+	struct _stat64 s;
+	if(_stat64(filename.c_str(), &s) != 0)
+		return false;
+#else
+	struct stat s;
+	if(stat(filename.c_str(), &s) != 0)
+		return false;
+#endif
+	stamp.size = uint64_t(s.st_size);
+	stamp.modified = int64_t(s.st_mtime);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A read only memory mapping of a whole file
+///////////////////////////////////////////////////////////////////////////////
+class MappedFile
+{
+public:
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+
+	bool open(const std::string& filename)
+	{
+#ifdef _WIN32
+		file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		                   FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if(file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER file_size;
+		if(!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+			return false;
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if(mapping == nullptr)
+			return false;
+		data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		size = size_t(file_size.QuadPart);
+#else
+		fd = ::open(filename.c_str(), O_RDONLY);
+		if(fd < 0)
+			return false;
+		struct stat s;
+		if(fstat(fd, &s) != 0 || s.st_size == 0)
+			return false;
+		void* mapped = mmap(nullptr, size_t(s.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		if(mapped == MAP_FAILED)
+			return false;
+		data = static_cast<const uint8_t*>(mapped);
+		size = size_t(s.st_size);
+#endif
+		return data != nullptr;
+	}
+
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if(data != nullptr)
+			UnmapViewOfFile(data);
+		if(mapping != nullptr)
+			CloseHandle(mapping);
+		if(file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+#else
+		if(data != nullptr)
+			munmap(const_cast<uint8_t*>(data), size);
+		if(fd >= 0)
+			close(fd);
+#endif
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#else
+	int fd = -1;
+#endif
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Reads values out of the mapped cache, and remembers if it ran past the
+// end of it
+///////////////////////////////////////////////////////////////////////////////
+struct CacheReader
+{
+	const uint8_t* data;
+	size_t size;
+	size_t position = 0;
+	bool ok = true;
+
+	CacheReader(const uint8_t* data, size_t size) : data(data), size(size)
+	{
+	}
+	const uint8_t* bytes(size_t n)
+	{
+		if(!ok || n > size - position)
+		{
+			ok = false;
+			return nullptr;
+		}
+		const uint8_t* result = data + position;
+		position += n;
+		return result;
+	}
+	template<typename T>
+	T value()
+	{
+		T result = T();
+		const uint8_t* p = bytes(sizeof(T));
+		if(p != nullptr)
+			memcpy(&result, p, sizeof(T));
+		return result;
+	}
+	std::string string()
+	{
+		const uint32_t length = value<uint32_t>();
+		const uint8_t* p = bytes(length);
+		return p != nullptr ? std::string(reinterpret_cast<const char*>(p), length) : std::string();
+	}
+	const uint8_t* alignedBytes(size_t n)
+	{
+		position = (position + cache_alignment - 1) / cache_alignment * cache_alignment;
+		if(position > size)
+		{
+			ok = false;
+			return nullptr;
+		}
+		return bytes(n);
+	}
+};
+
+struct CacheWriter
+{
+	std::vector<uint8_t> data;
+
+	void bytes(const void* p, size_t n)
+	{
+		data.insert(data.end(), static_cast<const uint8_t*>(p), static_cast<const uint8_t*>(p) + n);
+	}
+	template<typename T>
+	void value(const T& v)
+	{
+		bytes(&v, sizeof(T));
+	}
+	void string(const std::string& s)
+	{
+		value(uint32_t(s.size()));
+		bytes(s.data(), s.size());
+	}
+	void alignedBytes(const void* p, size_t n)
+	{
+		data.resize((data.size() + cache_alignment - 1) / cache_alignment * cache_alignment, 0);
+		bytes(p, n);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Write a cache to a temporary file first and then rename it, so that other
+// processes loading the same file never see half a cache. The temporary
+// name is unique to this process and call, as several processes (e.g. the
+// local workers of a coordinator) may write the same cache at once.
+///////////////////////////////////////////////////////////////////////////////
+static void writeCache(const CacheWriter& writer, const std::string& cache_filename)
+{
+	static std::atomic<unsigned> counter(0);
+#ifdef _WIN32
+	const unsigned long pid = GetCurrentProcessId();
+#else
+	const unsigned long pid = getpid();
+#endif
+	const std::string temporary_filename =
+	    cache_filename + "." + std::to_string(pid) + "." + std::to_string(counter++) + ".tmp";
+	{
+		std::ofstream file(temporary_filename, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(writer.data.data()), writer.data.size());
+		file.close();
+		if(!file)
+		{
+			std::cout << "(could not write " << cache_filename << ")";
+			std::remove(temporary_filename.c_str());
+			return;
+		}
+	}
+#ifdef _WIN32
+	// Replacing fails while another process has the old cache mapped, in
+	// which case the old one stays
+	const bool moved =
+	    MoveFileExA(temporary_filename.c_str(), cache_filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	const bool moved = std::rename(temporary_filename.c_str(), cache_filename.c_str()) == 0;
+#endif
+	if(!moved)
+	{
+		std::remove(temporary_filename.c_str());
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The material libraries an OBJ file uses
+///////////////////////////////////////////////////////////////////////////////
+static std::vector<std::string> materialLibraries(const std::string& path)
+{
+	std::vector<std::string> libraries;
+	std::ifstream obj(path);
+	std::string line;
+	while(std::getline(obj, line))
+	{
+		if(line.compare(0, 7, "mtllib ") == 0)
+		{
+			std::string library = line.substr(7);
+			while(!library.empty() && (library.back() == '\r' || library.back() == ' '))
+				library.pop_back();
+			libraries.push_back(library);
+		}
+	}
+	return libraries;
+}
+
+bool loadModelFromCache(const std::string& path, const std::string& directory, Model* model)
+{
+	MappedFile file;
+	if(!file.open(path + ".cache"))
+	{
+		return false;
+	}
+	CacheReader reader(file.data, file.size);
+	const uint8_t* magic = reader.bytes(sizeof(cache_magic));
+	if(magic == nullptr || memcmp(magic, cache_magic, sizeof(cache_magic)) != 0)
+	{
+		return false;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Check that the sources have not changed since the cache was written
+	///////////////////////////////////////////////////////////////////////////
+	const uint32_t number_of_sources = reader.value<uint32_t>();
+	for(uint32_t i = 0; i < number_of_sources && reader.ok; i++)
+	{
+		const std::string source = reader.string();
+		FileStamp cached;
+		cached.size = reader.value<uint64_t>();
+		cached.modified = reader.value<int64_t>();
+		FileStamp current;
+		fileStamp(i == 0 ? path : directory + source, current);
+		if(!(current == cached))
+		{
+			return false;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Materials and meshes
+	///////////////////////////////////////////////////////////////////////////
+	std::vector<Material> materials(reader.value<uint32_t>());
+	std::vector<std::string> texture_filenames(materials.size() * number_of_material_textures);
+	for(size_t i = 0; i < materials.size() && reader.ok; i++)
+	{
+		Material& m = materials[i];
+		m.m_name = reader.string();
+		m.m_color.x = reader.value<float>();
+		m.m_color.y = reader.value<float>();
+		m.m_color.z = reader.value<float>();
+		m.m_reflectivity = reader.value<float>();
+		m.m_shininess = reader.value<float>();
+		m.m_metalness = reader.value<float>();
+		m.m_fresnel = reader.value<float>();
+		m.m_emission = reader.value<float>();
+		m.m_transparency = reader.value<float>();
+		for(int slot = 0; slot < number_of_material_textures; slot++)
+			texture_filenames[i * number_of_material_textures + slot] = reader.string();
+	}
+	std::vector<Mesh> meshes(reader.value<uint32_t>());
+	for(size_t i = 0; i < meshes.size() && reader.ok; i++)
+	{
+		meshes[i].m_name = reader.string();
+		meshes[i].m_material_idx = reader.value<uint32_t>();
+		meshes[i].m_start_index = reader.value<uint32_t>();
+		meshes[i].m_number_of_vertices = reader.value<uint32_t>();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Vertex arrays
+	///////////////////////////////////////////////////////////////////////////
+	const uint64_t number_of_vertices = reader.value<uint64_t>();
+	if(!reader.ok || number_of_vertices > file.size)
+	{
+		return false;
+	}
+	const uint8_t* positions = reader.alignedBytes(number_of_vertices * sizeof(glm::vec3));
+	const uint8_t* normals = reader.alignedBytes(number_of_vertices * sizeof(glm::vec3));
+	const uint8_t* texture_coordinates = reader.alignedBytes(number_of_vertices * sizeof(glm::vec2));
+	if(!reader.ok)
+	{
+		return false;
+	}
+	model->m_positions.resize(number_of_vertices);
+	model->m_normals.resize(number_of_vertices);
+	model->m_texture_coordinates.resize(number_of_vertices);
+	if(number_of_vertices > 0)
+	{
+		memcpy(model->m_positions.data(), positions, number_of_vertices * sizeof(glm::vec3));
+		memcpy(model->m_normals.data(), normals, number_of_vertices * sizeof(glm::vec3));
+		memcpy(model->m_texture_coordinates.data(), texture_coordinates, number_of_vertices * sizeof(glm::vec2));
+	}
+
+	// Textures are still decoded from their image files, later
+	for(size_t i = 0; i < materials.size(); i++)
+	{
+		for(int slot = 0; slot < number_of_material_textures; slot++)
+		{
+			const std::string& texture = texture_filenames[i * number_of_material_textures + slot];
+			if(!texture.empty())
+				(materials[i].*material_textures[slot]).setFile(directory, texture, material_texture_components[slot]);
+		}
+	}
+	model->m_materials.swap(materials);
+	model->m_meshes.swap(meshes);
+	return true;
+}
+
+void saveModelToCache(const Model* model, const std::string& path, const std::string& directory)
+{
+	CacheWriter writer;
+	writer.bytes(cache_magic, sizeof(cache_magic));
+
+	// The OBJ file comes first, then its material libraries
+	std::vector<std::string> sources = materialLibraries(path);
+	sources.insert(sources.begin(), path);
+	writer.value(uint32_t(sources.size()));
+	for(size_t i = 0; i < sources.size(); i++)
+	{
+		FileStamp stamp;
+		fileStamp(i == 0 ? path : directory + sources[i], stamp);
+		writer.string(sources[i]);
+		writer.value(stamp.size);
+		writer.value(stamp.modified);
+	}
+
+	writer.value(uint32_t(model->m_materials.size()));
+	for(const Material& m : model->m_materials)
+	{
+		writer.string(m.m_name);
+		writer.value(m.m_color.x);
+		writer.value(m.m_color.y);
+		writer.value(m.m_color.z);
+		writer.value(m.m_reflectivity);
+		writer.value(m.m_shininess);
+		writer.value(m.m_metalness);
+		writer.value(m.m_fresnel);
+		writer.value(m.m_emission);
+		writer.value(m.m_transparency);
+		for(int slot = 0; slot < number_of_material_textures; slot++)
+		{
+			const Texture& texture = m.*material_textures[slot];
+			writer.string(texture.valid ? texture.filename : std::string());
+		}
+	}
+	writer.value(uint32_t(model->m_meshes.size()));
+	for(const Mesh& mesh : model->m_meshes)
+	{
+		writer.string(mesh.m_name);
+		writer.value(mesh.m_material_idx);
+		writer.value(mesh.m_start_index);
+		writer.value(mesh.m_number_of_vertices);
+	}
+	const uint64_t number_of_vertices = model->m_positions.size();
+	writer.value(number_of_vertices);
+	writer.alignedBytes(model->m_positions.data(), number_of_vertices * sizeof(glm::vec3));
+	writer.alignedBytes(model->m_normals.data(), number_of_vertices * sizeof(glm::vec3));
+	writer.alignedBytes(model->m_texture_coordinates.data(), number_of_vertices * sizeof(glm::vec2));
+
+	writeCache(writer, path + ".cache");
+}
+///////////////////////////////////////////////////////////////////////////////
+// Compressed textures
+///////////////////////////////////////////////////////////////////////////////
+// Bump when the layout or the compression changes
+static const char texture_cache_magic[8] = { 'L', 'H', 'T', 'E', 'X', 'T', 'R', '1' };
+
+static std::string textureCacheFilename(const std::string& path, int components)
+{
+	return path + "." + std::to_string(components) + ".cache";
+}
+
+// Runs f(begin, end) on ranges that split [0, n) between all hardware threads
+static void parallelRanges(int n, const std::function<void(int, int)>& f)
+{
+	const int number_of_threads = std::max(1, std::min(n, int(std::thread::hardware_concurrency())));
+	std::vector<std::thread> threads;
+	for(int t = 1; t < number_of_threads; t++)
+		threads.emplace_back([&f, n, t, number_of_threads]() {
+			f(n * t / number_of_threads, n * (t + 1) / number_of_threads);
+		});
+	f(0, n / number_of_threads);
+	for(auto& thread : threads)
+		thread.join();
+}
+
+static float srgbToLinear(uint8_t value)
+{
+	static const std::vector<float> table = []() {
+		std::vector<float> t(256);
+		for(int i = 0; i < 256; i++)
+		{
+			const float v = i / 255.0f;
+			t[i] = v <= 0.04045f ? v / 12.92f : powf((v + 0.055f) / 1.055f, 2.4f);
+		}
+		return t;
+	}();
+	return table[value];
+}
+
+static uint8_t linearToSrgb(float value)
+{
+	const float v = value <= 0.0031308f ? value * 12.92f : 1.055f * powf(value, 1.0f / 2.4f) - 0.055f;
+	return uint8_t(std::min(255.0f, std::max(0.0f, v * 255.0f + 0.5f)));
+}
+
+struct MipLevel
+{
+	int width, height;
+	std::vector<uint8_t> pixels;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Halve a mip level with a box filter. Color is averaged in linear light
+// for sRGB images, and alpha and data channels as they are.
+///////////////////////////////////////////////////////////////////////////////
+static MipLevel downsample(const MipLevel& source, int components, bool srgb)
+{
+	MipLevel level;
+	level.width = std::max(1, source.width / 2);
+	level.height = std::max(1, source.height / 2);
+	level.pixels.resize(size_t(level.width) * level.height * components);
+	const int color_components = srgb ? std::min(components, 3) : 0;
+	parallelRanges(level.height, [&](int begin, int end) {
+		for(int y = begin; y < end; y++)
+		{
+			const int y0 = std::min(2 * y, source.height - 1), y1 = std::min(2 * y + 1, source.height - 1);
+			for(int x = 0; x < level.width; x++)
+			{
+				const int x0 = std::min(2 * x, source.width - 1), x1 = std::min(2 * x + 1, source.width - 1);
+				const uint8_t* p[4] = { &source.pixels[(size_t(y0) * source.width + x0) * components],
+					                    &source.pixels[(size_t(y0) * source.width + x1) * components],
+					                    &source.pixels[(size_t(y1) * source.width + x0) * components],
+					                    &source.pixels[(size_t(y1) * source.width + x1) * components] };
+				uint8_t* out = &level.pixels[(size_t(y) * level.width + x) * components];
+				for(int c = 0; c < components; c++)
+				{
+					if(c < color_components)
+					{
+						out[c] = linearToSrgb(0.25f * (srgbToLinear(p[0][c]) + srgbToLinear(p[1][c])
+						                               + srgbToLinear(p[2][c]) + srgbToLinear(p[3][c])));
+					}
+					else
+					{
+						out[c] = uint8_t((p[0][c] + p[1][c] + p[2][c] + p[3][c] + 2) / 4);
+					}
+				}
+			}
+		}
+	});
+	return level;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The block compressed format for an image: BC1 for color without alpha,
+// BC3 for color with alpha, and BC4 and BC5 for one and two channels of data
+///////////////////////////////////////////////////////////////////////////////
+static uint32_t compressedFormat(const MipLevel& level, int components)
+{
+	switch(components)
+	{
+	case 1:
+		return GL_COMPRESSED_RED_RGTC1;
+	case 2:
+		return GL_COMPRESSED_RG_RGTC2;
+	case 3:
+		return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	case 4:
+		for(size_t i = 3; i < level.pixels.size(); i += 4)
+		{
+			if(level.pixels[i] != 255)
+				return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		}
+		return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	}
+	return 0;
+}
+
+static size_t blockSize(uint32_t format)
+{
+	return format == GL_COMPRESSED_RED_RGTC1 || format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? 8 : 16;
+}
+
+static std::vector<uint8_t> compress(const MipLevel& level, int components, uint32_t format)
+{
+	// stb_dxt builds its tables on the first call, which must not race
+	static std::once_flag initialized;
+	std::call_once(initialized, []() {
+		uint8_t block[16], pixels[64] = {};
+		stb_compress_dxt_block(block, pixels, 1, STB_DXT_NORMAL);
+	});
+
+	const int blocks_x = (level.width + 3) / 4, blocks_y = (level.height + 3) / 4;
+	const size_t block_size = blockSize(format);
+	std::vector<uint8_t> blocks(size_t(blocks_x) * blocks_y * block_size);
+	parallelRanges(blocks_y, [&](int begin, int end) {
+		for(int by = begin; by < end; by++)
+		{
+			for(int bx = 0; bx < blocks_x; bx++)
+			{
+				// Gather the block as RGBA for BC1 and BC3, and as it is for
+				// BC4 and BC5, repeating the edges of levels smaller than it
+				uint8_t pixels[64];
+				const int stride = components <= 2 ? components : 4;
+				for(int i = 0; i < 16; i++)
+				{
+					const int x = std::min(bx * 4 + i % 4, level.width - 1);
+					const int y = std::min(by * 4 + i / 4, level.height - 1);
+					const uint8_t* p = &level.pixels[(size_t(y) * level.width + x) * components];
+					for(int c = 0; c < stride; c++)
+						pixels[i * stride + c] = c < components ? p[c] : 255;
+				}
+				uint8_t* block = &blocks[(size_t(by) * blocks_x + bx) * block_size];
+				if(format == GL_COMPRESSED_RED_RGTC1)
+					stb_compress_bc4_block(block, pixels);
+				else if(format == GL_COMPRESSED_RG_RGTC2)
+					stb_compress_bc5_block(block, pixels);
+				else
+					stb_compress_dxt_block(block, pixels, format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ? 1 : 0,
+					                       STB_DXT_HIGHQUAL);
+			}
+		}
+	});
+	return blocks;
+}
+
+static bool loadTextureFromCache(const std::string& path, int components, CompressedTexture& texture)
+{
+	MappedFile file;
+	if(!file.open(textureCacheFilename(path, components)))
+	{
+		return false;
+	}
+	CacheReader reader(file.data, file.size);
+	const uint8_t* magic = reader.bytes(sizeof(texture_cache_magic));
+	if(magic == nullptr || memcmp(magic, texture_cache_magic, sizeof(texture_cache_magic)) != 0)
+	{
+		return false;
+	}
+	FileStamp current, cached;
+	fileStamp(path, current);
+	cached.size = reader.value<uint64_t>();
+	cached.modified = reader.value<int64_t>();
+	if(!(current == cached) || reader.value<int32_t>() != components)
+	{
+		return false;
+	}
+	texture.format = reader.value<uint32_t>();
+	texture.width = reader.value<int32_t>();
+	texture.height = reader.value<int32_t>();
+	texture.levels.resize(reader.value<uint32_t>());
+	for(auto& level : texture.levels)
+	{
+		const uint64_t size = reader.value<uint64_t>();
+		const uint8_t* blocks = reader.bytes(size_t(size));
+		if(blocks == nullptr)
+			return false;
+		level.assign(blocks, blocks + size);
+	}
+	return reader.ok && !texture.levels.empty();
+}
+
+static void saveTextureToCache(const CompressedTexture& texture, const std::string& path, int components)
+{
+	CacheWriter writer;
+	writer.bytes(texture_cache_magic, sizeof(texture_cache_magic));
+	FileStamp stamp;
+	fileStamp(path, stamp);
+	writer.value(stamp.size);
+	writer.value(stamp.modified);
+	writer.value(int32_t(components));
+	writer.value(uint32_t(texture.format));
+	writer.value(int32_t(texture.width));
+	writer.value(int32_t(texture.height));
+	writer.value(uint32_t(texture.levels.size()));
+	for(const auto& level : texture.levels)
+	{
+		writer.value(uint64_t(level.size()));
+		writer.bytes(level.data(), level.size());
+	}
+	writeCache(writer, textureCacheFilename(path, components));
+}
+
+bool loadCompressedTexture(const std::string& path, int components, CompressedTexture& texture)
+{
+	if(components < 1 || components > 4)
+	{
+		std::cout << "Texture loading not implemented for this number of compenents.\n";
+		return false;
+	}
+	if(loadTextureFromCache(path, components, texture))
+	{
+		return true;
+	}
+
+	MipLevel level;
+	int file_components;
+	uint8_t* data = stbi_load(path.c_str(), &level.width, &level.height, &file_components, components);
+	if(data == nullptr)
+	{
+		return false;
+	}
+	level.pixels.assign(data, data + size_t(level.width) * level.height * components);
+	stbi_image_free(data);
+
+	// Color textures are stored in sRGB, everything with fewer components
+	// is data
+	const bool srgb = components >= 3;
+	texture.format = compressedFormat(level, components);
+	texture.width = level.width;
+	texture.height = level.height;
+	texture.levels.clear();
+	for(;;)
+	{
+		texture.levels.push_back(compress(level, components, texture.format));
+		if(level.width == 1 && level.height == 1)
+			break;
+		level = downsample(level, components, srgb);
+	}
+	saveTextureToCache(texture, path, components);
+	return true;
+}
+
+void uploadCompressedTexture(const CompressedTexture& texture)
+{
+	if(texture.levels.empty())
+		return;
+	glTexStorage2D(GL_TEXTURE_2D, GLsizei(texture.levels.size()), texture.format, texture.width, texture.height);
+	for(size_t i = 0; i < texture.levels.size(); i++)
+	{
+		glCompressedTexSubImage2D(GL_TEXTURE_2D, GLint(i), 0, 0, std::max(1, texture.width >> i),
+		                          std::max(1, texture.height >> i), texture.format,
+		                          GLsizei(texture.levels[i].size()), texture.levels[i].data());
+	}
+}
+
+void uploadCompressedTextureLayer(const CompressedTexture& texture, int layer)
+{
+	for(size_t i = 0; i < texture.levels.size(); i++)
+	{
+		glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, GLint(i), 0, 0, layer, std::max(1, texture.width >> i),
+		                          std::max(1, texture.height >> i), 1, texture.format,
+		                          GLsizei(texture.levels[i].size()), texture.levels[i].data());
+	}
+}
+} // namespace labhelper
@@ -0,0 +1,49 @@
+#pragma once
+#include <string>
+#include "Model.h"
+
+namespace labhelper
+{
+//////////////////////////////////////////////////////////////////////////////
+// Compiled binary copies of OBJ models, written next to the OBJ file as
+// <file>.obj.cache the first time a model is loaded. The cache remembers
+// the size and modification time of the OBJ and its MTL files, and is
+// rebuilt when any of them change. Loading memory maps the cache and
+// copies the vertex arrays out of it, without any parsing.
+//
+// Layout: a header, a table of source files, the materials and meshes,
+// and then the position, normal and texture coordinate arrays, each
+// aligned to 64 bytes so that they can be uploaded as they are.
+//////////////////////////////////////////////////////////////////////////////
+
+// Fill in the materials, meshes and vertex arrays of model from the cache
+// of the OBJ file at path, naming but not decoding the textures. Returns
+// false if there is no valid cache.
+bool loadModelFromCache(const std::string& path, const std::string& directory, Model* model);
+
+// Write the cache of a model that was just loaded from the OBJ file at
+// path. Failing to write it is not an error.
+void saveModelToCache(const Model* model, const std::string& path, const std::string& directory);
+
+//////////////////////////////////////////////////////////////////////////////
+// Textures are baked into all their mip levels, block compressed, and
+// cached next to the image as <file>.<components>.cache, which is rebuilt
+// when the image changes. Mip levels of color images (3 or 4 components)
+// are filtered in linear light. Color without alpha is stored as BC1, color
+// with alpha as BC3, and one or two components of data as BC4 or BC5.
+// Images are decoded with stb_image's flip setting, which should be on.
+//////////////////////////////////////////////////////////////////////////////
+
+// Load the compressed mip levels of the image at path from its cache, or
+// bake them and write the cache. Returns false if the image can not be
+// decoded.
+bool loadCompressedTexture(const std::string& path, int components, CompressedTexture& texture);
+
+// Upload all levels of a compressed texture to the bound GL_TEXTURE_2D, as
+// immutable storage so that views can be made of it
+void uploadCompressedTexture(const CompressedTexture& texture);
+
+// Upload all levels of a compressed texture to a layer of the bound
+// GL_TEXTURE_2D_ARRAY, which has storage of the same size and format
+void uploadCompressedTextureLayer(const CompressedTexture& texture, int layer);
+} // namespace labhelper
@@ -6,6 +6,9 @@
 #include "material.h"
 #include "embree.h"
 #include "sampling.h"
+#include "guiding.h"
+#include "irradiance_cache.h"
+#include "statistics.h"
 
 using namespace std;
 using namespace glm;
@@ -18,7 +21,10 @@ namespace pathtracer
 Settings settings;
 Environment environment;
 Image rendered_image;
+CostImage cost_image;
 PointLight point_light;
+AreaLights area_lights;
+RegionOfInterest region;
 
 ///////////////////////////////////////////////////////////////////////////
 // Restart rendering of image
@@ -27,6 +33,8 @@ void restart()
 {
 	// No need to clear image,
 	rendered_image.number_of_samples = 0;
+	region.number_of_samples = 0;
+	region.current_bucket = 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -35,6 +43,13 @@ void restart()
 ///////////////////////////////////////////////////////////////////////////
 void resize(int w, int h)
 {
+	// Keep what we have accumulated if the size did not actually change
+	// (e.g. after a checkpoint has been resumed)
+	if(rendered_image.width == w / settings.subsampling && rendered_image.height == h / settings.subsampling
+	   && int(rendered_image.data.size()) == rendered_image.width * rendered_image.height)
+	{
+		return;
+	}
 	rendered_image.width = w / settings.subsampling;
 	rendered_image.height = h / settings.subsampling;
 	rendered_image.data.resize(rendered_image.width * rendered_image.height);
@@ -55,41 +70,465 @@ vec3 Lenvironment(const vec3& wi)
 	return environment.multiplier * environment.map.sample(lookup.x, lookup.y);
 }
 
+static float luminance(const vec3& c)
+{
+	return dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Build a piecewise constant distribution over the pixels of the
+// environment map, proportional to luminance times the solid angle of the
+// pixel, as rows (marginal) and pixels within each row (conditional).
+///////////////////////////////////////////////////////////////////////////
+void initEnvironmentSampling()
+{
+	const HDRImage& map = environment.map;
+	environment.conditional_cdf.resize(map.width * map.height);
+	environment.marginal_cdf.resize(map.height);
+	float total = 0.0f;
+	for(int y = 0; y < map.height; y++)
+	{
+		const float sin_theta = sin(M_PI * (y + 0.5f) / float(map.height));
+		float row_total = 0.0f;
+		for(int x = 0; x < map.width; x++)
+		{
+			const float* c = &map.data[(y * map.width + x) * 3];
+			row_total += luminance(vec3(c[0], c[1], c[2])) * sin_theta;
+			environment.conditional_cdf[y * map.width + x] = row_total;
+		}
+		total += row_total;
+		environment.marginal_cdf[y] = total;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Return the pdf (in solid angle) that sampleEnvironment() picks wi
+///////////////////////////////////////////////////////////////////////////
+static float environmentPdf(const vec3& wi)
+{
+	const HDRImage& map = environment.map;
+	if(environment.marginal_cdf.empty() || environment.marginal_cdf.back() <= 0.0f)
+		return 0.0f;
+	const float theta = acos(std::max(-1.0f, std::min(1.0f, wi.y)));
+	float phi = atan(wi.z, wi.x);
+	if(phi < 0.0f)
+		phi = phi + 2.0f * M_PI;
+	const float sin_theta = sin(theta);
+	if(sin_theta <= 0.0f)
+		return 0.0f;
+	const int x = std::min(int(phi / (2.0f * M_PI) * map.width), map.width - 1);
+	const int y = std::min(int(theta / M_PI * map.height), map.height - 1);
+	const float* row = &environment.conditional_cdf[y * map.width];
+	const float p_pixel = (row[x] - (x > 0 ? row[x - 1] : 0.0f)) / environment.marginal_cdf.back();
+	return p_pixel * map.width * map.height / (2.0f * M_PI * M_PI * sin_theta);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Importance sample a direction towards the environment
+///////////////////////////////////////////////////////////////////////////
+static vec3 sampleEnvironment(vec3& wi, float& pdf)
+{
+	const HDRImage& map = environment.map;
+	if(environment.marginal_cdf.empty() || environment.marginal_cdf.back() <= 0.0f)
+	{
+		pdf = 0.0f;
+		return vec3(0.0f);
+	}
+	const vector<float>& marginal = environment.marginal_cdf;
+	int y = int(upper_bound(marginal.begin(), marginal.end(), randf() * marginal.back()) - marginal.begin());
+	y = std::min(y, map.height - 1);
+	const float* row = &environment.conditional_cdf[y * map.width];
+	int x = int(upper_bound(row, row + map.width, randf() * row[map.width - 1]) - row);
+	x = std::min(x, map.width - 1);
+	const float theta = M_PI * (y + randf()) / float(map.height);
+	const float phi = 2.0f * M_PI * (x + randf()) / float(map.width);
+	wi = vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+	pdf = environmentPdf(wi);
+	return Lenvironment(wi);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Add all triangles with an emissive material in a model as area lights
+///////////////////////////////////////////////////////////////////////////
+void addAreaLights(const labhelper::Model* model, const mat4& model_matrix)
+{
+	for(auto& mesh : model->m_meshes)
+	{
+		const labhelper::Material* material = &model->m_materials[mesh.m_material_idx];
+		const float L = luminance(material->m_emission * material->m_color);
+		if(L <= 0.0f)
+			continue;
+		area_lights.luminance[material] = L;
+		for(uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i += 3)
+		{
+			AreaLights::Triangle t;
+			t.p0 = vec3(model_matrix * vec4(model->m_positions[i + 0], 1.0f));
+			t.p1 = vec3(model_matrix * vec4(model->m_positions[i + 1], 1.0f));
+			t.p2 = vec3(model_matrix * vec4(model->m_positions[i + 2], 1.0f));
+			const vec3 c = cross(t.p1 - t.p0, t.p2 - t.p0);
+			t.area = 0.5f * length(c);
+			if(t.area <= 0.0f)
+				continue;
+			t.normal = normalize(c);
+			t.material = material;
+			area_lights.triangles.push_back(t);
+			area_lights.total_power += t.area * L;
+			area_lights.cdf.push_back(area_lights.total_power);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Return the pdf (per unit area) of sampling a point on an emissive
+// surface with the given material
+///////////////////////////////////////////////////////////////////////////
+static float areaLightPdf(const labhelper::Material* material)
+{
+	if(area_lights.total_power <= 0.0f)
+		return 0.0f;
+	auto it = area_lights.luminance.find(material);
+	if(it == area_lights.luminance.end())
+		return 0.0f;
+	// p(triangle) = area * L / total_power, p(point | triangle) = 1 / area
+	return it->second / area_lights.total_power;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Sample a point on an emissive triangle, in proportion to emitted power
+///////////////////////////////////////////////////////////////////////////
+static const AreaLights::Triangle* sampleAreaLight(vec3& position, float& pdf_area)
+{
+	if(area_lights.triangles.empty())
+	{
+		pdf_area = 0.0f;
+		return nullptr;
+	}
+	const vector<float>& cdf = area_lights.cdf;
+	size_t idx = upper_bound(cdf.begin(), cdf.end(), randf() * area_lights.total_power) - cdf.begin();
+	const AreaLights::Triangle& t = area_lights.triangles[std::min(idx, cdf.size() - 1)];
+	const float su = sqrt(randf());
+	const float v = randf();
+	position = (1.0f - su) * t.p0 + su * (1.0f - v) * t.p1 + su * v * t.p2;
+	pdf_area = areaLightPdf(t.material);
+	return &t;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Multiple importance sampling weight for a sample taken with pdf a, when
+// it could also have been taken with pdf b
+///////////////////////////////////////////////////////////////////////////
+static float powerHeuristic(float a, float b)
+{
+	if(a <= 0.0f)
+		return 0.0f;
+	return (a * a) / (a * a + b * b);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Offset a point along the geometry normal, to the side that a ray in
+// direction d leaves from, so that it does not hit its own surface.
+///////////////////////////////////////////////////////////////////////////
+static vec3 offsetRayOrigin(const Intersection& hit, const vec3& d)
+{
+	return hit.position + (dot(d, hit.geometry_normal) < 0.0f ? -EPSILON : EPSILON) * hit.geometry_normal;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// intersect() and occluded(), counted in the statistics
+///////////////////////////////////////////////////////////////////////////
+static bool traceRay(Ray& r, statistics::RayType type)
+{
+	if(!statistics::options.enabled)
+		return intersect(r);
+	statistics::Counters& counters = statistics::threadCounters();
+	counters.rays[type]++;
+	if(!statistics::options.timing)
+		return intersect(r);
+	const uint64_t start = statistics::now();
+	const bool hit = intersect(r);
+	counters.intersection_ns += statistics::now() - start;
+	return hit;
+}
+
+static bool traceShadowRay(Ray& r)
+{
+	if(!statistics::options.enabled)
+		return occluded(r);
+	statistics::Counters& counters = statistics::threadCounters();
+	counters.rays[statistics::ShadowRay]++;
+	if(!statistics::options.timing)
+		return occluded(r);
+	const uint64_t start = statistics::now();
+	const bool hit = occluded(r);
+	counters.intersection_ns += statistics::now() - start;
+	return hit;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The pdf of scattering in direction wi, when the brdf is sampled with
+// probability brdf_fraction and the guiding distribution otherwise
+///////////////////////////////////////////////////////////////////////////
+static float scatteringPdf(BRDF& mat,
+                           const guiding::Region* region,
+                           float brdf_fraction,
+                           const vec3& wi,
+                           const vec3& wo,
+                           const vec3& n)
+{
+	const float p = mat.pdf(wi, wo, n);
+	if(brdf_fraction >= 1.0f)
+		return p;
+	return brdf_fraction * p + (1.0f - brdf_fraction) * guiding::pdf(region, wi);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A path vertex at which the guiding distribution learns the radiance
+// that arrived from the sampled direction
+///////////////////////////////////////////////////////////////////////////
+struct GuidingVertex
+{
+	guiding::Region* region;
+	vec3 wi;
+	float pdf;
+	vec3 throughput; // Including the scattering at this vertex
+	vec3 L;          // Radiance gathered before the path continued from here
+};
+const int max_guiding_vertices = 32;
+
+static vec3 irradianceCacheRadiance(const vec3& origin, const vec3& direction, float& distance);
+
 ///////////////////////////////////////////////////////////////////////////
 // Calculate the radiance going from one point (r.hitPosition()) in one
-// direction (-r.d), through path tracing.
+// direction (-r.d), through path tracing. With use_irradiance_cache, the
+// path ends at its second hit, where the irradiance cache provides the
+// indirect light. number_of_hits is set to the number of surfaces the
+// path hit.
 ///////////////////////////////////////////////////////////////////////////
-vec3 Li(Ray& primary_ray)
+static vec3 tracePath(Ray& primary_ray, int max_bounces, bool use_irradiance_cache, int& number_of_hits)
 {
 	vec3 L = vec3(0.0f);
 	vec3 path_throughput = vec3(1.0);
 	Ray current_ray = primary_ray;
+	// The pdf of the scattering sample that led to the current hit
+	float brdf_pdf = 0.0f;
+	// Guiding learns from passes over the whole image only (see region)
+	const bool guide = guiding::options.enabled && !region.enabled;
+	const bool train_guiding = guide && guiding::isTraining();
+	GuidingVertex guiding_vertices[max_guiding_vertices];
+	int number_of_guiding_vertices = 0;
 
-	///////////////////////////////////////////////////////////////////
-	// Get the intersection information from the ray
-	///////////////////////////////////////////////////////////////////
-	Intersection hit = getIntersection(current_ray);
-	///////////////////////////////////////////////////////////////////
-	// Create a Material tree for evaluating brdfs and calculating
-	// sample directions.
-	///////////////////////////////////////////////////////////////////
-
-	Diffuse diffuse(hit.material->m_color);
-	BRDF& mat = diffuse;
-	///////////////////////////////////////////////////////////////////
-	// Calculate Direct Illumination from light.
-	///////////////////////////////////////////////////////////////////
-	{
-		const float distance_to_light = length(point_light.position - hit.position);
-		const float falloff_factor = 1.0f / (distance_to_light * distance_to_light);
-		vec3 Li = point_light.intensity_multiplier * point_light.color * falloff_factor;
-		vec3 wi = normalize(point_light.position - hit.position);
-		L = mat.f(wi, hit.wo, hit.shading_normal) * Li * std::max(0.0f, dot(wi, hit.shading_normal));
+	int bounces = 0;
+	for(;; bounces++)
+	{
+		///////////////////////////////////////////////////////////////////
+		// Get the intersection information from the ray
+		///////////////////////////////////////////////////////////////////
+		Intersection hit = getIntersection(current_ray);
+		const labhelper::Material* material = hit.material;
+		///////////////////////////////////////////////////////////////////
+		// Add emitted radiance from the surface itself. Emission found by
+		// brdf sampling is weighted against area light sampling.
+		///////////////////////////////////////////////////////////////////
+		{
+			const vec3 Le = material->m_emission * material->m_color;
+			if(bounces == 0)
+			{
+				L += path_throughput * Le;
+			}
+			else if(Le != vec3(0.0f))
+			{
+				const float cos_light = abs(dot(hit.geometry_normal, current_ray.d));
+				const float distance2 = current_ray.tfar * current_ray.tfar;
+				const float light_pdf =
+				    cos_light > 0.0f ? areaLightPdf(material) * distance2 / cos_light : 0.0f;
+				L += path_throughput * Le * powerHeuristic(brdf_pdf, light_pdf);
+			}
+		}
+		// The last brdf sample only contributes emission found through it
+		if(bounces > max_bounces)
+			break;
+		///////////////////////////////////////////////////////////////////
+		// Create a Material tree for evaluating brdfs and calculating
+		// sample directions.
+		///////////////////////////////////////////////////////////////////
+		Diffuse diffuse(material->m_color);
+		BlinnPhong dielectric(material->m_shininess, material->m_fresnel, &diffuse);
+		BlinnPhongMetal metal(material->m_color, material->m_shininess, material->m_fresnel);
+		LinearBlend metal_blend(material->m_metalness, &metal, &dielectric);
+		LinearBlend reflectivity_blend(material->m_reflectivity, &metal_blend, &diffuse);
+		BRDF& mat = reflectivity_blend;
+		///////////////////////////////////////////////////////////////////
+		// Where the path guiding has learned something, directions are
+		// sampled from the brdf or from the guiding distribution
+		///////////////////////////////////////////////////////////////////
+		guiding::Region* guiding_region = guide ? guiding::lookup(hit.position) : nullptr;
+		const bool can_guide = guiding_region != nullptr && guiding::canSample(guiding_region);
+		const float brdf_fraction = can_guide ? guiding::options.brdf_sampling_fraction : 1.0f;
+		///////////////////////////////////////////////////////////////////
+		// Calculate Direct Illumination from light.
+		///////////////////////////////////////////////////////////////////
+		{
+			const float distance_to_light = length(point_light.position - hit.position);
+			const float falloff_factor = 1.0f / (distance_to_light * distance_to_light);
+			vec3 Li = point_light.intensity_multiplier * point_light.color * falloff_factor;
+			vec3 wi = normalize(point_light.position - hit.position);
+			Ray shadow_ray(offsetRayOrigin(hit, wi), wi, 0.0f, distance_to_light);
+			if(!traceShadowRay(shadow_ray))
+			{
+				L += path_throughput * mat.f(wi, hit.wo, hit.shading_normal) * Li
+				     * std::max(0.0f, dot(wi, hit.shading_normal));
+			}
+		}
+		///////////////////////////////////////////////////////////////////
+		// After the first bounce, take everything but the point light
+		// from the irradiance cache, treating the surface as diffuse with
+		// its base color (a biased approximation for previews).
+		///////////////////////////////////////////////////////////////////
+		if(use_irradiance_cache && bounces >= 1)
+		{
+			if(dot(hit.wo, hit.shading_normal) > 0.0f)
+			{
+				const vec3 E = irradiance_cache::irradiance(offsetRayOrigin(hit, hit.shading_normal),
+				                                            hit.shading_normal, irradianceCacheRadiance);
+				L += path_throughput * (material->m_color / M_PI) * E;
+			}
+			break;
+		}
+		///////////////////////////////////////////////////////////////////
+		// Sample the environment map, weighted against brdf sampling
+		///////////////////////////////////////////////////////////////////
+		if(environment.multiplier > 0.0f)
+		{
+			vec3 wi;
+			float light_pdf;
+			vec3 Le = sampleEnvironment(wi, light_pdf);
+			const float cosine_term = dot(wi, hit.shading_normal);
+			if(light_pdf > 0.0f && cosine_term > 0.0f)
+			{
+				const vec3 brdf = mat.f(wi, hit.wo, hit.shading_normal);
+				Ray shadow_ray(offsetRayOrigin(hit, wi), wi);
+				if(brdf != vec3(0.0f) && !traceShadowRay(shadow_ray))
+				{
+					const float weight = powerHeuristic(
+					    light_pdf, scatteringPdf(mat, guiding_region, brdf_fraction, wi, hit.wo, hit.shading_normal));
+					L += path_throughput * brdf * Le * cosine_term * weight / light_pdf;
+				}
+			}
+		}
+		///////////////////////////////////////////////////////////////////
+		// Sample a point on an emissive surface, weighted against brdf
+		// sampling
+		///////////////////////////////////////////////////////////////////
+		{
+			vec3 light_position;
+			float pdf_area;
+			const AreaLights::Triangle* light = sampleAreaLight(light_position, pdf_area);
+			if(light != nullptr && pdf_area > 0.0f)
+			{
+				const float distance_to_light = length(light_position - hit.position);
+				const vec3 wi = (light_position - hit.position) / distance_to_light;
+				const float cos_light = abs(dot(light->normal, wi));
+				const float cosine_term = dot(wi, hit.shading_normal);
+				if(cos_light > 0.0f && cosine_term > 0.0f)
+				{
+					const float light_pdf = pdf_area * distance_to_light * distance_to_light / cos_light;
+					const vec3 brdf = mat.f(wi, hit.wo, hit.shading_normal);
+					Ray shadow_ray(offsetRayOrigin(hit, wi), wi, 0.0f, distance_to_light - 2.0f * EPSILON);
+					if(brdf != vec3(0.0f) && !traceShadowRay(shadow_ray))
+					{
+						const vec3 Le = light->material->m_emission * light->material->m_color;
+						const float weight = powerHeuristic(
+						    light_pdf, scatteringPdf(mat, guiding_region, brdf_fraction, wi, hit.wo, hit.shading_normal));
+						L += path_throughput * brdf * Le * cosine_term * weight / light_pdf;
+					}
+				}
+			}
+		}
+		///////////////////////////////////////////////////////////////////
+		// Sample an incoming direction (from the brdf, or with one-sample
+		// MIS between the brdf and the guiding distribution) and continue
+		// the path
+		///////////////////////////////////////////////////////////////////
+		vec3 wi;
+		vec3 brdf;
+		if(!can_guide)
+		{
+			brdf = mat.sample_wi(wi, hit.wo, hit.shading_normal, brdf_pdf);
+		}
+		else
+		{
+			if(randf() < brdf_fraction)
+			{
+				brdf = mat.sample_wi(wi, hit.wo, hit.shading_normal, brdf_pdf);
+			}
+			else
+			{
+				wi = guiding::sample(guiding_region);
+				brdf = mat.f(wi, hit.wo, hit.shading_normal);
+			}
+			brdf_pdf = scatteringPdf(mat, guiding_region, brdf_fraction, wi, hit.wo, hit.shading_normal);
+		}
+		if(brdf_pdf < EPSILON)
+			break;
+		const float cosine_term = abs(dot(wi, hit.shading_normal));
+		path_throughput = path_throughput * (brdf * cosine_term) / brdf_pdf;
+		if(path_throughput == vec3(0.0f))
+			break;
+		if(train_guiding && number_of_guiding_vertices < max_guiding_vertices)
+		{
+			GuidingVertex v = { guiding_region, wi, brdf_pdf, path_throughput, L };
+			guiding_vertices[number_of_guiding_vertices++] = v;
+		}
+		current_ray = Ray(offsetRayOrigin(hit, wi), wi);
+		if(!traceRay(current_ray, statistics::BounceRay))
+		{
+			const float light_pdf = environment.multiplier > 0.0f ? environmentPdf(wi) : 0.0f;
+			L += path_throughput * Lenvironment(wi) * powerHeuristic(brdf_pdf, light_pdf);
+			break;
+		}
+	}
+	number_of_hits = bounces + 1;
+	///////////////////////////////////////////////////////////////////////
+	// Everything gathered after a vertex arrived there from its sampled
+	// direction, scaled by the throughput up to and including the vertex
+	///////////////////////////////////////////////////////////////////////
+	for(int i = 0; i < number_of_guiding_vertices; i++)
+	{
+		const GuidingVertex& v = guiding_vertices[i];
+		const vec3 gathered = L - v.L;
+		vec3 incident;
+		for(int c = 0; c < 3; c++)
+		{
+			incident[c] = v.throughput[c] > 0.0f ? gathered[c] / v.throughput[c] : 0.0f;
+		}
+		guiding::record(v.region, v.wi, luminance(incident), v.pdf);
 	}
 	// Return the final outgoing radiance for the primary ray
 	return L;
 }
 
+vec3 Li(Ray& primary_ray, int& number_of_hits)
+{
+	return tracePath(primary_ray, settings.max_bounces, irradiance_cache::options.enabled, number_of_hits);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The radiance that records of the irradiance cache are made from: full
+// paths, that do not use the cache themselves.
+///////////////////////////////////////////////////////////////////////////
+static vec3 irradianceCacheRadiance(const vec3& origin, const vec3& direction, float& distance)
+{
+	Ray ray(origin, direction);
+	if(!traceRay(ray, statistics::BounceRay))
+	{
+		distance = FLT_MAX;
+		return Lenvironment(direction);
+	}
+	distance = ray.tfar;
+	int number_of_hits;
+	return tracePath(ray, std::max(0, settings.max_bounces - 1), false, number_of_hits);
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Used to homogenize points transformed with projection matrices
 ///////////////////////////////////////////////////////////////////////////
@@ -99,56 +538,435 @@ inline static glm::vec3 homogenize(const glm::vec4& p)
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Trace one path per pixel and accumulate the result in an image
+// Cache of the primary hit of every stratum of every pixel. It is valid
+// as long as the camera, image size and strata stay the same, and is
+// cleared when they change.
 ///////////////////////////////////////////////////////////////////////////
-void tracePaths(const glm::mat4& V, const glm::mat4& P)
+struct PrimaryHit
 {
-	// Stop here if we have as many samples as we want
-	if((int(rendered_image.number_of_samples) > settings.max_paths_per_pixel)
-	   && (settings.max_paths_per_pixel != 0))
+	uint32_t geomID, primID;
+	float u, v;
+	float tfar; // Negative if not cached yet
+	vec3 n;
+};
+static struct PrimaryHitCache
+{
+	mat4 V, P;
+	int width = 0, height = 0, strata = 0;
+	std::vector<PrimaryHit, numa::FirstTouchAllocator<PrimaryHit>> hits;
+} primary_hit_cache;
+
+static void validatePrimaryHitCache(const mat4& V, const mat4& P, int width, int height, int strata)
+{
+	PrimaryHitCache& cache = primary_hit_cache;
+	if(cache.V == V && cache.P == P && cache.width == width && cache.height == height && cache.strata == strata)
 	{
 		return;
 	}
+	cache.V = V;
+	cache.P = P;
+	cache.width = width;
+	cache.height = height;
+	cache.strata = strata;
+	PrimaryHit empty = { RTC_INVALID_GEOMETRY_ID, RTC_INVALID_GEOMETRY_ID, 0.0f, 0.0f, -1.0f, vec3(0.0f) };
+	cache.hits.assign(size_t(width) * height * strata * strata, empty);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A position within a stratum of a pixel. The order in which the strata
+// are visited is offset per pixel to avoid visible patterns before all
+// strata have been sampled. With the primary hit cache every stratum has
+// a fixed, pseudo random position, so that it always gives the same
+// primary ray (and the image converges to the average of those
+// positions). Otherwise the position is drawn anew for every sample, so
+// that the image converges to the integral over the pixel.
+///////////////////////////////////////////////////////////////////////////
+static uint32_t hashPixel(uint32_t x, uint32_t y, uint32_t s)
+{
+	uint32_t h = x * 0x8da6b343u ^ y * 0xd8163841u ^ s * 0xcb1ab31fu;
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
+
+static int pixelStratum(int x, int y, int sample, int strata)
+{
+	return int((uint32_t(sample) + hashPixel(x, y, 0)) % uint32_t(strata * strata));
+}
+
+static vec2 stratumPosition(int x, int y, int stratum, int strata, bool fixed_position)
+{
+	vec2 jitter;
+	if(fixed_position)
+	{
+		const uint32_t h = hashPixel(x, y, stratum + 1);
+		jitter = vec2(float(h & 0xFFFF), float(h >> 16)) * (1.0f / 65536.0f);
+	}
+	else
+	{
+		jitter.x = randf();
+		jitter.y = randf();
+	}
+	return (vec2(float(stratum % strata), float(stratum / strata)) + jitter) / float(strata);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Create a ray that starts in the camera position and points toward a
+// point within a stratum of a pixel on a virtual screen
+///////////////////////////////////////////////////////////////////////////
+static Ray cameraRay(const vec3& camera_pos,
+                     const mat4& inverse_PV,
+                     int width,
+                     int height,
+                     int x,
+                     int y,
+                     int stratum,
+                     int strata,
+                     bool fixed_position)
+{
+	Ray ray;
+	ray.o = camera_pos;
+	const vec2 offset = stratumPosition(x, y, stratum, strata, fixed_position);
+	vec2 screenCoord = vec2((float(x) + offset.x) / float(width), (float(y) + offset.y) / float(height));
+	// Calculate direction
+	vec4 viewCoord = vec4(screenCoord.x * 2.0f - 1.0f, screenCoord.y * 2.0f - 1.0f, 1.0f, 1.0f);
+	vec3 p = homogenize(inverse_PV * viewCoord);
+	ray.d = normalize(p - camera_pos);
+	return ray;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Trace one path per pixel in a tile and add the radiance to sums
+///////////////////////////////////////////////////////////////////////////
+void traceTile(const mat4& V,
+               const mat4& P,
+               int width,
+               int height,
+               const Tile& tile,
+               int sample,
+               vec3* sums,
+               float* costs)
+{
 	vec3 camera_pos = vec3(glm::inverse(V) * vec4(0.0f, 0.0f, 0.0f, 1.0f));
+	mat4 inverse_PV = inverse(P * V);
+	const int strata = std::max(1, settings.strata);
+	if(settings.cache_primary_hits)
+	{
+		validatePrimaryHitCache(V, P, width, height, strata);
+	}
+	const bool use_cache = settings.cache_primary_hits;
+	const bool count = statistics::options.enabled;
+	const bool timing = count && statistics::options.timing;
+	const CostMeasure cost_measure = costs != nullptr ? cost_image.measure : CostMeasure::None;
 	// Trace one path per pixel (the omp parallel stuf magically distributes the
-	// pathtracing on all cores of your CPU).
-	int num_rays = 0;
-	vector<vec4> local_image(rendered_image.width * rendered_image.height, vec4(0.0f));
-
-#pragma omp parallel for
-	for(int y = 0; y < rendered_image.height; y++)
+	// pathtracing on all cores of your CPU). The schedule is static so that
+	// the same thread (and random generator) always gets the same rows,
+	// which makes resumed checkpoints continue bit-exactly.
+#pragma omp parallel for schedule(static)
+	for(int y = tile.y0; y < tile.y1; y++)
 	{
-		for(int x = 0; x < rendered_image.width; x++)
+		for(int x = tile.x0; x < tile.x1; x++)
 		{
 			vec3 color;
-			Ray primaryRay;
-			primaryRay.o = camera_pos;
-			// Create a ray that starts in the camera position and points toward
-			// the current pixel on a virtual screen.
-			vec2 screenCoord = vec2(float(x) / float(rendered_image.width),
-			                        float(y) / float(rendered_image.height));
-			// Calculate direction
-			vec4 viewCoord = vec4(screenCoord.x * 2.0f - 1.0f, screenCoord.y * 2.0f - 1.0f, 1.0f, 1.0f);
-			vec3 p = homogenize(inverse(P * V) * viewCoord);
-			primaryRay.d = normalize(p - camera_pos);
-			// Intersect ray with scene
-			if(intersect(primaryRay))
+			const bool need_time = timing || cost_measure == CostMeasure::Nanoseconds;
+			const uint64_t start = need_time ? statistics::now() : 0;
+			uint64_t rays_before = 0;
+			if(cost_measure == CostMeasure::Rays)
+			{
+				const statistics::Counters& counters = statistics::threadCounters();
+				for(int i = 0; i < statistics::NumberOfRayTypes; i++)
+					rays_before += counters.rays[i];
+			}
+			const int stratum = pixelStratum(x, y, sample, strata);
+			Ray primaryRay = cameraRay(camera_pos, inverse_PV, width, height, x, y, stratum, strata, use_cache);
+			// Intersect ray with scene, or reuse the hit from an earlier pass
+			bool hit;
+			PrimaryHit* cached = nullptr;
+			if(use_cache)
+			{
+				cached = &primary_hit_cache.hits[(size_t(y) * width + x) * strata * strata + stratum];
+			}
+			if(cached != nullptr && cached->tfar >= 0.0f)
+			{
+				hit = cached->geomID != RTC_INVALID_GEOMETRY_ID;
+				primaryRay.geomID = cached->geomID;
+				primaryRay.primID = cached->primID;
+				primaryRay.u = cached->u;
+				primaryRay.v = cached->v;
+				primaryRay.n = cached->n;
+				if(hit)
+					primaryRay.tfar = cached->tfar;
+				if(count)
+					statistics::threadCounters().cached_primary_hits++;
+			}
+			else
+			{
+				hit = traceRay(primaryRay, statistics::PrimaryRay);
+				if(cached != nullptr)
+				{
+					cached->geomID = hit ? primaryRay.geomID : RTC_INVALID_GEOMETRY_ID;
+					cached->primID = primaryRay.primID;
+					cached->u = primaryRay.u;
+					cached->v = primaryRay.v;
+					cached->n = primaryRay.n;
+					cached->tfar = hit ? primaryRay.tfar : 0.0f;
+				}
+			}
+			int number_of_hits = 0;
+			if(hit)
 			{
 				// If it hit something, evaluate the radiance from that point
-				color = Li(primaryRay);
+				color = Li(primaryRay, number_of_hits);
 			}
 			else
 			{
 				// Otherwise evaluate environment
 				color = Lenvironment(primaryRay.d);
 			}
-			// Accumulate the obtained radiance to the pixels color
-			float n = float(rendered_image.number_of_samples);
-			rendered_image.data[y * rendered_image.width + x] =
-			    rendered_image.data[y * rendered_image.width + x] * (n / (n + 1.0f))
-			    + (1.0f / (n + 1.0f)) * color;
+			sums[(y - tile.y0) * tile.width() + (x - tile.x0)] += color;
+			if(count)
+			{
+				statistics::Counters& counters = statistics::threadCounters();
+				counters.paths++;
+				counters.path_length[std::min(number_of_hits, statistics::max_path_length)]++;
+				if(timing)
+					counters.path_ns += statistics::now() - start;
+			}
+			if(cost_measure == CostMeasure::Rays)
+			{
+				const statistics::Counters& counters = statistics::threadCounters();
+				uint64_t rays = 0;
+				for(int i = 0; i < statistics::NumberOfRayTypes; i++)
+					rays += counters.rays[i];
+				costs[(y - tile.y0) * tile.width() + (x - tile.x0)] += float(rays - rays_before);
+			}
+			else if(cost_measure == CostMeasure::Nanoseconds)
+			{
+				costs[(y - tile.y0) * tile.width() + (x - tile.x0)] += float(statistics::now() - start);
+			}
 		}
 	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Fill the primary hit cache from a visibility buffer. The buffer only
+// tells which triangle covers the center of a stratum, so the jittered
+// ray of the stratum is tested against that triangle. Near silhouettes,
+// where the neighbouring strata see other geometry, and where the ray
+// misses the triangle, the entry is left for traceTile() to trace.
+///////////////////////////////////////////////////////////////////////////
+void setPrimaryVisibility(const mat4& V,
+                          const mat4& P,
+                          int width,
+                          int height,
+                          int strata,
+                          const VisibilitySample* samples)
+{
+	if(!settings.cache_primary_hits || strata != std::max(1, settings.strata))
+	{
+		return;
+	}
+	validatePrimaryHitCache(V, P, width, height, strata);
+	vec3 camera_pos = vec3(glm::inverse(V) * vec4(0.0f, 0.0f, 0.0f, 1.0f));
+	mat4 inverse_PV = inverse(P * V);
+	const int buffer_width = width * strata, buffer_height = height * strata;
+	auto geometryAt = [&](int bx, int by) {
+		bx = std::max(0, std::min(buffer_width - 1, bx));
+		by = std::max(0, std::min(buffer_height - 1, by));
+		return samples[size_t(by) * buffer_width + bx].geomID;
+	};
+#pragma omp parallel for schedule(static)
+	for(int y = 0; y < height; y++)
+	{
+		for(int x = 0; x < width; x++)
+		{
+			for(int stratum = 0; stratum < strata * strata; stratum++)
+			{
+				PrimaryHit& cached = primary_hit_cache.hits[(size_t(y) * width + x) * strata * strata + stratum];
+				if(cached.tfar >= 0.0f)
+				{
+					continue;
+				}
+				const int bx = x * strata + stratum % strata;
+				const int by = y * strata + stratum / strata;
+				const VisibilitySample& sample = samples[size_t(by) * buffer_width + bx];
+				if(geometryAt(bx - 1, by) != sample.geomID || geometryAt(bx + 1, by) != sample.geomID
+				   || geometryAt(bx, by - 1) != sample.geomID || geometryAt(bx, by + 1) != sample.geomID)
+				{
+					continue;
+				}
+				if(sample.geomID == RTC_INVALID_GEOMETRY_ID)
+				{
+					cached.geomID = RTC_INVALID_GEOMETRY_ID;
+					cached.tfar = 0.0f;
+					continue;
+				}
+				Ray ray = cameraRay(camera_pos, inverse_PV, width, height, x, y, stratum, strata, true);
+				if(intersectTriangle(ray, sample.geomID, sample.primID))
+				{
+					cached.geomID = ray.geomID;
+					cached.primID = ray.primID;
+					cached.u = ray.u;
+					cached.v = ray.v;
+					cached.n = ray.n;
+					cached.tfar = ray.tfar;
+				}
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Region of interest
+///////////////////////////////////////////////////////////////////////////
+void setRegionOfInterest(const vec2& min, const vec2& max)
+{
+	region.enabled = true;
+	region.min = clamp(glm::min(min, max), vec2(0.0f), vec2(1.0f));
+	region.max = clamp(glm::max(min, max), vec2(0.0f), vec2(1.0f));
+	restart();
+}
+
+void clearRegionOfInterest()
+{
+	region.enabled = false;
+	restart();
+}
+
+Tile regionTile()
+{
+	const vec2 size(rendered_image.width, rendered_image.height);
+	const ivec2 lo = ivec2(floor(region.min * size));
+	const ivec2 hi = ivec2(ceil(region.max * size));
+	Tile tile = { std::max(lo.x, 0), std::max(lo.y, 0), std::min(hi.x, rendered_image.width),
+		          std::min(hi.y, rendered_image.height) };
+	// Always trace at least one pixel
+	tile.x1 = std::max(tile.x1, std::min(tile.x0 + 1, rendered_image.width));
+	tile.y1 = std::max(tile.y1, std::min(tile.y0 + 1, rendered_image.height));
+	return tile;
+}
+
+int numberOfBuckets()
+{
+	const Tile tile = regionTile();
+	const int bucket_size = std::max(1, region.bucket_size);
+	return ((tile.width() + bucket_size - 1) / bucket_size) * ((tile.height() + bucket_size - 1) / bucket_size);
+}
+
+Tile bucketTile(int bucket)
+{
+	const Tile tile = regionTile();
+	const int bucket_size = std::max(1, region.bucket_size);
+	const int buckets_x = (tile.width() + bucket_size - 1) / bucket_size;
+	// Start at the top of the image, like a printed page
+	const int x0 = tile.x0 + (bucket % buckets_x) * bucket_size;
+	const int y1 = tile.y1 - (bucket / buckets_x) * bucket_size;
+	Tile result = { x0, std::max(tile.y0, y1 - bucket_size), std::min(tile.x1, x0 + bucket_size), y1 };
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Trace samples paths per pixel in a tile and blend them into
+// rendered_image, which already holds number_of_samples paths per pixel
+// there.
+///////////////////////////////////////////////////////////////////////////
+static void accumulateTile(const mat4& V, const mat4& P, const Tile& tile, int number_of_samples, int samples)
+{
+	vector<vec3, numa::FirstTouchAllocator<vec3>> local_image(tile.width() * tile.height(), vec3(0.0f));
+	const bool measure_cost = cost_image.measure != CostMeasure::None;
+	vector<float> local_costs(measure_cost ? tile.width() * tile.height() : 0, 0.0f);
+	if(measure_cost && cost_image.data.size() != rendered_image.data.size())
+	{
+		cost_image.data.assign(rendered_image.data.size(), 0.0f);
+	}
+	const uint64_t start = statistics::now();
+	for(int i = 0; i < samples; i++)
+	{
+		traceTile(V, P, rendered_image.width, rendered_image.height, tile, number_of_samples + i, local_image.data(),
+		          measure_cost ? local_costs.data() : nullptr);
+	}
+	statistics::endPass(uint64_t(tile.width()) * tile.height() * samples, double(statistics::now() - start) * 1e-9);
+
+	// Accumulate the obtained radiance to the pixels color
+	float n = float(number_of_samples);
+	float m = float(samples);
+#pragma omp parallel for schedule(static)
+	for(int y = tile.y0; y < tile.y1; y++)
+	{
+		for(int x = tile.x0; x < tile.x1; x++)
+		{
+			vec3& pixel = rendered_image.data[y * rendered_image.width + x];
+			pixel = pixel * (n / (n + m))
+			        + (1.0f / (n + m)) * local_image[(y - tile.y0) * tile.width() + (x - tile.x0)];
+			if(measure_cost)
+			{
+				float& cost = cost_image.data[y * rendered_image.width + x];
+				cost = cost * (n / (n + m)) + (1.0f / (n + m)) * local_costs[(y - tile.y0) * tile.width() + (x - tile.x0)];
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Trace the region of interest
+///////////////////////////////////////////////////////////////////////////
+static void traceRegion(const mat4& V, const mat4& P)
+{
+	if(!region.bucket_mode)
+	{
+		// Stop here if we have as many samples as we want
+		if((region.number_of_samples > settings.max_paths_per_pixel) && (settings.max_paths_per_pixel != 0))
+		{
+			return;
+		}
+		accumulateTile(V, P, regionTile(), region.number_of_samples, 1);
+		region.number_of_samples += 1;
+		return;
+	}
+
+	// Stop here if all buckets are done
+	if(region.current_bucket >= numberOfBuckets())
+	{
+		return;
+	}
+	// Buckets are small, so spend about as much work per call as one pass
+	// over the whole region would take, to keep the overhead per call low.
+	const Tile bucket = bucketTile(region.current_bucket);
+	const Tile tile = regionTile();
+	const int remaining = std::max(1, region.bucket_samples - region.number_of_samples);
+	const int samples = std::min(remaining, std::max(1, (tile.width() * tile.height())
+	                                                        / std::max(1, bucket.width() * bucket.height())));
+	accumulateTile(V, P, bucket, region.number_of_samples, samples);
+	region.number_of_samples += samples;
+	if(region.number_of_samples >= region.bucket_samples)
+	{
+		region.current_bucket += 1;
+		region.number_of_samples = 0;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Trace one path per pixel and accumulate the result in an image
+///////////////////////////////////////////////////////////////////////////
+void tracePaths(const glm::mat4& V, const glm::mat4& P)
+{
+	if(region.enabled)
+	{
+		traceRegion(V, P);
+		return;
+	}
+	// Stop here if we have as many samples as we want
+	if((int(rendered_image.number_of_samples) > settings.max_paths_per_pixel)
+	   && (settings.max_paths_per_pixel != 0))
+	{
+		return;
+	}
+	Tile whole_image = { 0, 0, rendered_image.width, rendered_image.height };
+	accumulateTile(V, P, whole_image, rendered_image.number_of_samples, 1);
 	rendered_image.number_of_samples += 1;
+	guiding::endPass();
 }
 }; // namespace pathtracer
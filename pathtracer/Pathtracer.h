@@ -1,9 +1,11 @@
 #pragma once
 #include <glm/glm.hpp>
 #include <vector>
+#include <map>
 #include <Model.h>
 #include <omp.h>
 #include "HDRImage.h"
+#include "numa.h"
 
 #ifdef M_PI
 #undef M_PI
@@ -24,6 +26,13 @@ extern struct Settings
 	int subsampling;
 	int max_bounces;
 	int max_paths_per_pixel;
+	// Pixels are split into strata x strata sub-pixel positions, and
+	// successive samples of a pixel cycle through them
+	int strata;
+	// Reuse the first hit of each stratum while the camera is static. This
+	// fixes the position of each stratum within the pixel, so the image no
+	// longer converges to the integral over the pixel.
+	bool cache_primary_hits;
 } settings;
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -33,21 +42,49 @@ extern struct Environment
 {
 	float multiplier;
 	HDRImage map;
+	// Distribution used to importance sample the map by luminance. Built
+	// by initEnvironmentSampling().
+	std::vector<float> marginal_cdf;
+	std::vector<float> conditional_cdf;
 } environment;
 
+///////////////////////////////////////////////////////////////////////////
+// Build the importance sampling distribution for the environment map.
+// Call after environment.map has been loaded.
+///////////////////////////////////////////////////////////////////////////
+void initEnvironmentSampling();
+
 ///////////////////////////////////////////////////////////////////////////
 // The rendered image
 ///////////////////////////////////////////////////////////////////////////
 extern struct Image
 {
 	int width, height, number_of_samples = 0;
-	std::vector<glm::vec3> data;
+	// Placed on the NUMA nodes of the threads that accumulate into it
+	std::vector<glm::vec3, numa::FirstTouchAllocator<glm::vec3>> data;
 	float* getPtr()
 	{
 		return &data[0].x;
 	}
 } rendered_image;
 
+///////////////////////////////////////////////////////////////////////////
+// The cost of every pixel of rendered_image, averaged over its paths like
+// the radiance, for finding out where time goes. Measuring rays needs
+// statistics::options.enabled. Restart after changing the measure.
+///////////////////////////////////////////////////////////////////////////
+enum class CostMeasure
+{
+	None,
+	Rays,       // Rays traced per path
+	Nanoseconds // Time per path
+};
+extern struct CostImage
+{
+	CostMeasure measure = CostMeasure::None;
+	std::vector<float> data; // Same layout as rendered_image.data
+} cost_image;
+
 ///////////////////////////////////////////////////////////////////////////////
 // The light source
 ///////////////////////////////////////////////////////////////////////////////
@@ -58,6 +95,32 @@ extern struct PointLight
 	vec3 position;
 } point_light;
 
+///////////////////////////////////////////////////////////////////////////////
+// Emissive triangles, which are sampled as area lights
+///////////////////////////////////////////////////////////////////////////////
+extern struct AreaLights
+{
+	struct Triangle
+	{
+		vec3 p0, p1, p2;
+		vec3 normal;
+		float area;
+		const labhelper::Material* material;
+	};
+	std::vector<Triangle> triangles;
+	// Triangles are chosen in proportion to their emitted power
+	std::vector<float> cdf;
+	float total_power = 0.0f;
+	// Luminance of each emissive material when the lights were added, so
+	// that pdfs stay consistent if materials are edited afterwards.
+	std::map<const labhelper::Material*, float> luminance;
+} area_lights;
+
+///////////////////////////////////////////////////////////////////////////
+// Add all triangles with an emissive material in a model as area lights
+///////////////////////////////////////////////////////////////////////////
+void addAreaLights(const labhelper::Model* model, const mat4& model_matrix);
+
 ///////////////////////////////////////////////////////////////////////////
 // Restart rendering of image
 ///////////////////////////////////////////////////////////////////////////
@@ -73,4 +136,92 @@ void resize(int w, int h);
 // Trace one path per pixel
 ///////////////////////////////////////////////////////////////////////////
 void tracePaths(const mat4& V, const mat4& P);
+
+///////////////////////////////////////////////////////////////////////////
+// A rectangle [x0, x1) x [y0, y1) of an image
+///////////////////////////////////////////////////////////////////////////
+struct Tile
+{
+	int x0, y0, x1, y1;
+	int width() const
+	{
+		return x1 - x0;
+	}
+	int height() const
+	{
+		return y1 - y0;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Region of interest. When enabled, tracePaths() only traces the pixels
+// inside the crop window and leaves the rest of rendered_image as it is.
+// In bucket mode the crop window is split into buckets of bucket_size
+// pixels, and each bucket is traced to bucket_samples paths per pixel
+// before moving on to the next one. Call restart() after changing the
+// window or the mode. Path guiding is only trained on, and used for,
+// passes over the whole image, so it is off while a region is enabled.
+///////////////////////////////////////////////////////////////////////////
+extern struct RegionOfInterest
+{
+	bool enabled = false;
+	// The crop window, in [0, 1] image coordinates with y = 0 at the
+	// bottom row of rendered_image
+	vec2 min = vec2(0.0f);
+	vec2 max = vec2(1.0f);
+	bool bucket_mode = false;
+	int bucket_size = 32;
+	int bucket_samples = 64;
+	// Progress: samples per pixel in the region (or in the current bucket)
+	int number_of_samples = 0;
+	int current_bucket = 0;
+} region;
+
+///////////////////////////////////////////////////////////////////////////
+// Restrict tracing to a crop window, or go back to the whole image
+///////////////////////////////////////////////////////////////////////////
+void setRegionOfInterest(const vec2& min, const vec2& max);
+void clearRegionOfInterest();
+
+///////////////////////////////////////////////////////////////////////////
+// The crop window in pixels of rendered_image, and its buckets
+///////////////////////////////////////////////////////////////////////////
+Tile regionTile();
+int numberOfBuckets();
+Tile bucketTile(int bucket);
+
+///////////////////////////////////////////////////////////////////////////
+// Trace one path per pixel in a tile of an image of size width x height,
+// and add the radiance of each path to sums (row major, one per pixel of
+// the tile). sample is the index of this sample in the pixels, and
+// selects the stratum. Does not touch rendered_image. If costs is given,
+// the cost of each path (see cost_image) is added to it.
+///////////////////////////////////////////////////////////////////////////
+void traceTile(const mat4& V,
+               const mat4& P,
+               int width,
+               int height,
+               const Tile& tile,
+               int sample,
+               vec3* sums,
+               float* costs = nullptr);
+
+///////////////////////////////////////////////////////////////////////////
+// Primary visibility found elsewhere, e.g. by rasterization: the geometry
+// and primitive seen at the center of every stratum of an image of size
+// width x height, as a (width * strata) x (height * strata) buffer with
+// the bottom row first. geomID is RTC_INVALID_GEOMETRY_ID where nothing
+// was seen. Fills the primary hit cache for V and P, so that traceTile()
+// does not have to trace those primary rays. Needs cache_primary_hits.
+///////////////////////////////////////////////////////////////////////////
+struct VisibilitySample
+{
+	uint32_t geomID, primID;
+};
+void setPrimaryVisibility(const mat4& V,
+                          const mat4& P,
+                          int width,
+                          int height,
+                          int strata,
+                          const VisibilitySample* samples);
 }; // namespace pathtracer
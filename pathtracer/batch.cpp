@@ -0,0 +1,465 @@
+#include "batch.h"
+#include <stb_image_write.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <glm/gtx/transform.hpp>
+#include "Pathtracer.h"
+#include "guiding.h"
+#include "statistics.h"
+#include "tiled_image.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+namespace batch
+{
+static string directoryOf(const string& filename)
+{
+	const size_t slash = filename.find_last_of("/\\");
+	return slash == string::npos ? string() : filename.substr(0, slash + 1);
+}
+
+static string resolve(const string& directory, const string& path)
+{
+	const bool absolute = !path.empty() && (path[0] == '/' || path[0] == '\\' || path.find(':') != string::npos);
+	return absolute ? path : directory + path;
+}
+
+static bool hasExtension(const string& filename, const string& extension)
+{
+	return filename.size() >= extension.size()
+	       && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+static bool readVec3(istringstream& line, vec3& v)
+{
+	return bool(line >> v.x >> v.y >> v.z);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The output name of a turntable frame: the run of '#' replaced by the
+// zero padded frame number
+///////////////////////////////////////////////////////////////////////////
+static string frameName(const string& pattern, int frame)
+{
+	const size_t first = pattern.find('#');
+	if(first == string::npos)
+	{
+		return pattern;
+	}
+	const size_t last = pattern.find_first_not_of('#', first);
+	const size_t width = (last == string::npos ? pattern.size() : last) - first;
+	string number = to_string(frame);
+	if(number.size() < width)
+	{
+		number = string(width - number.size(), '0') + number;
+	}
+	return pattern.substr(0, first) + number + (last == string::npos ? string() : pattern.substr(last));
+}
+
+bool loadJobFile(const string& filename, JobFile& job_file)
+{
+	ifstream file(filename);
+	if(!file)
+	{
+		cout << "Could not open job file " << filename << ".\n";
+		return false;
+	}
+	const string directory = directoryOf(filename);
+	job_file = JobFile();
+
+	// The state that jobs are made from, with the defaults of the
+	// interactive pathtracer
+	Job state;
+	state.camera_position = vec3(-30.0f, 10.0f, 30.0f);
+	state.camera_target = vec3(0.0f, 10.0f, 0.0f);
+	state.fov = 45.0f;
+	state.width = 1280;
+	state.height = 720;
+	state.samples = 256;
+	state.max_bounces = 8;
+	state.strata = 2;
+	state.point_light.intensity_multiplier = 2500.0f;
+	state.point_light.color = vec3(1.0f);
+	state.point_light.position = vec3(10.0f, 40.0f, 10.0f);
+	state.environment_multiplier = 1.0f;
+
+	string text;
+	for(int line_number = 1; getline(file, text); line_number++)
+	{
+		istringstream line(text);
+		string directive;
+		if(!(line >> directive) || directive[0] == '#')
+		{
+			continue;
+		}
+		bool ok = true;
+		string error;
+		if(directive == "model" || directive == "environment")
+		{
+			if(!job_file.jobs.empty())
+			{
+				ok = false;
+				error = directive + " must come before the first job";
+			}
+			else if(directive == "model")
+			{
+				SceneDescription::ModelInstance instance;
+				ok = bool(line >> instance.filename);
+				instance.filename = resolve(directory, instance.filename);
+				instance.model_matrix = mat4(1.0f);
+				string transform;
+				while(ok && line >> transform)
+				{
+					vec3 v;
+					float f;
+					if(transform == "translate" && readVec3(line, v))
+						instance.model_matrix = instance.model_matrix * translate(v);
+					else if(transform == "rotate" && line >> f && readVec3(line, v))
+						instance.model_matrix = instance.model_matrix * rotate(radians(f), normalize(v));
+					else if(transform == "scale" && line >> f)
+						instance.model_matrix = instance.model_matrix * scale(vec3(f));
+					else
+					{
+						ok = false;
+						error = "bad transform " + transform;
+					}
+				}
+				job_file.scene.models.push_back(instance);
+			}
+			else
+			{
+				ok = bool(line >> job_file.scene.environment_map);
+				job_file.scene.environment_map = resolve(directory, job_file.scene.environment_map);
+				float multiplier;
+				if(ok && line >> multiplier)
+				{
+					state.environment_multiplier = multiplier;
+				}
+			}
+		}
+		else if(directive == "light")
+		{
+			ok = readVec3(line, state.point_light.position);
+			string option;
+			while(ok && line >> option)
+			{
+				if(option == "color")
+					ok = readVec3(line, state.point_light.color);
+				else if(option == "intensity")
+					ok = bool(line >> state.point_light.intensity_multiplier);
+				else
+					ok = false;
+			}
+		}
+		else if(directive == "environment_multiplier")
+			ok = bool(line >> state.environment_multiplier);
+		else if(directive == "size")
+			ok = line >> state.width >> state.height && state.width > 0 && state.height > 0;
+		else if(directive == "fov")
+			ok = line >> state.fov && state.fov > 0.0f && state.fov < 180.0f;
+		else if(directive == "samples")
+			ok = line >> state.samples && state.samples > 0;
+		else if(directive == "max_bounces")
+			ok = line >> state.max_bounces && state.max_bounces >= 0;
+		else if(directive == "strata")
+			ok = line >> state.strata && state.strata > 0;
+		else if(directive == "camera")
+			ok = readVec3(line, state.camera_position) && readVec3(line, state.camera_target);
+		else if(directive == "render" || directive == "turntable")
+		{
+			int frames = 1;
+			if(directive == "turntable")
+			{
+				ok = line >> frames && frames > 0;
+			}
+			string output;
+			ok = ok && line >> output;
+			if(ok && !hasExtension(output, ".png") && !hasExtension(output, ".hdr") && !hasExtension(output, ".pfm"))
+			{
+				ok = false;
+				error = "output must be a .png, .hdr or .pfm file";
+			}
+			for(int frame = 0; ok && frame < frames; frame++)
+			{
+				Job job = state;
+				job.output = resolve(directory, directive == "turntable" ? frameName(output, frame) : output);
+				const float angle = 2.0f * M_PI * float(frame) / float(frames);
+				job.camera_position = state.camera_target
+				                      + vec3(rotate(angle, vec3(0.0f, 1.0f, 0.0f))
+				                             * vec4(state.camera_position - state.camera_target, 0.0f));
+				job_file.jobs.push_back(job);
+			}
+		}
+		else
+		{
+			ok = false;
+			error = "unknown directive " + directive;
+		}
+		if(!ok)
+		{
+			cout << filename << ":" << line_number << ": " << (error.empty() ? "bad " + directive : error) << "\n";
+			return false;
+		}
+	}
+	job_file.scene.point_light = state.point_light;
+	job_file.scene.environment_multiplier = state.environment_multiplier;
+	if(!job_file.jobs.empty())
+	{
+		// The scene is set up with the lights of the first job
+		job_file.scene.point_light = job_file.jobs[0].point_light;
+		job_file.scene.environment_multiplier = job_file.jobs[0].environment_multiplier;
+	}
+	return true;
+}
+
+static bool isStreamed(const Job& job)
+{
+	return hasExtension(job.output, ".pfm");
+}
+
+void beginJob(const Job& job, mat4& V, mat4& P)
+{
+	settings.subsampling = 1;
+	settings.max_paths_per_pixel = 0;
+	settings.max_bounces = job.max_bounces;
+	settings.strata = job.strata;
+	point_light = job.point_light;
+	environment.multiplier = job.environment_multiplier;
+	// The primary hit cache fixes the sub-pixel positions of the strata,
+	// and these images (and the benchmark references) should converge to
+	// the pixel integral
+	settings.cache_primary_hits = false;
+	if(isStreamed(job))
+	{
+		// Streamed jobs trace each tile to completion before the next, so a
+		// guiding pass would only ever see one tile
+		guiding::options.enabled = false;
+	}
+	else
+	{
+		resize(job.width, job.height);
+		restart();
+	}
+	V = lookAt(job.camera_position, job.camera_target, vec3(0.0f, 1.0f, 0.0f));
+	P = perspective(radians(job.fov), float(job.width) / float(job.height), 0.1f, 100.0f);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A hash (64 bit FNV-1a) of everything that the pixels of a job depend on
+///////////////////////////////////////////////////////////////////////////
+struct JobHash
+{
+	uint64_t value = 14695981039346656037ull;
+	void add(const void* data, size_t size)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		for(size_t i = 0; i < size; i++)
+		{
+			value = (value ^ bytes[i]) * 1099511628211ull;
+		}
+	}
+	template<typename T>
+	void add(const T& value)
+	{
+		add(&value, sizeof(T));
+	}
+	void add(const string& s)
+	{
+		add(uint64_t(s.size()));
+		add(s.data(), s.size());
+	}
+};
+
+static uint64_t jobHash(const SceneDescription& scene, const Job& job)
+{
+	JobHash hash;
+	hash.add(job.camera_position);
+	hash.add(job.camera_target);
+	hash.add(job.fov);
+	hash.add(job.width);
+	hash.add(job.height);
+	hash.add(job.samples);
+	hash.add(job.max_bounces);
+	hash.add(job.strata);
+	hash.add(job.point_light);
+	hash.add(job.environment_multiplier);
+	hash.add(scene.environment_map);
+	hash.add(uint64_t(scene.models.size()));
+	for(const auto& instance : scene.models)
+	{
+		hash.add(instance.filename);
+		hash.add(instance.model_matrix);
+	}
+	return hash.value;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Render a job tile by tile, each to its full number of samples, into a
+// tiled image next to the output, and convert that to the output once all
+// tiles are done. Memory use does not depend on the size of the image.
+// Continues where an interrupted render of the same job stopped; a tiled
+// image of anything else is started over.
+///////////////////////////////////////////////////////////////////////////
+static bool renderStreamed(const SceneDescription& scene, const Job& job, const mat4& V, const mat4& P)
+{
+	const int tile_size = 64;
+	const string tiles_filename = job.output + ".tiles";
+	const uint64_t hash = jobHash(scene, job);
+	TiledImageFile tiles;
+	if(tiles.open(tiles_filename) && tiles.width == job.width && tiles.height == job.height
+	   && tiles.tile_size == tile_size && tiles.content_hash == hash)
+	{
+		cout << "continuing " << tiles_filename << " (" << tiles.numberOfWrittenTiles() << "/"
+		     << tiles.numberOfTiles() << " tiles)..." << flush;
+	}
+	else if(!tiles.create(tiles_filename, job.width, job.height, tile_size, hash))
+	{
+		return false;
+	}
+	vector<vec3> sums(tile_size * tile_size);
+	for(int i = 0; i < tiles.numberOfTiles(); i++)
+	{
+		if(tiles.isWritten(i))
+		{
+			continue;
+		}
+		const Tile tile = tiles.tile(i);
+		fill(sums.begin(), sums.end(), vec3(0.0f));
+		const uint64_t start = statistics::now();
+		for(int sample = 0; sample < job.samples; sample++)
+		{
+			traceTile(V, P, job.width, job.height, tile, sample, sums.data());
+		}
+		// One pass per tile, to keep the statistics small for huge images
+		statistics::endPass(uint64_t(tile.width()) * tile.height() * job.samples,
+		                    double(statistics::now() - start) * 1e-9);
+		for(vec3& sum : sums)
+		{
+			sum /= float(job.samples);
+		}
+		if(!tiles.writeTile(i, sums.data()))
+		{
+			cout << "Could not write tile " << i << " to " << tiles_filename << ".\n";
+			return false;
+		}
+	}
+	tiles.close();
+	if(!convertToPFM(tiles_filename, job.output))
+	{
+		return false;
+	}
+	remove(tiles_filename.c_str());
+	return true;
+}
+
+bool saveImage(const string& filename)
+{
+	const int width = rendered_image.width, height = rendered_image.height;
+	bool ok;
+	// Images are stored top row first
+	if(hasExtension(filename, ".hdr"))
+	{
+		vector<vec3> flipped(size_t(width) * height);
+		for(int y = 0; y < height; y++)
+		{
+			copy(&rendered_image.data[size_t(height - 1 - y) * width],
+			     &rendered_image.data[size_t(height - 1 - y) * width] + width, &flipped[size_t(y) * width]);
+		}
+		ok = stbi_write_hdr(filename.c_str(), width, height, 3, &flipped[0].x) != 0;
+	}
+	else
+	{
+		vector<uint8_t> pixels(size_t(width) * height * 3);
+		for(int y = 0; y < height; y++)
+		{
+			for(int x = 0; x < width; x++)
+			{
+				const vec3& c = rendered_image.data[size_t(height - 1 - y) * width + x];
+				for(int i = 0; i < 3; i++)
+				{
+					pixels[(size_t(y) * width + x) * 3 + i] = uint8_t(clamp(c[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+				}
+			}
+		}
+		ok = stbi_write_png(filename.c_str(), width, height, 3, pixels.data(), width * 3) != 0;
+	}
+	if(!ok)
+	{
+		cout << "Could not write " << filename << ".\n";
+	}
+	return ok;
+}
+
+int run(const string& filename)
+{
+	JobFile job_file;
+	if(!loadJobFile(filename, job_file))
+	{
+		return 1;
+	}
+	if(job_file.jobs.empty())
+	{
+		cout << filename << " has no render or turntable jobs.\n";
+		return 1;
+	}
+	if(job_file.scene.models.empty())
+	{
+		cout << filename << " has no models.\n";
+		return 1;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Set up the scene once for all jobs
+	///////////////////////////////////////////////////////////////////////
+	auto setup_start = chrono::steady_clock::now();
+	vector<pair<labhelper::Model*, mat4>> models = loadScene(job_file.scene, false);
+	cout << "Scene set up in " << chrono::duration<float>(chrono::steady_clock::now() - setup_start).count()
+	     << " s.\n";
+
+	int failures = 0;
+	for(size_t i = 0; i < job_file.jobs.size(); i++)
+	{
+		const Job& job = job_file.jobs[i];
+		mat4 V, P;
+		beginJob(job, V, P);
+
+		cout << "Job " << i + 1 << "/" << job_file.jobs.size() << ": " << job.samples << " samples to "
+		     << job.output << "..." << flush;
+		statistics::reset();
+		auto start = chrono::steady_clock::now();
+		bool ok;
+		if(isStreamed(job))
+		{
+			ok = renderStreamed(job_file.scene, job, V, P);
+		}
+		else
+		{
+			for(int sample = 0; sample < job.samples; sample++)
+			{
+				tracePaths(V, P);
+			}
+			ok = true;
+		}
+		const float seconds = chrono::duration<float>(chrono::steady_clock::now() - start).count();
+		cout << "done (" << seconds << " s, " << statistics::total().raysPerSecond() * 1e-6 << " Mrays/s).\n";
+		if(!ok || (!isStreamed(job) && !saveImage(job.output)))
+		{
+			failures++;
+		}
+	}
+
+	for(auto& m : models)
+	{
+		labhelper::freeModel(m.first);
+	}
+	return failures > 0 ? 1 : 0;
+}
+} // namespace batch
+} // namespace pathtracer
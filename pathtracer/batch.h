@@ -0,0 +1,88 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "scene.h"
+
+///////////////////////////////////////////////////////////////////////////
+// Job files describe a scene and a list of images to render from it. The
+// batch runner loads the scene and builds the BVH once, and then renders
+// every job back to back. A job file is a list of directives, one per
+// line (lines starting with '#' are comments):
+//
+//   model <file.obj> [translate x y z] [rotate degrees x y z] [scale s]
+//   environment <file.hdr> [multiplier]
+//   light <x y z> [color r g b] [intensity i]
+//   environment_multiplier <m>
+//   size <width> <height>
+//   fov <degrees>
+//   samples <paths per pixel>
+//   max_bounces <n>
+//   strata <n>
+//   camera <position x y z> <target x y z>
+//   render <output.png|output.hdr|output.pfm>
+//   turntable <frames> <output_###.png>
+//
+// Directives other than model and environment set state for the jobs
+// that follow them, so e.g. a light can be changed between two renders.
+// model and environment must come before the first job. turntable adds a
+// job per frame, with the camera rotated around its target about the y
+// axis; the run of '#' in the output name is replaced by the zero padded
+// frame number. Relative paths are relative to the job file.
+//
+// Jobs with a .pfm output are streamed: they are rendered a tile at a time
+// to output.pfm.tiles (see tiled_image.h), without allocating the whole
+// image, which makes poster sized images possible. Running the job file
+// again continues an interrupted streamed job, unless the job or the
+// scene directives have changed since. Path guiding is not used for
+// streamed jobs.
+///////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+namespace batch
+{
+struct Job
+{
+	std::string output;
+	glm::vec3 camera_position;
+	glm::vec3 camera_target;
+	float fov;
+	int width, height;
+	int samples;
+	int max_bounces;
+	int strata;
+	PointLight point_light;
+	float environment_multiplier;
+};
+
+struct JobFile
+{
+	SceneDescription scene;
+	std::vector<Job> jobs;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Parse a job file. Reports the first error with its line and returns
+// false.
+///////////////////////////////////////////////////////////////////////////
+bool loadJobFile(const std::string& filename, JobFile& job_file);
+
+///////////////////////////////////////////////////////////////////////////
+// Set the pathtracer up for a job on an already loaded scene, restart it,
+// and return the view and projection matrices to trace with
+///////////////////////////////////////////////////////////////////////////
+void beginJob(const Job& job, glm::mat4& V, glm::mat4& P);
+
+///////////////////////////////////////////////////////////////////////////
+// Write rendered_image to a .png (clamped to [0, 1], as it is displayed)
+// or .hdr file
+///////////////////////////////////////////////////////////////////////////
+bool saveImage(const std::string& filename);
+
+///////////////////////////////////////////////////////////////////////////
+// Render all jobs of a job file, without a window. Returns the exit code
+// of the process.
+///////////////////////////////////////////////////////////////////////////
+int run(const std::string& filename);
+} // namespace batch
+} // namespace pathtracer
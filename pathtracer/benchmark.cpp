@@ -0,0 +1,158 @@
+#include "benchmark.h"
+#include <stb_image.h>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include "Pathtracer.h"
+#include "batch.h"
+#include "scene.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+namespace benchmark
+{
+Options options;
+
+///////////////////////////////////////////////////////////////////////////
+// Errors of rendered_image against a reference
+///////////////////////////////////////////////////////////////////////////
+struct Error
+{
+	double rmse;
+	double relmse;
+};
+
+static Error compare(const vector<vec3>& reference)
+{
+	// Keeps relMSE finite where the reference is black
+	const double epsilon = 0.01;
+	double squared = 0.0, relative = 0.0;
+	for(size_t i = 0; i < reference.size(); i++)
+	{
+		for(int c = 0; c < 3; c++)
+		{
+			const double r = reference[i][c];
+			const double d = double(rendered_image.data[i][c]) - r;
+			squared += d * d;
+			relative += d * d / (r * r + epsilon);
+		}
+	}
+	const double n = double(reference.size()) * 3.0;
+	Error error;
+	error.rmse = sqrt(squared / n);
+	error.relmse = relative / n;
+	return error;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Load a reference image, bottom row first like rendered_image
+///////////////////////////////////////////////////////////////////////////
+static bool loadReference(const batch::Job& job, vector<vec3>& reference)
+{
+	int width, height, components;
+	stbi_set_flip_vertically_on_load(true);
+	float* data = stbi_loadf(job.output.c_str(), &width, &height, &components, 3);
+	if(data == nullptr)
+	{
+		cout << "Could not load the reference " << job.output << ". Render it with --batch first.\n";
+		return false;
+	}
+	const bool same_size = width == job.width && height == job.height;
+	if(same_size)
+	{
+		reference.assign(reinterpret_cast<vec3*>(data), reinterpret_cast<vec3*>(data) + size_t(width) * height);
+	}
+	else
+	{
+		cout << "The reference " << job.output << " is " << width << "x" << height << ", but the job is "
+		     << job.width << "x" << job.height << ".\n";
+	}
+	stbi_image_free(data);
+	return same_size;
+}
+
+int run(const string& job_filename, const string& results_filename)
+{
+	batch::JobFile job_file;
+	if(!batch::loadJobFile(job_filename, job_file))
+	{
+		return 1;
+	}
+	if(job_file.jobs.empty() || job_file.scene.models.empty())
+	{
+		cout << job_filename << " has no models or no jobs.\n";
+		return 1;
+	}
+	vector<vector<vec3>> references(job_file.jobs.size());
+	for(size_t i = 0; i < job_file.jobs.size(); i++)
+	{
+		if(!loadReference(job_file.jobs[i], references[i]))
+		{
+			return 1;
+		}
+	}
+
+	// Results of several job files can be collected in one file
+	ofstream results(results_filename, ios::app);
+	if(!results)
+	{
+		cout << "Could not open " << results_filename << " for writing.\n";
+		return 1;
+	}
+	if(results.tellp() == 0)
+	{
+		results << "job_file,job,samples,seconds,rmse,relmse\n";
+	}
+
+	vector<pair<labhelper::Model*, mat4>> models = loadScene(job_file.scene, false);
+	for(size_t i = 0; i < job_file.jobs.size(); i++)
+	{
+		const batch::Job& job = job_file.jobs[i];
+		mat4 V, P;
+		batch::beginJob(job, V, P);
+		cout << "Benchmarking " << job.output << ":\n";
+		cout << "  samples  seconds        RMSE      relMSE\n";
+
+		// Only tracing is timed, not the comparisons
+		double seconds = 0.0;
+		Error error = {};
+		int samples = 0;
+		for(int next_measurement = 1; samples < options.max_samples && seconds < options.max_seconds;)
+		{
+			auto start = chrono::steady_clock::now();
+			tracePaths(V, P);
+			seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			samples++;
+			if(samples == next_measurement || samples == options.max_samples || seconds >= options.max_seconds)
+			{
+				error = compare(references[i]);
+				results << job_filename << "," << job.output << "," << samples << "," << seconds << ","
+				        << error.rmse << "," << error.relmse << "\n";
+				cout << "  " << setw(7) << samples << " " << setw(8) << seconds << " " << setw(11) << error.rmse << " "
+				     << setw(11) << error.relmse << "\n";
+				while(next_measurement <= samples)
+				{
+					next_measurement *= 2;
+				}
+			}
+		}
+		// Higher is better, and independent of how long the job ran for an
+		// unbiased renderer, as relMSE falls with 1 / seconds
+		cout << "  Efficiency 1/(relMSE * seconds): " << (error.relmse > 0.0 ? 1.0 / (error.relmse * seconds) : 0.0)
+		     << "\n";
+	}
+
+	for(auto& m : models)
+	{
+		labhelper::freeModel(m.first);
+	}
+	return results ? 0 : 1;
+}
+} // namespace benchmark
+} // namespace pathtracer
@@ -0,0 +1,33 @@
+#pragma once
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////
+// Time-to-quality benchmark. Renders the jobs of a job file (see batch.h)
+// progressively and, at every power of two samples per pixel, compares
+// the image to a reference: the job's output image, as rendered with many
+// samples by --batch. RMSE and relMSE are recorded against both samples
+// and wall clock time, so that changes to sampling can be compared by how
+// fast they converge rather than by eye.
+//
+// The benchmark scenes live in scenes/benchmark/. Render their references
+// once with --batch, and after that run --benchmark on each of them.
+///////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+namespace benchmark
+{
+extern struct Options
+{
+	// Stop a job at this many samples per pixel, or when it has been
+	// traced for max_seconds, whichever comes first
+	int max_samples = 1024;
+	float max_seconds = 60.0f;
+} options;
+
+///////////////////////////////////////////////////////////////////////////
+// Benchmark all jobs of a job file, and append one line per measurement
+// to a .csv file. Returns the exit code of the process.
+///////////////////////////////////////////////////////////////////////////
+int run(const std::string& job_filename, const std::string& results_filename);
+} // namespace benchmark
+} // namespace pathtracer
@@ -0,0 +1,680 @@
+#include "bvh.h"
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <omp.h>
+#include "numa.h"
+#include "sampling.h"
+#ifdef PATHTRACER_AVX2
+#include "simd.h"
+#endif
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+namespace bvh
+{
+///////////////////////////////////////////////////////////////////////////
+// Build parameters
+///////////////////////////////////////////////////////////////////////////
+const int number_of_bins = 16;
+const int max_leaf_size = 8;      // Must fit in the 4 bits of a leaf child
+const int max_depth = 64;         // Of the binary tree, bounds the stack
+const int parallel_threshold = 4096; // Build subtrees larger than this as tasks
+const float traversal_cost = 1.0f;
+const float intersection_cost = 1.0f;
+
+///////////////////////////////////////////////////////////////////////////
+// A triangle stored as one vertex and two edges, ready for the
+// Moller-Trumbore test
+///////////////////////////////////////////////////////////////////////////
+struct Triangle
+{
+	vec3 v0, e1, e2;
+	uint32_t geom_ID, prim_ID;
+};
+vector<Triangle> triangles;
+
+///////////////////////////////////////////////////////////////////////////
+// 8-wide node. Child boxes are stored relative to the bounds of the node
+// in steps of scale, rounded outwards to 8 bits. A child is either an
+// inner node (its index) or a leaf (leaf_flag, the first triangle and
+// the number of triangles). Unused children are empty leaves.
+///////////////////////////////////////////////////////////////////////////
+const uint32_t leaf_flag = 0x80000000u;
+struct Node8
+{
+	float origin[3];
+	float scale[3];
+	uint8_t lo[3][8];
+	uint8_t hi[3][8];
+	uint32_t children[8];
+};
+vector<Node8> nodes;
+
+///////////////////////////////////////////////////////////////////////////
+// Copies of nodes and triangles for NUMA nodes 1, 2, ..., each placed on
+// its node, if numa::replicate_scene is set. NUMA node 0 uses the
+// originals.
+///////////////////////////////////////////////////////////////////////////
+struct Replica
+{
+	vector<Node8> nodes;
+	vector<Triangle> triangles;
+};
+vector<Replica> replicas;
+
+///////////////////////////////////////////////////////////////////////////
+// Per thread traversal counters, a cache line each
+///////////////////////////////////////////////////////////////////////////
+struct alignas(cache_line_size) Counters
+{
+	uint64_t rays = 0;
+	uint64_t node_visits = 0;
+	uint64_t triangle_tests = 0;
+};
+vector<Counters, CacheLineAllocator<Counters>> counters(maxThreads());
+
+///////////////////////////////////////////////////////////////////////////
+// Add triangles to be built into the BVH
+///////////////////////////////////////////////////////////////////////////
+void addTriangles(uint32_t geom_ID, const vec3* vertices, uint32_t number_of_triangles)
+{
+	for(uint32_t i = 0; i < number_of_triangles; i++)
+	{
+		Triangle t;
+		t.v0 = vertices[i * 3 + 0];
+		t.e1 = vertices[i * 3 + 1] - t.v0;
+		t.e2 = vertices[i * 3 + 2] - t.v0;
+		t.geom_ID = geom_ID;
+		t.prim_ID = i;
+		triangles.push_back(t);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Binary build tree
+///////////////////////////////////////////////////////////////////////////
+struct AABB
+{
+	vec3 min = vec3(FLT_MAX);
+	vec3 max = vec3(-FLT_MAX);
+	void extend(const vec3& p)
+	{
+		min = glm::min(min, p);
+		max = glm::max(max, p);
+	}
+	void extend(const AABB& b)
+	{
+		min = glm::min(min, b.min);
+		max = glm::max(max, b.max);
+	}
+	float area() const
+	{
+		vec3 d = max - min;
+		if(d.x < 0.0f)
+			return 0.0f;
+		return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+};
+
+struct BuildPrimitive
+{
+	AABB bounds;
+	vec3 centroid;
+	int index;
+};
+
+struct BuildNode
+{
+	AABB bounds;
+	BuildNode* children[2] = { nullptr, nullptr };
+	int first = 0, count = 0;
+	bool isLeaf() const
+	{
+		return children[0] == nullptr;
+	}
+	~BuildNode()
+	{
+		delete children[0];
+		delete children[1];
+	}
+};
+
+static BuildNode* makeLeaf(const AABB& bounds, int begin, int end)
+{
+	BuildNode* node = new BuildNode;
+	node->bounds = bounds;
+	node->first = begin;
+	node->count = end - begin;
+	return node;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Build a subtree over prims[begin, end). Subtrees work on disjoint
+// ranges, so large ones are built as parallel tasks.
+///////////////////////////////////////////////////////////////////////////
+static BuildNode* buildRecursive(vector<BuildPrimitive>& prims, int begin, int end, int depth)
+{
+	AABB bounds, centroid_bounds;
+	for(int i = begin; i < end; i++)
+	{
+		bounds.extend(prims[i].bounds);
+		centroid_bounds.extend(prims[i].centroid);
+	}
+	const int count = end - begin;
+	if(count <= 1)
+	{
+		return makeLeaf(bounds, begin, end);
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Find the split with the lowest SAH cost among the bin boundaries of
+	// all three axes
+	///////////////////////////////////////////////////////////////////////
+	float best_cost = FLT_MAX;
+	int best_axis = -1, best_split = 0;
+	const vec3 extent = centroid_bounds.max - centroid_bounds.min;
+	for(int axis = 0; axis < 3; axis++)
+	{
+		if(extent[axis] <= 0.0f)
+			continue;
+		AABB bin_bounds[number_of_bins];
+		int bin_count[number_of_bins] = {};
+		const float k = float(number_of_bins) * (1.0f - 1e-5f) / extent[axis];
+		for(int i = begin; i < end; i++)
+		{
+			int b = int((prims[i].centroid[axis] - centroid_bounds.min[axis]) * k);
+			bin_count[b]++;
+			bin_bounds[b].extend(prims[i].bounds);
+		}
+		// Sweep from the right to get the cost of everything right of a split
+		float right_cost[number_of_bins];
+		AABB right;
+		int right_count = 0;
+		for(int b = number_of_bins - 1; b > 0; b--)
+		{
+			right.extend(bin_bounds[b]);
+			right_count += bin_count[b];
+			right_cost[b] = right.area() * float(right_count);
+		}
+		AABB left;
+		int left_count = 0;
+		for(int b = 1; b < number_of_bins; b++)
+		{
+			left.extend(bin_bounds[b - 1]);
+			left_count += bin_count[b - 1];
+			float cost = left.area() * float(left_count) + right_cost[b];
+			if(left_count > 0 && left_count < count && cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_split = b;
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Make a leaf if that is cheaper, or split
+	///////////////////////////////////////////////////////////////////////
+	int mid;
+	if(best_axis >= 0)
+	{
+		const float split_cost = traversal_cost + intersection_cost * best_cost / bounds.area();
+		const float leaf_cost = intersection_cost * float(count);
+		if(count <= max_leaf_size && leaf_cost <= split_cost)
+		{
+			return makeLeaf(bounds, begin, end);
+		}
+		if(depth >= max_depth)
+		{
+			best_axis = -1;
+		}
+	}
+	if(best_axis >= 0)
+	{
+		const float k = float(number_of_bins) * (1.0f - 1e-5f) / extent[best_axis];
+		const float min = centroid_bounds.min[best_axis];
+		const int axis = best_axis, split = best_split;
+		mid = int(std::partition(prims.begin() + begin, prims.begin() + end,
+		                         [=](const BuildPrimitive& p) { return int((p.centroid[axis] - min) * k) < split; })
+		          - prims.begin());
+	}
+	else
+	{
+		// All centroids in one place (or too deep), so no split is better
+		// than another
+		if(count <= max_leaf_size)
+		{
+			return makeLeaf(bounds, begin, end);
+		}
+		mid = begin + count / 2;
+	}
+
+	BuildNode* node = new BuildNode;
+	node->bounds = bounds;
+	BuildNode* left = nullptr;
+	BuildNode* right = nullptr;
+	if(count > parallel_threshold)
+	{
+#pragma omp task shared(prims, left)
+		left = buildRecursive(prims, begin, mid, depth + 1);
+		right = buildRecursive(prims, mid, end, depth + 1);
+#pragma omp taskwait
+	}
+	else
+	{
+		left = buildRecursive(prims, begin, mid, depth + 1);
+		right = buildRecursive(prims, mid, end, depth + 1);
+	}
+	node->children[0] = left;
+	node->children[1] = right;
+	return node;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Quantize the box of a child relative to a node, rounding outwards so
+// that the dequantized box always contains the child.
+///////////////////////////////////////////////////////////////////////////
+static void quantize(Node8& node, int child, const AABB& bounds)
+{
+	for(int axis = 0; axis < 3; axis++)
+	{
+		const float origin = node.origin[axis];
+		const float scale = node.scale[axis];
+		int lo = int(std::floor((bounds.min[axis] - origin) / scale));
+		int hi = int(std::ceil((bounds.max[axis] - origin) / scale));
+		lo = std::max(0, std::min(255, lo));
+		hi = std::max(0, std::min(255, hi));
+		while(lo > 0 && origin + float(lo) * scale > bounds.min[axis])
+			lo--;
+		while(hi < 255 && origin + float(hi) * scale < bounds.max[axis])
+			hi++;
+		node.lo[axis][child] = uint8_t(lo);
+		node.hi[axis][child] = uint8_t(hi);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Turn a binary subtree into 8-wide nodes by repeatedly opening the
+// inner child with the largest surface area. Returns the node index.
+///////////////////////////////////////////////////////////////////////////
+static uint32_t collapse(const BuildNode* root)
+{
+	const BuildNode* children[8];
+	int n = 0;
+	if(root->isLeaf())
+	{
+		children[n++] = root;
+	}
+	else
+	{
+		children[n++] = root->children[0];
+		children[n++] = root->children[1];
+	}
+	while(n < 8)
+	{
+		int largest = -1;
+		for(int i = 0; i < n; i++)
+		{
+			if(!children[i]->isLeaf() && (largest < 0 || children[i]->bounds.area() > children[largest]->bounds.area()))
+				largest = i;
+		}
+		if(largest < 0)
+			break;
+		const BuildNode* opened = children[largest];
+		children[largest] = opened->children[0];
+		children[n++] = opened->children[1];
+	}
+
+	const uint32_t index = uint32_t(nodes.size());
+	nodes.push_back(Node8());
+	Node8 node;
+	// Pad the bounds a little so that rounding when dequantizing can not
+	// make a box smaller than its child
+	const vec3 padding = 1e-5f * (abs(root->bounds.min) + abs(root->bounds.max)) + vec3(1e-6f);
+	const vec3 origin = root->bounds.min - padding;
+	const vec3 scale = ((root->bounds.max + padding) - origin) * (1.0f / 255.0f) * (1.0f + 1e-5f);
+	for(int axis = 0; axis < 3; axis++)
+	{
+		node.origin[axis] = origin[axis];
+		node.scale[axis] = scale[axis];
+	}
+	for(int i = 0; i < 8; i++)
+	{
+		if(i >= n)
+		{
+			// An empty leaf with an inverted box
+			for(int axis = 0; axis < 3; axis++)
+			{
+				node.lo[axis][i] = 255;
+				node.hi[axis][i] = 0;
+			}
+			node.children[i] = leaf_flag;
+			continue;
+		}
+		quantize(node, i, children[i]->bounds);
+		if(children[i]->isLeaf())
+			node.children[i] = leaf_flag | (uint32_t(children[i]->first) << 4) | uint32_t(children[i]->count);
+		else
+			node.children[i] = collapse(children[i]);
+	}
+	nodes[index] = node;
+	return index;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Build the BVH over all triangles added so far
+///////////////////////////////////////////////////////////////////////////
+void build()
+{
+	cout << "Building SAH BVH over " << triangles.size() << " triangles..." << flush;
+	auto start = chrono::high_resolution_clock::now();
+	nodes.clear();
+	if(triangles.empty())
+	{
+		cout << "done.\n";
+		return;
+	}
+
+	vector<BuildPrimitive> prims(triangles.size());
+#pragma omp parallel for
+	for(int i = 0; i < int(triangles.size()); i++)
+	{
+		const Triangle& t = triangles[i];
+		BuildPrimitive& p = prims[i];
+		p.bounds.extend(t.v0);
+		p.bounds.extend(t.v0 + t.e1);
+		p.bounds.extend(t.v0 + t.e2);
+		p.centroid = 0.5f * (p.bounds.min + p.bounds.max);
+		p.index = i;
+	}
+
+	BuildNode* root = nullptr;
+#pragma omp parallel
+#pragma omp single
+	root = buildRecursive(prims, 0, int(prims.size()), 0);
+
+	// Store the triangles in leaf order
+	vector<Triangle> ordered(triangles.size());
+	for(size_t i = 0; i < prims.size(); i++)
+	{
+		ordered[i] = triangles[prims[i].index];
+	}
+	triangles.swap(ordered);
+
+	collapse(root);
+	delete root;
+
+	///////////////////////////////////////////////////////////////////////
+	// The first thread on each NUMA node makes the copy for its node, so
+	// that the pages end up there
+	///////////////////////////////////////////////////////////////////////
+	replicas.clear();
+	if(numa::enabled() && numa::replicate_scene && numa::numberOfNodes() > 1)
+	{
+		replicas.resize(numa::numberOfNodes() - 1);
+#pragma omp parallel
+		{
+			const int thread = omp_get_thread_num();
+			const int node = numa::threadNode();
+			if(node > 0 && (thread == 0 || numa::nodeOfThread(thread - 1) != node))
+			{
+				replicas[node - 1].nodes = nodes;
+				replicas[node - 1].triangles = triangles;
+			}
+		}
+	}
+
+	chrono::duration<float> seconds = chrono::high_resolution_clock::now() - start;
+	cout << "done (" << nodes.size() << " nodes, " << seconds.count() << " s).\n";
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A ray prepared for box tests
+///////////////////////////////////////////////////////////////////////////
+struct TraversalRay
+{
+	vec3 o, d;
+	vec3 inv_d;
+	vec3 o_inv_d;
+	int sign[3];
+};
+
+static TraversalRay prepare(const Ray& r)
+{
+	TraversalRay ray;
+	ray.o = r.o;
+	ray.d = r.d;
+	for(int axis = 0; axis < 3; axis++)
+	{
+		// Keep the inverse finite, so that no 0 * inf appears in the slabs
+		float d = r.d[axis];
+		if(std::abs(d) < 1e-20f)
+			d = d < 0.0f ? -1e-20f : 1e-20f;
+		ray.inv_d[axis] = 1.0f / d;
+		ray.o_inv_d[axis] = r.o[axis] * ray.inv_d[axis];
+		ray.sign[axis] = ray.inv_d[axis] < 0.0f ? 1 : 0;
+	}
+	return ray;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Test a ray against the eight child boxes of a node. Returns one bit per
+// child that is hit within [t_min, t_max], and the entry distances.
+///////////////////////////////////////////////////////////////////////////
+#ifdef PATHTRACER_AVX2
+static inline simd::floatx8 dequantize(const uint8_t* q, float origin, float scale)
+{
+	__m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(q));
+	simd::floatx8 f = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+	return simd::fmadd(f, simd::floatx8(scale), simd::floatx8(origin));
+}
+
+static inline int intersectChildren(const Node8& node, const TraversalRay& ray, float t_min, float t_max, float dist[8])
+{
+	simd::floatx8 t_near(t_min), t_far(t_max);
+	for(int axis = 0; axis < 3; axis++)
+	{
+		const uint8_t* near_planes = ray.sign[axis] ? node.hi[axis] : node.lo[axis];
+		const uint8_t* far_planes = ray.sign[axis] ? node.lo[axis] : node.hi[axis];
+		const simd::floatx8 inv_d(ray.inv_d[axis]), o_inv_d(ray.o_inv_d[axis]);
+		const simd::floatx8 n = dequantize(near_planes, node.origin[axis], node.scale[axis]);
+		const simd::floatx8 f = dequantize(far_planes, node.origin[axis], node.scale[axis]);
+		t_near = simd::max(t_near, simd::fmadd(n, inv_d, -o_inv_d));
+		t_far = simd::min(t_far, simd::fmadd(f, inv_d, -o_inv_d));
+	}
+	t_near.store(dist);
+	return simd::bits(t_near <= t_far);
+}
+#else
+static inline int intersectChildren(const Node8& node, const TraversalRay& ray, float t_min, float t_max, float dist[8])
+{
+	int mask = 0;
+	for(int i = 0; i < 8; i++)
+	{
+		float t_near = t_min, t_far = t_max;
+		for(int axis = 0; axis < 3; axis++)
+		{
+			const uint8_t n = ray.sign[axis] ? node.hi[axis][i] : node.lo[axis][i];
+			const uint8_t f = ray.sign[axis] ? node.lo[axis][i] : node.hi[axis][i];
+			const float origin = node.origin[axis], scale = node.scale[axis];
+			t_near = std::max(t_near, (origin + float(n) * scale) * ray.inv_d[axis] - ray.o_inv_d[axis]);
+			t_far = std::min(t_far, (origin + float(f) * scale) * ray.inv_d[axis] - ray.o_inv_d[axis]);
+		}
+		dist[i] = t_near;
+		mask |= (t_near <= t_far ? 1 : 0) << i;
+	}
+	return mask;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+// Moller-Trumbore ray/triangle test. Both sides are hit, as in Embree.
+///////////////////////////////////////////////////////////////////////////
+static inline bool intersectTriangle(const Triangle& tri, const TraversalRay& ray, float t_min, float& t, float& u, float& v)
+{
+	const vec3 p = cross(ray.d, tri.e2);
+	const float det = dot(tri.e1, p);
+	if(det == 0.0f)
+		return false;
+	const float inv_det = 1.0f / det;
+	const vec3 s = ray.o - tri.v0;
+	const float uu = dot(s, p) * inv_det;
+	if(uu < 0.0f || uu > 1.0f)
+		return false;
+	const vec3 q = cross(s, tri.e1);
+	const float vv = dot(ray.d, q) * inv_det;
+	if(vv < 0.0f || uu + vv > 1.0f)
+		return false;
+	const float tt = dot(tri.e2, q) * inv_det;
+	if(tt <= t_min || tt >= t)
+		return false;
+	t = tt;
+	u = uu;
+	v = vv;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Traverse the BVH in front to back order. Returns the index of the
+// closest hit triangle (or the first found if any_hit), or -1.
+///////////////////////////////////////////////////////////////////////////
+static int traverse(const TraversalRay& ray, float t_min, float& t_max, float& u, float& v, bool any_hit)
+{
+	Counters& c = counters[omp_get_thread_num()];
+	c.rays++;
+	const int numa_node = numa::threadNode();
+	const bool replicated = numa_node > 0 && numa_node <= int(replicas.size());
+	const vector<Node8>& scene_nodes = replicated ? replicas[numa_node - 1].nodes : nodes;
+	const vector<Triangle>& scene_triangles = replicated ? replicas[numa_node - 1].triangles : triangles;
+	if(scene_nodes.empty())
+		return -1;
+
+	struct Entry
+	{
+		uint32_t child;
+		float dist;
+	};
+	// The forced median splits below max_depth add at most 32 more levels
+	Entry stack[8 * (max_depth + 32)];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, t_min };
+	int hit = -1;
+	while(stack_size > 0)
+	{
+		const Entry entry = stack[--stack_size];
+		if(entry.dist > t_max)
+			continue;
+		if(entry.child & leaf_flag)
+		{
+			const uint32_t first = (entry.child & ~leaf_flag) >> 4;
+			const uint32_t count = entry.child & 0xF;
+			c.triangle_tests += count;
+			for(uint32_t i = first; i < first + count; i++)
+			{
+				if(intersectTriangle(scene_triangles[i], ray, t_min, t_max, u, v))
+				{
+					hit = int(i);
+					if(any_hit)
+						return hit;
+				}
+			}
+			continue;
+		}
+
+		const Node8& node = scene_nodes[entry.child];
+		c.node_visits++;
+		float dist[8];
+		int mask = intersectChildren(node, ray, t_min, t_max, dist);
+		// Push the hit children far to near, so the nearest is popped first
+		Entry hits[8];
+		int number_of_hits = 0;
+		while(mask != 0)
+		{
+			int i = 0;
+			while(!(mask & (1 << i)))
+				i++;
+			mask &= mask - 1;
+			Entry e = { node.children[i], dist[i] };
+			int j = number_of_hits++;
+			while(j > 0 && hits[j - 1].dist < e.dist)
+			{
+				hits[j] = hits[j - 1];
+				j--;
+			}
+			hits[j] = e;
+		}
+		for(int i = 0; i < number_of_hits; i++)
+		{
+			stack[stack_size++] = hits[i];
+		}
+	}
+	return hit;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Test a ray against the scene and find the closest intersection
+///////////////////////////////////////////////////////////////////////////
+bool intersect(Ray& r)
+{
+	const TraversalRay ray = prepare(r);
+	float t = r.tfar, u, v;
+	int hit = traverse(ray, r.tnear, t, u, v, false);
+	if(hit < 0)
+		return false;
+	const Triangle& tri = triangles[hit];
+	r.tfar = t;
+	r.u = u;
+	r.v = v;
+	// Same orientation as Embree's geometry normal
+	r.n = cross(tri.e2, tri.e1);
+	r.geomID = tri.geom_ID;
+	r.primID = tri.prim_ID;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Test whether a ray is intersected by the scene
+///////////////////////////////////////////////////////////////////////////
+bool occluded(Ray& r)
+{
+	const TraversalRay ray = prepare(r);
+	float t = r.tfar, u, v;
+	if(traverse(ray, r.tnear, t, u, v, true) < 0)
+		return false;
+	// Embree marks an occluded ray like this
+	r.geomID = 0;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Traversal counters
+///////////////////////////////////////////////////////////////////////////
+Statistics statistics()
+{
+	Statistics s = { 0, 0, 0 };
+	for(const Counters& c : counters)
+	{
+		s.rays += c.rays;
+		s.node_visits += c.node_visits;
+		s.triangle_tests += c.triangle_tests;
+	}
+	return s;
+}
+
+void resetStatistics()
+{
+	for(Counters& c : counters)
+	{
+		c = Counters();
+	}
+}
+} // namespace bvh
+} // namespace pathtracer
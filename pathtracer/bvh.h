@@ -0,0 +1,46 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <stdint.h>
+#include "embree.h"
+
+///////////////////////////////////////////////////////////////////////////
+// An in-tree alternative to Embree. Triangles are organized in a binned
+// SAH BVH, which is collapsed into 8-wide nodes with child boxes
+// quantized to 8 bits per plane. With PATHTRACER_AVX2 all eight child
+// boxes of a node are tested against a ray at once.
+///////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+namespace bvh
+{
+///////////////////////////////////////////////////////////////////////////
+// Add number_of_triangles triangles (three consecutive world space
+// vertices each). Hits on them report geom_ID and the index of the
+// triangle as primID, like Embree does.
+///////////////////////////////////////////////////////////////////////////
+void addTriangles(uint32_t geom_ID, const glm::vec3* vertices, uint32_t number_of_triangles);
+
+///////////////////////////////////////////////////////////////////////////
+// Build the BVH over all triangles added so far
+///////////////////////////////////////////////////////////////////////////
+void build();
+
+///////////////////////////////////////////////////////////////////////////
+// Same semantics as pathtracer::intersect() and pathtracer::occluded()
+///////////////////////////////////////////////////////////////////////////
+bool intersect(Ray& r);
+bool occluded(Ray& r);
+
+///////////////////////////////////////////////////////////////////////////
+// Traversal counters, summed over all threads since the last reset
+///////////////////////////////////////////////////////////////////////////
+struct Statistics
+{
+	uint64_t rays;
+	uint64_t node_visits;
+	uint64_t triangle_tests;
+};
+Statistics statistics();
+void resetStatistics();
+} // namespace bvh
+} // namespace pathtracer
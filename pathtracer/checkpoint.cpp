@@ -0,0 +1,174 @@
+#include "checkpoint.h"
+#include "Pathtracer.h"
+#include "sampling.h"
+#include "guiding.h"
+#include "irradiance_cache.h"
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#undef near
+#undef far
+#endif
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// File layout: header, settings and lights, camera, the accumulated image
+// and finally the random generator state as text.
+///////////////////////////////////////////////////////////////////////////
+static const char checkpoint_magic[4] = { 'P', 'T', 'C', 'K' };
+static const uint32_t checkpoint_version = 2;
+
+struct CheckpointHeader
+{
+	char magic[4];
+	uint32_t version;
+	int32_t width, height;
+	int32_t number_of_samples;
+	Settings settings;
+	float environment_multiplier;
+	PointLight point_light;
+	CheckpointCamera camera;
+	uint64_t random_state_size;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Move a file to a name that may already exist, replacing that file
+///////////////////////////////////////////////////////////////////////////
+static bool replaceFile(const string& from, const string& to)
+{
+#ifdef _WIN32
+	// rename() fails on Windows if the target exists
+	return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	// and replaces it atomically everywhere else
+	return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+bool saveCheckpoint(const string& filename, const CheckpointCamera& camera)
+{
+	// The learned guiding distributions, the irradiance cache and the
+	// progress of a region or its buckets are not saved, so a resumed
+	// render could not continue where these left off.
+	if(guiding::options.enabled || irradiance_cache::options.enabled || region.enabled)
+	{
+		cout << "Not checkpointing " << filename
+		     << ": path guiding, the irradiance cache and regions of interest can not be checkpointed.\n";
+		return false;
+	}
+
+	CheckpointHeader header;
+	memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+	header.version = checkpoint_version;
+	header.width = rendered_image.width;
+	header.height = rendered_image.height;
+	header.number_of_samples = rendered_image.number_of_samples;
+	header.settings = settings;
+	header.environment_multiplier = environment.multiplier;
+	header.point_light = point_light;
+	header.camera = camera;
+	const string random_state = saveRandomState();
+	header.random_state_size = random_state.size();
+
+	const string temporary = filename + ".tmp";
+	{
+		ofstream file(temporary, ios::binary | ios::trunc);
+		if(!file.is_open())
+		{
+			cout << "Could not open checkpoint " << temporary << " for writing.\n";
+			return false;
+		}
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(rendered_image.data.data()),
+		           rendered_image.data.size() * sizeof(vec3));
+		file.write(random_state.data(), random_state.size());
+		if(!file.good())
+		{
+			cout << "Failed to write checkpoint " << temporary << ".\n";
+			return false;
+		}
+	}
+	if(!replaceFile(temporary, filename))
+	{
+		cout << "Could not move checkpoint into place at " << filename << ".\n";
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// An upper bound on the size of saveRandomState(): every generator is
+// written as its state words and position, in decimal, one separator
+// after each
+///////////////////////////////////////////////////////////////////////////
+static uint64_t maxRandomStateSize()
+{
+	const uint64_t word = numeric_limits<uint32_t>::digits10 + 2;
+	return uint64_t(maxThreads()) * (mt19937::state_size + 1) * word;
+}
+
+bool loadCheckpoint(const string& filename, CheckpointCamera& camera)
+{
+	ifstream file(filename, ios::binary);
+	if(!file.is_open())
+	{
+		cout << "Could not open checkpoint " << filename << ".\n";
+		return false;
+	}
+	CheckpointHeader header;
+	if(!file.read(reinterpret_cast<char*>(&header), sizeof(header))
+	   || memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0
+	   || header.version != checkpoint_version || header.width <= 0 || header.height <= 0)
+	{
+		cout << "Not a valid checkpoint: " << filename << ".\n";
+		return false;
+	}
+	// Check the sizes in the header against the file before allocating,
+	// so that a corrupt header can not ask for gigabytes
+	const streamoff header_end = file.tellg();
+	file.seekg(0, ios::end);
+	const uint64_t remaining = uint64_t(file.tellg() - header_end);
+	file.seekg(header_end);
+	const uint64_t pixels = uint64_t(header.width) * uint64_t(header.height);
+	if(pixels > remaining / sizeof(vec3) || header.random_state_size > maxRandomStateSize()
+	   || header.random_state_size != remaining - pixels * sizeof(vec3))
+	{
+		cout << "Checkpoint " << filename << " is truncated or corrupt.\n";
+		return false;
+	}
+	decltype(rendered_image.data) data(static_cast<size_t>(pixels));
+	string random_state(size_t(header.random_state_size), '\0');
+	if(!file.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(vec3))
+	   || !file.read(&random_state[0], random_state.size()))
+	{
+		cout << "Checkpoint " << filename << " is truncated.\n";
+		return false;
+	}
+	if(!loadRandomState(random_state))
+	{
+		cout << "Checkpoint " << filename << " has a corrupt random state, or was saved with a different number of threads.\n";
+		return false;
+	}
+	settings = header.settings;
+	environment.multiplier = header.environment_multiplier;
+	point_light = header.point_light;
+	camera = header.camera;
+	rendered_image.width = header.width;
+	rendered_image.height = header.height;
+	rendered_image.number_of_samples = header.number_of_samples;
+	rendered_image.data.swap(data);
+	return true;
+}
+} // namespace pathtracer
@@ -0,0 +1,39 @@
+#pragma once
+#include <string>
+#include <glm/glm.hpp>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// The camera that a checkpoint was rendered from. Stored as the raw
+// values that the view matrix is built from, so that a resumed render
+// sees exactly the same matrices.
+///////////////////////////////////////////////////////////////////////////
+struct CheckpointCamera
+{
+	glm::vec3 position;
+	glm::vec3 direction;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Write the progressive accumulation (rendered_image and its number of
+// samples), the settings, lights and camera it was rendered with and the
+// state of all random number generators to a file. The file is written
+// to a temporary name first and then renamed, so a crash while saving
+// never destroys the previous checkpoint.
+//
+// The state of path guiding, the irradiance cache and the region of
+// interest is not saved, so nothing is written while any of them is
+// enabled.
+///////////////////////////////////////////////////////////////////////////
+bool saveCheckpoint(const std::string& filename, const CheckpointCamera& camera);
+
+///////////////////////////////////////////////////////////////////////////
+// Restore everything written by saveCheckpoint(). The image keeps the
+// size it was saved with; call resize() with a window size of
+// (width * subsampling) x (height * subsampling) to keep it. Continuing
+// with the same number of OpenMP threads then gives bit-exactly the same
+// result as if the render had never stopped.
+///////////////////////////////////////////////////////////////////////////
+bool loadCheckpoint(const std::string& filename, CheckpointCamera& camera);
+} // namespace pathtracer
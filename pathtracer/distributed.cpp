@@ -0,0 +1,766 @@
+#include "distributed.h"
+#include "Pathtracer.h"
+#include "sampling.h"
+#include "irradiance_cache.h"
+#include "guiding.h"
+#include "statistics.h"
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#undef near
+#undef far
+typedef SOCKET socket_t;
+#define INVALID_SOCKET_VALUE INVALID_SOCKET
+#define closesocket_portable closesocket
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <signal.h>
+typedef int socket_t;
+#define INVALID_SOCKET_VALUE (-1)
+#define closesocket_portable close
+#endif
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+namespace distributed
+{
+///////////////////////////////////////////////////////////////////////////
+// Message types. Every message is a header followed by a payload.
+///////////////////////////////////////////////////////////////////////////
+enum MessageType : uint32_t
+{
+	MSG_SCENE = 1,
+	MSG_JOB = 2,
+	MSG_RESULT = 3,
+	MSG_QUIT = 4,
+	MSG_HELLO = 5,
+	MSG_READY = 6,
+};
+
+struct MessageHeader
+{
+	uint32_t type;
+	uint32_t size;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The first message of a worker, so that the coordinator does not hand
+// the scene to anything that happens to connect
+///////////////////////////////////////////////////////////////////////////
+struct Hello
+{
+	char magic[4];
+	uint32_t version;
+};
+static const char hello_magic[4] = { 'P', 'T', 'W', 'K' };
+static const uint32_t protocol_version = 2;
+
+///////////////////////////////////////////////////////////////////////////
+// Limits that keep a misbehaving peer from stalling the GUI thread of the
+// coordinator or from making us allocate whatever it asks for
+///////////////////////////////////////////////////////////////////////////
+// No message is anywhere near this large, not even the scene
+static const uint32_t max_message_size = 64 << 20;
+// A worker must say hello within this time after connecting
+static const int handshake_timeout_ms = 2000;
+// A worker that has not returned its tile this long after it was sent is
+// dropped, and the tile is given to someone else. This also bounds how
+// long the coordinator waits for the rest of a message.
+static const int job_timeout_ms = 30000;
+// How often the coordinator looks for missed deadlines
+static const int poll_interval_ms = 100;
+
+///////////////////////////////////////////////////////////////////////////
+// Helpers to (de)serialize plain old data and strings
+///////////////////////////////////////////////////////////////////////////
+struct MessageWriter
+{
+	vector<char> buffer;
+	template<typename T>
+	void write(const T& value)
+	{
+		const char* p = reinterpret_cast<const char*>(&value);
+		buffer.insert(buffer.end(), p, p + sizeof(T));
+	}
+	void write(const void* data, size_t size)
+	{
+		const char* p = static_cast<const char*>(data);
+		buffer.insert(buffer.end(), p, p + size);
+	}
+	void writeString(const string& s)
+	{
+		write(uint32_t(s.size()));
+		write(s.data(), s.size());
+	}
+};
+
+struct MessageReader
+{
+	const vector<char>& buffer;
+	size_t position = 0;
+	MessageReader(const vector<char>& b) : buffer(b)
+	{
+	}
+	template<typename T>
+	bool read(T& value)
+	{
+		return read(&value, sizeof(T));
+	}
+	bool read(void* data, size_t size)
+	{
+		if(position + size > buffer.size())
+			return false;
+		memcpy(data, &buffer[position], size);
+		position += size;
+		return true;
+	}
+	bool readString(string& s)
+	{
+		uint32_t size;
+		if(!read(size) || position + size > buffer.size())
+			return false;
+		s.assign(&buffer[position], size);
+		position += size;
+		return true;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// A job is one tile of one pass, with the camera and the settings that
+// may change between passes.
+///////////////////////////////////////////////////////////////////////////
+struct Job
+{
+	uint32_t id;
+	uint32_t seed;
+	int32_t width, height;
+	Tile tile;
+	int32_t samples;
+	int32_t first_sample;
+	mat4 V, P;
+	int32_t max_bounces;
+	int32_t strata;
+	// Whether strata have fixed positions (see settings.cache_primary_hits)
+	int32_t cache_primary_hits;
+	float environment_multiplier;
+	PointLight point_light;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Thin wrappers around BSD sockets / winsock
+///////////////////////////////////////////////////////////////////////////
+static bool initSockets()
+{
+#ifdef _WIN32
+	static bool initialized = false;
+	if(!initialized)
+	{
+		WSADATA wsa_data;
+		if(WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+			return false;
+		initialized = true;
+	}
+#else
+	// Writing to a worker that died should fail, not kill us
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	return true;
+}
+
+static bool sendAll(socket_t s, const void* data, size_t size)
+{
+	const char* p = static_cast<const char*>(data);
+	while(size > 0)
+	{
+		int sent = int(send(s, p, int(std::min(size, size_t(1 << 30))), 0));
+		if(sent <= 0)
+			return false;
+		p += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+static bool receiveAll(socket_t s, void* data, size_t size)
+{
+	char* p = static_cast<char*>(data);
+	while(size > 0)
+	{
+		int received = int(recv(s, p, int(std::min(size, size_t(1 << 30))), 0));
+		if(received <= 0)
+			return false;
+		p += received;
+		size -= received;
+	}
+	return true;
+}
+
+static bool sendMessage(socket_t s, MessageType type, const vector<char>& payload)
+{
+	MessageHeader header = { type, uint32_t(payload.size()) };
+	return sendAll(s, &header, sizeof(header)) && (payload.empty() || sendAll(s, payload.data(), payload.size()));
+}
+
+static bool receiveMessage(socket_t s, MessageType& type, vector<char>& payload)
+{
+	MessageHeader header;
+	if(!receiveAll(s, &header, sizeof(header)))
+		return false;
+	type = MessageType(header.type);
+	if(header.size > max_message_size)
+		return false;
+	payload.resize(header.size);
+	return header.size == 0 || receiveAll(s, payload.data(), header.size);
+}
+
+static void setNoDelay(socket_t s)
+{
+	int one = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&one), sizeof(one));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Make recv() on a socket give up after timeout_ms
+///////////////////////////////////////////////////////////////////////////
+static void setReceiveTimeout(socket_t s, int timeout_ms)
+{
+#ifdef _WIN32
+	DWORD timeout = DWORD(timeout_ms);
+#else
+	timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+#endif
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Wait at most timeout_ms for data to arrive on a socket
+///////////////////////////////////////////////////////////////////////////
+static bool waitForData(socket_t s, int timeout_ms)
+{
+	fd_set read_set;
+	FD_ZERO(&read_set);
+	FD_SET(s, &read_set);
+	timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+	return select(int(s) + 1, &read_set, nullptr, nullptr, &timeout) > 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Coordinator state
+///////////////////////////////////////////////////////////////////////////
+struct Worker
+{
+	socket_t socket;
+	// Set when the worker has loaded the scene and can take jobs
+	bool ready = false;
+	bool busy = false;
+	Job job;
+	chrono::steady_clock::time_point deadline;
+};
+static socket_t listen_socket = INVALID_SOCKET_VALUE;
+static vector<Worker> workers;
+static vector<char> scene_message;
+static uint32_t next_job_id = 0;
+static uint32_t pass_counter = 0;
+static const int tile_size = 64;
+
+bool startCoordinator(const string& host, int port, const SceneDescription& scene, int local_workers, const string& executable)
+{
+	if(!initSockets())
+	{
+		cout << "Coordinator: could not initialize sockets.\n";
+		return false;
+	}
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	addrinfo* address = nullptr;
+	if(getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &address) != 0)
+	{
+		cout << "Coordinator: unknown address " << host << ".\n";
+		return false;
+	}
+	listen_socket = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+	if(listen_socket == INVALID_SOCKET_VALUE)
+	{
+		cout << "Coordinator: could not create socket.\n";
+		freeaddrinfo(address);
+		return false;
+	}
+	int one = 1;
+	setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&one), sizeof(one));
+	const bool bound = ::bind(listen_socket, address->ai_addr, int(address->ai_addrlen)) == 0
+	                   && listen(listen_socket, 64) == 0;
+	freeaddrinfo(address);
+	if(!bound)
+	{
+		cout << "Coordinator: could not listen on " << host << ":" << port << ".\n";
+		closesocket_portable(listen_socket);
+		listen_socket = INVALID_SOCKET_VALUE;
+		return false;
+	}
+	cout << "Coordinator: listening for workers on " << host << ":" << port << ".\n";
+
+	///////////////////////////////////////////////////////////////////////
+	// Serialize the scene once, it is sent to every worker that connects
+	///////////////////////////////////////////////////////////////////////
+	MessageWriter writer;
+	writer.writeString(scene.environment_map);
+	writer.write(scene.environment_multiplier);
+	writer.write(scene.point_light);
+	writer.write(uint32_t(scene.models.size()));
+	for(const auto& instance : scene.models)
+	{
+		writer.writeString(instance.filename);
+		writer.write(instance.model_matrix);
+	}
+	scene_message = writer.buffer;
+
+	///////////////////////////////////////////////////////////////////////
+	// Spawn workers on this machine
+	///////////////////////////////////////////////////////////////////////
+	for(int i = 0; i < local_workers; i++)
+	{
+		const string local_host = host == "0.0.0.0" ? "127.0.0.1" : host;
+		string arguments = " --worker " + local_host + ":" + to_string(port);
+#ifdef _WIN32
+		string command = "start \"\" /B \"" + executable + "\"" + arguments;
+#else
+		string command = "\"" + executable + "\"" + arguments + " &";
+#endif
+		if(system(command.c_str()) != 0)
+			cout << "Coordinator: failed to start local worker: " << command << "\n";
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Wait for the hello of a worker that just connected
+///////////////////////////////////////////////////////////////////////////
+static bool receiveHello(socket_t s)
+{
+	MessageType type;
+	vector<char> payload;
+	Hello hello;
+	if(!waitForData(s, handshake_timeout_ms) || !receiveMessage(s, type, payload) || type != MSG_HELLO)
+		return false;
+	MessageReader reader(payload);
+	return reader.read(hello) && memcmp(hello.magic, hello_magic, sizeof(hello_magic)) == 0
+	       && hello.version == protocol_version;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Accept any workers that are waiting to connect, without blocking for
+// longer than the handshake
+///////////////////////////////////////////////////////////////////////////
+static void acceptWorkers()
+{
+	for(;;)
+	{
+		fd_set read_set;
+		FD_ZERO(&read_set);
+		FD_SET(listen_socket, &read_set);
+		timeval no_wait = { 0, 0 };
+		if(select(int(listen_socket) + 1, &read_set, nullptr, nullptr, &no_wait) <= 0)
+			return;
+		socket_t s = accept(listen_socket, nullptr, nullptr);
+		if(s == INVALID_SOCKET_VALUE)
+			return;
+		setNoDelay(s);
+		setReceiveTimeout(s, job_timeout_ms);
+		if(!receiveHello(s))
+		{
+			cout << "Coordinator: rejected a connection that is not a worker.\n";
+			closesocket_portable(s);
+			continue;
+		}
+		if(!sendMessage(s, MSG_SCENE, scene_message))
+		{
+			closesocket_portable(s);
+			continue;
+		}
+		Worker worker;
+		worker.socket = s;
+		workers.push_back(worker);
+		cout << "Coordinator: worker connected (" << workers.size() << " in total).\n";
+	}
+}
+
+static bool sendJob(Worker& worker, const Job& job)
+{
+	MessageWriter writer;
+	writer.write(job);
+	worker.job = job;
+	worker.busy = sendMessage(worker.socket, MSG_JOB, writer.buffer);
+	worker.deadline = chrono::steady_clock::now() + chrono::milliseconds(job_timeout_ms);
+	return worker.busy;
+}
+
+static void dropWorker(size_t i, deque<Job>& queue, const char* reason)
+{
+	cout << "Coordinator: " << reason << ".\n";
+	if(workers[i].busy)
+		queue.push_back(workers[i].job);
+	closesocket_portable(workers[i].socket);
+	workers.erase(workers.begin() + i);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Note the workers that have finished loading the scene, without blocking
+///////////////////////////////////////////////////////////////////////////
+static void updateReadyWorkers()
+{
+	deque<Job> no_jobs;
+	vector<char> payload;
+	for(size_t i = 0; i < workers.size();)
+	{
+		if(workers[i].ready || !waitForData(workers[i].socket, 0))
+		{
+			i++;
+			continue;
+		}
+		MessageType type;
+		if(!receiveMessage(workers[i].socket, type, payload) || type != MSG_READY)
+		{
+			dropWorker(i, no_jobs, "lost a worker");
+			continue;
+		}
+		workers[i].ready = true;
+		i++;
+	}
+}
+
+static int numberOfReadyWorkers()
+{
+	return int(count_if(workers.begin(), workers.end(), [](const Worker& worker) { return worker.ready; }));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Add the sums of a finished tile to rendered_image
+///////////////////////////////////////////////////////////////////////////
+static void mergeTile(const Tile& tile, int samples, const vec3* sums)
+{
+	const float n = float(rendered_image.number_of_samples);
+	const float k = float(samples);
+	for(int y = tile.y0; y < tile.y1; y++)
+	{
+		for(int x = tile.x0; x < tile.x1; x++)
+		{
+			vec3& pixel = rendered_image.data[y * rendered_image.width + x];
+			pixel = (pixel * n + sums[(y - tile.y0) * tile.width() + (x - tile.x0)]) / (n + k);
+		}
+	}
+}
+
+bool tracePathsDistributed(const mat4& V, const mat4& P)
+{
+	if(listen_socket == INVALID_SOCKET_VALUE)
+		return false;
+	acceptWorkers();
+	updateReadyWorkers();
+	if(numberOfReadyWorkers() == 0)
+		return false;
+	// A region of interest is small, so it is traced locally
+	if(region.enabled)
+		return false;
+	// Workers have no irradiance cache or guiding tree, and a pass must
+	// not mix tiles traced with and without them. Guiding also only
+	// learns from passes that tracePaths() traces.
+	if(irradiance_cache::options.enabled || guiding::options.enabled)
+		return false;
+	// Stop here if we have as many samples as we want
+	if((int(rendered_image.number_of_samples) > settings.max_paths_per_pixel)
+	   && (settings.max_paths_per_pixel != 0))
+	{
+		return true;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Split the image into jobs
+	///////////////////////////////////////////////////////////////////////
+	deque<Job> queue;
+	for(int y = 0; y < rendered_image.height; y += tile_size)
+	{
+		for(int x = 0; x < rendered_image.width; x += tile_size)
+		{
+			Job job;
+			job.id = next_job_id++;
+			job.seed = pass_counter * 0x9E3779B9u + job.id;
+			job.width = rendered_image.width;
+			job.height = rendered_image.height;
+			job.tile = { x, y, std::min(x + tile_size, rendered_image.width),
+				         std::min(y + tile_size, rendered_image.height) };
+			job.samples = 1;
+			job.first_sample = rendered_image.number_of_samples;
+			job.V = V;
+			job.P = P;
+			job.max_bounces = settings.max_bounces;
+			job.strata = settings.strata;
+			job.cache_primary_hits = settings.cache_primary_hits ? 1 : 0;
+			job.environment_multiplier = environment.multiplier;
+			job.point_light = point_light;
+			queue.push_back(job);
+		}
+	}
+	pass_counter++;
+	size_t remaining = queue.size();
+
+	///////////////////////////////////////////////////////////////////////
+	// Hand out jobs to idle workers and merge results as they arrive. A
+	// worker that disconnects or misses its deadline has its job put back
+	// in the queue.
+	///////////////////////////////////////////////////////////////////////
+	vector<char> payload;
+	while(remaining > 0)
+	{
+		for(size_t i = 0; i < workers.size(); i++)
+		{
+			if(workers[i].ready && !workers[i].busy && !queue.empty())
+			{
+				if(sendJob(workers[i], queue.front()))
+					queue.pop_front();
+			}
+		}
+		// Drop workers we could not talk to, or that take too long
+		const auto now = chrono::steady_clock::now();
+		for(size_t i = 0; i < workers.size();)
+		{
+			if(workers[i].ready && !workers[i].busy && !queue.empty())
+				dropWorker(i, queue, "lost a worker");
+			else if(workers[i].busy && now > workers[i].deadline)
+				dropWorker(i, queue, "a worker missed its deadline");
+			else
+				i++;
+		}
+		if(numberOfReadyWorkers() == 0)
+		{
+			// Nobody left to help, finish the pass ourselves
+			for(const Job& job : queue)
+			{
+				vector<vec3> sums(job.tile.width() * job.tile.height(), vec3(0.0f));
+				traceTile(V, P, job.width, job.height, job.tile, job.first_sample, sums.data());
+				mergeTile(job.tile, 1, sums.data());
+			}
+			// Only part of the pass was counted, so none of it is kept
+			statistics::discardPass();
+			break;
+		}
+
+		fd_set read_set;
+		FD_ZERO(&read_set);
+		socket_t max_socket = 0;
+		for(const Worker& worker : workers)
+		{
+			FD_SET(worker.socket, &read_set);
+			max_socket = std::max(max_socket, worker.socket);
+		}
+		timeval timeout = { 0, poll_interval_ms * 1000 };
+		if(select(int(max_socket) + 1, &read_set, nullptr, nullptr, &timeout) <= 0)
+			continue;
+		for(size_t i = 0; i < workers.size();)
+		{
+			Worker& worker = workers[i];
+			if(!FD_ISSET(worker.socket, &read_set))
+			{
+				i++;
+				continue;
+			}
+			MessageType type;
+			uint32_t job_id;
+			int32_t samples;
+			if(!worker.ready)
+			{
+				if(!receiveMessage(worker.socket, type, payload) || type != MSG_READY)
+				{
+					dropWorker(i, queue, "lost a worker");
+					continue;
+				}
+				worker.ready = true;
+				i++;
+				continue;
+			}
+			bool ok = worker.busy && receiveMessage(worker.socket, type, payload) && type == MSG_RESULT;
+			MessageReader reader(payload);
+			// Anything but the job we sent would corrupt the average
+			ok = ok && reader.read(job_id) && reader.read(samples) && job_id == worker.job.id
+			     && samples == worker.job.samples;
+			const Tile& tile = worker.job.tile;
+			const size_t tile_bytes = tile.width() * tile.height() * sizeof(vec3);
+			ok = ok && payload.size() - reader.position == tile_bytes;
+			if(!ok)
+			{
+				dropWorker(i, queue, "lost a worker");
+				continue;
+			}
+			mergeTile(tile, worker.job.samples, reinterpret_cast<const vec3*>(&payload[reader.position]));
+			worker.busy = false;
+			remaining--;
+			i++;
+		}
+	}
+	rendered_image.number_of_samples += 1;
+	return true;
+}
+
+void stopCoordinator()
+{
+	for(Worker& worker : workers)
+	{
+		sendMessage(worker.socket, MSG_QUIT, vector<char>());
+		closesocket_portable(worker.socket);
+	}
+	workers.clear();
+	if(listen_socket != INVALID_SOCKET_VALUE)
+	{
+		closesocket_portable(listen_socket);
+		listen_socket = INVALID_SOCKET_VALUE;
+	}
+}
+
+int numberOfWorkers()
+{
+	return int(workers.size());
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Worker
+///////////////////////////////////////////////////////////////////////////
+static socket_t connectToCoordinator(const string& host, int port)
+{
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* result = nullptr;
+	if(getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &result) != 0)
+		return INVALID_SOCKET_VALUE;
+	socket_t s = INVALID_SOCKET_VALUE;
+	for(addrinfo* a = result; a != nullptr; a = a->ai_next)
+	{
+		s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if(s == INVALID_SOCKET_VALUE)
+			continue;
+		if(connect(s, a->ai_addr, int(a->ai_addrlen)) == 0)
+			break;
+		closesocket_portable(s);
+		s = INVALID_SOCKET_VALUE;
+	}
+	freeaddrinfo(result);
+	if(s != INVALID_SOCKET_VALUE)
+		setNoDelay(s);
+	return s;
+}
+
+int runWorker(const string& host, int port)
+{
+	if(!initSockets())
+	{
+		cout << "Worker: could not initialize sockets.\n";
+		return 1;
+	}
+	socket_t s = connectToCoordinator(host, port);
+	if(s == INVALID_SOCKET_VALUE)
+	{
+		cout << "Worker: could not connect to " << host << ":" << port << ".\n";
+		return 1;
+	}
+	MessageWriter hello;
+	hello.write(hello_magic, sizeof(hello_magic));
+	hello.write(protocol_version);
+	if(!sendMessage(s, MSG_HELLO, hello.buffer))
+	{
+		cout << "Worker: lost the connection to the coordinator.\n";
+		closesocket_portable(s);
+		return 1;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// The first message is always the scene
+	///////////////////////////////////////////////////////////////////////
+	MessageType type;
+	vector<char> payload;
+	if(!receiveMessage(s, type, payload) || type != MSG_SCENE)
+	{
+		cout << "Worker: expected a scene from the coordinator.\n";
+		closesocket_portable(s);
+		return 1;
+	}
+	SceneDescription scene;
+	{
+		MessageReader reader(payload);
+		uint32_t number_of_models = 0;
+		bool ok = reader.readString(scene.environment_map) && reader.read(scene.environment_multiplier)
+		          && reader.read(scene.point_light) && reader.read(number_of_models);
+		for(uint32_t i = 0; ok && i < number_of_models; i++)
+		{
+			SceneDescription::ModelInstance instance;
+			ok = reader.readString(instance.filename) && reader.read(instance.model_matrix);
+			scene.models.push_back(instance);
+		}
+		if(!ok)
+		{
+			cout << "Worker: received a malformed scene.\n";
+			closesocket_portable(s);
+			return 1;
+		}
+	}
+	vector<pair<labhelper::Model*, mat4>> models = loadScene(scene, false);
+	sendMessage(s, MSG_READY, vector<char>());
+
+	///////////////////////////////////////////////////////////////////////
+	// Render jobs until the coordinator goes away
+	///////////////////////////////////////////////////////////////////////
+	vector<vec3> sums;
+	while(receiveMessage(s, type, payload) && type == MSG_JOB)
+	{
+		Job job;
+		MessageReader reader(payload);
+		if(!reader.read(job))
+			break;
+		settings.max_bounces = job.max_bounces;
+		settings.strata = job.strata;
+		settings.cache_primary_hits = job.cache_primary_hits != 0;
+		environment.multiplier = job.environment_multiplier;
+		point_light = job.point_light;
+		seedRandom(job.seed);
+		sums.assign(job.tile.width() * job.tile.height(), vec3(0.0f));
+		for(int i = 0; i < job.samples; i++)
+		{
+			traceTile(job.V, job.P, job.width, job.height, job.tile, job.first_sample + i, sums.data());
+		}
+		MessageWriter writer;
+		writer.write(job.id);
+		writer.write(job.samples);
+		writer.write(sums.data(), sums.size() * sizeof(vec3));
+		if(!sendMessage(s, MSG_RESULT, writer.buffer))
+			break;
+	}
+	closesocket_portable(s);
+	for(auto& m : models)
+	{
+		labhelper::freeModel(m.first);
+	}
+	return 0;
+}
+} // namespace distributed
+} // namespace pathtracer
@@ -0,0 +1,62 @@
+#pragma once
+#include <string>
+#include <glm/glm.hpp>
+#include "scene.h"
+
+///////////////////////////////////////////////////////////////////////////
+// Distributed rendering. A coordinator (the interactive pathtracer) hands
+// out tiles of each pass to worker processes over TCP, and merges the
+// tiles they send back into rendered_image. Workers are started with
+//
+//   pathtracer --worker <host>:<port>
+//
+// on any machine that sees the same scene files (relative paths are
+// resolved against the worker's working directory), or are spawned
+// locally by the coordinator. All machines must have the same
+// endianness.
+///////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+namespace distributed
+{
+///////////////////////////////////////////////////////////////////////////
+// Start listening for workers on host:port, and spawn local_workers
+// worker processes of executable on this machine. Use host 0.0.0.0 to
+// accept workers from other machines; anyone who can reach the port can
+// then take part. Workers that connect and identify themselves get the
+// scene, and take part in every following pass once they have loaded it.
+// A worker that does not return a tile in time is dropped and its tile
+// traced by someone else.
+///////////////////////////////////////////////////////////////////////////
+bool startCoordinator(const std::string& host,
+                      int port,
+                      const SceneDescription& scene,
+                      int local_workers,
+                      const std::string& executable);
+
+///////////////////////////////////////////////////////////////////////////
+// Stop all workers and close the connections
+///////////////////////////////////////////////////////////////////////////
+void stopCoordinator();
+
+///////////////////////////////////////////////////////////////////////////
+// Distribute one path per pixel over the workers, like tracePaths().
+// Returns false (and renders nothing) if we are not a coordinator, no
+// workers are connected, or the irradiance cache or path guiding is
+// enabled (workers always trace full, unguided paths). Passes traced
+// here are not recorded in statistics, and leave cost_image untouched.
+///////////////////////////////////////////////////////////////////////////
+bool tracePathsDistributed(const glm::mat4& V, const glm::mat4& P);
+
+///////////////////////////////////////////////////////////////////////////
+// The number of currently connected workers
+///////////////////////////////////////////////////////////////////////////
+int numberOfWorkers();
+
+///////////////////////////////////////////////////////////////////////////
+// Connect to a coordinator and render tiles until told to quit. Returns
+// the process exit code.
+///////////////////////////////////////////////////////////////////////////
+int runWorker(const std::string& host, int port);
+} // namespace distributed
+} // namespace pathtracer
@@ -1,6 +1,9 @@
 #include "embree.h"
+#include "bvh.h"
+#include <cfloat>
 #include <iostream>
 #include <map>
+#include <vector>
 
 
 using namespace std;
@@ -13,12 +16,28 @@ namespace pathtracer
 ///////////////////////////////////////////////////////////////////////////
 RTCDevice embree_device;
 RTCScene embree_scene;
+AccelerationBackend backend = AccelerationBackend::Embree;
+
+void setAccelerationBackend(AccelerationBackend b)
+{
+	backend = b;
+}
+
+AccelerationBackend getAccelerationBackend()
+{
+	return backend;
+}
 
 ///////////////////////////////////////////////////////////////////////////
 // Build an acceleration structure for the scene
 ///////////////////////////////////////////////////////////////////////////
 void buildBVH()
 {
+	if(backend == AccelerationBackend::SAH_BVH)
+	{
+		bvh::build();
+		return;
+	}
 	cout << "Embree building BVH..." << flush;
 	rtcCommit(embree_scene);
 	cout << "done.\n";
@@ -38,12 +57,128 @@ void embreeErrorHandler(const RTCError code, const char* str)
 ///////////////////////////////////////////////////////////////////////////
 map<uint32_t, const labhelper::Model*> map_geom_ID_to_model;
 map<uint32_t, const labhelper::Mesh*> map_geom_ID_to_mesh;
+map<uint32_t, mat4> map_geom_ID_to_transform;
+
+///////////////////////////////////////////////////////////////////////////
+// Compact copies of the shading attributes of every triangle, which is
+// all getIntersection() reads. Normals are octahedral encoded in two
+// 16 bit values, and texture coordinates are quantized to 16 bits within
+// the bounds of the mesh's texture coordinates. 24 bytes per triangle
+// instead of 60.
+///////////////////////////////////////////////////////////////////////////
+struct TriangleAttributes
+{
+	uint32_t normals[3];
+	uint16_t texture_coordinates[3][2];
+};
+struct MeshAttributes
+{
+	vector<TriangleAttributes> triangles;
+	vec2 texture_coordinate_min;
+	vec2 texture_coordinate_scale;
+};
+vector<MeshAttributes> geom_ID_to_attributes; // Geometry IDs are dense
+
+static uint32_t encodeNormal(vec3 n)
+{
+	const float l1 = abs(n.x) + abs(n.y) + abs(n.z);
+	if(!(l1 > 0.0f))
+	{
+		n = vec3(0.0f, 0.0f, 1.0f);
+	}
+	else
+	{
+		n /= l1;
+	}
+	// Fold the lower hemisphere over the upper
+	vec2 e(n.x, n.y);
+	if(n.z < 0.0f)
+	{
+		e = (1.0f - abs(vec2(n.y, n.x))) * vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+	}
+	const uvec2 q = uvec2(round((clamp(e, -1.0f, 1.0f) * 0.5f + 0.5f) * 65535.0f));
+	return q.x | (q.y << 16);
+}
+
+static vec3 decodeNormal(uint32_t encoded)
+{
+	const vec2 e = vec2(float(encoded & 0xFFFF), float(encoded >> 16)) * (2.0f / 65535.0f) - 1.0f;
+	vec3 n(e.x, e.y, 1.0f - abs(e.x) - abs(e.y));
+	const float t = std::max(-n.z, 0.0f);
+	n.x += n.x >= 0.0f ? -t : t;
+	n.y += n.y >= 0.0f ? -t : t;
+	return n; // Not normalized
+}
+
+static void addAttributes(uint32_t geom_ID, const labhelper::Model* model, const labhelper::Mesh& mesh)
+{
+	if(geom_ID >= geom_ID_to_attributes.size())
+	{
+		geom_ID_to_attributes.resize(geom_ID + 1);
+	}
+	MeshAttributes& attributes = geom_ID_to_attributes[geom_ID];
+	const vec3* normals = &model->m_normals[mesh.m_start_index];
+	const vec2* texture_coordinates = &model->m_texture_coordinates[mesh.m_start_index];
+	vec2 uv_min(FLT_MAX), uv_max(-FLT_MAX);
+	for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+	{
+		uv_min = min(uv_min, texture_coordinates[i]);
+		uv_max = max(uv_max, texture_coordinates[i]);
+	}
+	if(mesh.m_number_of_vertices == 0)
+	{
+		uv_min = uv_max = vec2(0.0f);
+	}
+	const vec2 extent = uv_max - uv_min;
+	attributes.texture_coordinate_min = uv_min;
+	attributes.texture_coordinate_scale = extent / 65535.0f;
+	attributes.triangles.resize(mesh.m_number_of_vertices / 3);
+	for(size_t t = 0; t < attributes.triangles.size(); t++)
+	{
+		for(int j = 0; j < 3; j++)
+		{
+			const size_t i = t * 3 + j;
+			attributes.triangles[t].normals[j] = encodeNormal(normals[i]);
+			for(int k = 0; k < 2; k++)
+			{
+				const float relative = extent[k] > 0.0f ? (texture_coordinates[i][k] - uv_min[k]) / extent[k] : 0.0f;
+				attributes.triangles[t].texture_coordinates[j][k] = uint16_t(round(relative * 65535.0f));
+			}
+		}
+	}
+}
 
 ///////////////////////////////////////////////////////////////////////////
 // Add a model to the embree scene
 ///////////////////////////////////////////////////////////////////////////
 void addModel(const labhelper::Model* model, const mat4& model_matrix)
 {
+	if(backend == AccelerationBackend::SAH_BVH)
+	{
+		///////////////////////////////////////////////////////////////////
+		// Number the meshes like embree would, and hand the transformed
+		// triangles to our own BVH
+		///////////////////////////////////////////////////////////////////
+		static uint32_t next_geom_ID = 0;
+		cout << "Adding " << model->m_name << " to BVH scene..." << flush;
+		for(auto& mesh : model->m_meshes)
+		{
+			uint32_t geom_ID = next_geom_ID++;
+			map_geom_ID_to_mesh[geom_ID] = &mesh;
+			map_geom_ID_to_model[geom_ID] = model;
+			map_geom_ID_to_transform[geom_ID] = model_matrix;
+			addAttributes(geom_ID, model, mesh);
+			vector<vec3> vertices(mesh.m_number_of_vertices);
+			for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+			{
+				vertices[i] = vec3(model_matrix * vec4(model->m_positions[mesh.m_start_index + i], 1.0f));
+			}
+			bvh::addTriangles(geom_ID, vertices.data(), mesh.m_number_of_vertices / 3);
+		}
+		cout << "done.\n";
+		return;
+	}
+
 	///////////////////////////////////////////////////////////////////////
 	// Lazy initialize embree on first use
 	///////////////////////////////////////////////////////////////////////
@@ -70,6 +205,8 @@ void addModel(const labhelper::Model* model, const mat4& model_matrix)
 		                                      mesh.m_number_of_vertices / 3, mesh.m_number_of_vertices);
 		map_geom_ID_to_mesh[geom_ID] = &mesh;
 		map_geom_ID_to_model[geom_ID] = model;
+		map_geom_ID_to_transform[geom_ID] = model_matrix;
+		addAttributes(geom_ID, model, mesh);
 		// Transform and commit vertices
 		vec4* embree_vertices = (vec4*)rtcMapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
 		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
@@ -97,11 +234,18 @@ Intersection getIntersection(const Ray& r)
 	const labhelper::Mesh* mesh = map_geom_ID_to_mesh[r.geomID];
 	Intersection i;
 	i.material = &(model->m_materials[mesh->m_material_idx]);
-	vec3 n0 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-	vec3 n1 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-	vec3 n2 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
+	const MeshAttributes& attributes = geom_ID_to_attributes[r.geomID];
+	const TriangleAttributes& triangle = attributes.triangles[r.primID];
+	vec3 n0 = decodeNormal(triangle.normals[0]);
+	vec3 n1 = decodeNormal(triangle.normals[1]);
+	vec3 n2 = decodeNormal(triangle.normals[2]);
 	float w = 1.0f - (r.u + r.v);
-	i.shading_normal = normalize(w * n0 + r.u * n1 + r.v * n2);
+	i.shading_normal = normalize(w * normalize(n0) + r.u * normalize(n1) + r.v * normalize(n2));
+	vec2 uv0(triangle.texture_coordinates[0][0], triangle.texture_coordinates[0][1]);
+	vec2 uv1(triangle.texture_coordinates[1][0], triangle.texture_coordinates[1][1]);
+	vec2 uv2(triangle.texture_coordinates[2][0], triangle.texture_coordinates[2][1]);
+	i.texture_coordinate = attributes.texture_coordinate_min
+	                       + attributes.texture_coordinate_scale * (w * uv0 + r.u * uv1 + r.v * uv2);
 	i.geometry_normal = -normalize(r.n);
 	i.position = r.o + r.tfar * r.d;
 	i.wo = normalize(-r.d);
@@ -113,6 +257,8 @@ Intersection getIntersection(const Ray& r)
 ///////////////////////////////////////////////////////////////////////////
 bool intersect(Ray& r)
 {
+	if(backend == AccelerationBackend::SAH_BVH)
+		return bvh::intersect(r);
 	rtcIntersect(embree_scene, *((RTCRay*)&r));
 	return r.geomID != RTC_INVALID_GEOMETRY_ID;
 }
@@ -123,7 +269,52 @@ bool intersect(Ray& r)
 ///////////////////////////////////////////////////////////////////////////
 bool occluded(Ray& r)
 {
+	if(backend == AccelerationBackend::SAH_BVH)
+		return bvh::occluded(r);
 	rtcOccluded(embree_scene, *((RTCRay*)&r));
 	return r.geomID != RTC_INVALID_GEOMETRY_ID;
 }
-} // namespace pathtracer
\ No newline at end of file
+
+///////////////////////////////////////////////////////////////////////////
+// Test a ray against a single triangle of the scene, with the same
+// conventions for u, v and the geometry normal as Embree
+///////////////////////////////////////////////////////////////////////////
+bool intersectTriangle(Ray& r, uint32_t geom_ID, uint32_t prim_ID)
+{
+	auto model = map_geom_ID_to_model.find(geom_ID);
+	if(model == map_geom_ID_to_model.end())
+		return false;
+	const labhelper::Mesh* mesh = map_geom_ID_to_mesh[geom_ID];
+	if(prim_ID >= mesh->m_number_of_vertices / 3)
+		return false;
+	const mat4& model_matrix = map_geom_ID_to_transform[geom_ID];
+	const vec3* p = &model->second->m_positions[mesh->m_start_index + prim_ID * 3];
+	const vec3 v0 = vec3(model_matrix * vec4(p[0], 1.0f));
+	const vec3 e1 = vec3(model_matrix * vec4(p[1], 1.0f)) - v0;
+	const vec3 e2 = vec3(model_matrix * vec4(p[2], 1.0f)) - v0;
+	// Moller-Trumbore
+	const vec3 q = cross(r.d, e2);
+	const float det = dot(e1, q);
+	if(det == 0.0f)
+		return false;
+	const float inv_det = 1.0f / det;
+	const vec3 s = r.o - v0;
+	const float u = dot(s, q) * inv_det;
+	if(u < 0.0f || u > 1.0f)
+		return false;
+	const vec3 w = cross(s, e1);
+	const float v = dot(r.d, w) * inv_det;
+	if(v < 0.0f || u + v > 1.0f)
+		return false;
+	const float t = dot(e2, w) * inv_det;
+	if(t <= r.tnear || t >= r.tfar)
+		return false;
+	r.tfar = t;
+	r.u = u;
+	r.v = v;
+	r.n = cross(e2, e1);
+	r.geomID = geom_ID;
+	r.primID = prim_ID;
+	return true;
+}
+} // namespace pathtracer
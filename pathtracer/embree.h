@@ -8,7 +8,21 @@
 namespace pathtracer
 {
 ///////////////////////////////////////////////////////////////////////////
-// Add a model to the embree scene
+// Which acceleration structure intersect() and occluded() use. Choose
+// before the first model is added.
+///////////////////////////////////////////////////////////////////////////
+enum class AccelerationBackend
+{
+	Embree,
+	SAH_BVH // The in-tree BVH in bvh.h
+};
+void setAccelerationBackend(AccelerationBackend backend);
+AccelerationBackend getAccelerationBackend();
+
+///////////////////////////////////////////////////////////////////////////
+// Add a model to the embree scene. Its normals and texture coordinates
+// are copied into a compressed store, so the model's own arrays are not
+// needed for intersections afterwards.
 ///////////////////////////////////////////////////////////////////////////
 void addModel(const labhelper::Model* model, const glm::mat4& model_matrix);
 
@@ -60,6 +74,7 @@ struct Intersection
 	glm::vec3 geometry_normal;
 	glm::vec3 shading_normal;
 	glm::vec3 wo;
+	glm::vec2 texture_coordinate;
 	const labhelper::Material* material;
 };
 Intersection getIntersection(const Ray& r);
@@ -74,4 +89,10 @@ bool intersect(Ray& r);
 // intersection).
 ///////////////////////////////////////////////////////////////////////////
 bool occluded(Ray& r);
+
+///////////////////////////////////////////////////////////////////////////
+// Test a ray against a single triangle of the scene (primitive prim_ID
+// of geometry geom_ID), and fill in the hit like intersect() would
+///////////////////////////////////////////////////////////////////////////
+bool intersectTriangle(Ray& r, uint32_t geom_ID, uint32_t prim_ID);
 } // namespace pathtracer
\ No newline at end of file
@@ -0,0 +1,337 @@
+#include "guiding.h"
+#include "Pathtracer.h"
+#include "sampling.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+namespace guiding
+{
+Options options;
+
+///////////////////////////////////////////////////////////////////////////
+// Refinement parameters
+///////////////////////////////////////////////////////////////////////////
+// Quadrants with more than this fraction of the energy are subdivided
+const float directional_threshold = 0.01f;
+const int max_directional_depth = 20;
+// Leaves are split when they get more records than this times
+// sqrt(2^iteration)
+const float spatial_threshold = 4000.0f;
+const int max_spatial_depth = 48;
+
+///////////////////////////////////////////////////////////////////////////
+// Directions are mapped to the unit square with the equal area
+// cylindrical projection, so a density on the square is 4 pi times the
+// density per solid angle.
+///////////////////////////////////////////////////////////////////////////
+static vec2 directionToSquare(const vec3& d)
+{
+	const float cos_theta = std::max(-1.0f, std::min(1.0f, d.y));
+	float phi = atan2(d.z, d.x);
+	if(phi < 0.0f)
+		phi += 2.0f * M_PI;
+	const vec2 p((cos_theta + 1.0f) * 0.5f, phi / (2.0f * M_PI));
+	return clamp(p, vec2(0.0f), vec2(0.99999994f));
+}
+
+static vec3 squareToDirection(const vec2& p)
+{
+	const float cos_theta = 2.0f * p.x - 1.0f;
+	const float sin_theta = sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+	const float phi = 2.0f * M_PI * p.y;
+	return vec3(sin_theta * cos(phi), cos_theta, sin_theta * sin(phi));
+}
+
+// The quadrant of p, and p within that quadrant
+static int quadrant(vec2& p)
+{
+	const int qx = p.x >= 0.5f ? 1 : 0;
+	const int qy = p.y >= 0.5f ? 1 : 0;
+	p = p * 2.0f - vec2(float(qx), float(qy));
+	return qx + 2 * qy;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A quadtree over the square of directions. Every node stores the energy
+// in each of its four quadrants; a quadrant is either a leaf or has a
+// child node.
+///////////////////////////////////////////////////////////////////////////
+struct DTree
+{
+	struct Node
+	{
+		float sum[4];
+		uint32_t child[4]; // 0 if the quadrant is a leaf
+	};
+	vector<Node> nodes;
+	float count = 0.0f; // Number of records
+	float total = 0.0f; // Energy of the whole tree, after build()
+
+	DTree()
+	{
+		nodes.push_back(Node());
+	}
+
+	void record(vec2 p, float value)
+	{
+		uint32_t n = 0;
+		for(;;)
+		{
+			const int q = quadrant(p);
+			if(nodes[n].child[q] == 0)
+			{
+#pragma omp atomic
+				nodes[n].sum[q] += value;
+				return;
+			}
+			n = nodes[n].child[q];
+		}
+	}
+
+	// Sum the leaves into the inner quadrants
+	float build(uint32_t n = 0)
+	{
+		float node_total = 0.0f;
+		for(int q = 0; q < 4; q++)
+		{
+			if(nodes[n].child[q] != 0)
+				nodes[n].sum[q] = build(nodes[n].child[q]);
+			node_total += nodes[n].sum[q];
+		}
+		if(n == 0)
+			total = node_total;
+		return node_total;
+	}
+
+	// Density on the unit square
+	float pdf(vec2 p) const
+	{
+		if(total <= 0.0f)
+			return 0.0f;
+		float density = 1.0f;
+		uint32_t n = 0;
+		for(;;)
+		{
+			const Node& node = nodes[n];
+			const float node_total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+			if(node_total <= 0.0f)
+				return 0.0f;
+			const int q = quadrant(p);
+			density *= 4.0f * node.sum[q] / node_total;
+			if(node.child[q] == 0)
+				return density;
+			n = node.child[q];
+		}
+	}
+
+	vec2 sample() const
+	{
+		vec2 origin(0.0f);
+		float size = 1.0f;
+		uint32_t n = 0;
+		for(;;)
+		{
+			const Node& node = nodes[n];
+			const float node_total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+			float u = randf() * node_total;
+			int q = 0;
+			for(; q < 3; q++)
+			{
+				if(u < node.sum[q])
+					break;
+				u -= node.sum[q];
+			}
+			// Rounding may have taken us past the last non-empty quadrant
+			while(node.sum[q] <= 0.0f && q > 0)
+				q--;
+			size *= 0.5f;
+			origin += size * vec2(float(q & 1), float(q >> 1));
+			if(node.child[q] == 0)
+				return origin + size * vec2(randf(), randf());
+			n = node.child[q];
+		}
+	}
+
+	// A tree with the same energy as this one but with a structure that
+	// subdivides where this one had much energy, and all sums zero
+	DTree refined() const
+	{
+		DTree result;
+		if(total > 0.0f)
+			refine(result, 0, 0, 1.0f, 1);
+		return result;
+	}
+
+	void refine(DTree& result, uint32_t result_node, int node, float fraction, int depth) const
+	{
+		const float node_total = node >= 0 ? nodes[node].sum[0] + nodes[node].sum[1] + nodes[node].sum[2]
+		                                         + nodes[node].sum[3] :
+		                                     0.0f;
+		for(int q = 0; q < 4; q++)
+		{
+			// Below the leaves of this tree, assume energy is uniform
+			const float quadrant_fraction =
+			    node_total > 0.0f ? fraction * nodes[node].sum[q] / node_total : fraction * 0.25f;
+			if(quadrant_fraction <= directional_threshold || depth >= max_directional_depth)
+				continue;
+			const uint32_t child = uint32_t(result.nodes.size());
+			result.nodes.push_back(Node());
+			result.nodes[result_node].child[q] = child;
+			const int old_child = node >= 0 && nodes[node].child[q] != 0 ? int(nodes[node].child[q]) : -1;
+			refine(result, child, old_child, quadrant_fraction, depth + 1);
+		}
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// A node of the spatial tree. Leaves have a distribution to sample from
+// (learned in the previous iteration) and one that is being trained.
+///////////////////////////////////////////////////////////////////////////
+struct Region
+{
+	uint32_t children[2] = { 0, 0 }; // 0 for leaves
+	int depth = 0;
+	DTree sampling;
+	DTree training;
+};
+
+static vec3 bounds_min = vec3(-1.0f), bounds_size = vec3(2.0f);
+static vector<Region> regions(1);
+static int current_iteration = 0;
+static int passes_in_iteration = 0;
+
+void setSceneBounds(const vec3& min, const vec3& max)
+{
+	// A cube slightly larger than the scene, so that splits stay cubic
+	const vec3 center = 0.5f * (min + max);
+	const vec3 extent = max - min;
+	const float size = 1.01f * std::max(extent.x, std::max(extent.y, extent.z)) + EPSILON;
+	bounds_min = center - vec3(0.5f * size);
+	bounds_size = vec3(size);
+	reset();
+}
+
+void reset()
+{
+	regions.assign(1, Region());
+	current_iteration = 0;
+	passes_in_iteration = 0;
+}
+
+Region* lookup(const vec3& p)
+{
+	vec3 lo = bounds_min, size = bounds_size;
+	uint32_t n = 0;
+	while(regions[n].children[0] != 0)
+	{
+		const int axis = regions[n].depth % 3;
+		size[axis] *= 0.5f;
+		if(p[axis] < lo[axis] + size[axis])
+		{
+			n = regions[n].children[0];
+		}
+		else
+		{
+			lo[axis] += size[axis];
+			n = regions[n].children[1];
+		}
+	}
+	return &regions[n];
+}
+
+bool canSample(const Region* region)
+{
+	return options.enabled && region->sampling.total > 0.0f;
+}
+
+vec3 sample(const Region* region)
+{
+	return squareToDirection(region->sampling.sample());
+}
+
+float pdf(const Region* region, const vec3& wi)
+{
+	return region->sampling.pdf(directionToSquare(wi)) * (1.0f / (4.0f * M_PI));
+}
+
+bool isTraining()
+{
+	return options.enabled && current_iteration < options.training_iterations;
+}
+
+void record(Region* region, const vec3& wi, float radiance, float pdf)
+{
+	if(!(pdf > 0.0f) || !std::isfinite(radiance / pdf))
+		return;
+	region->training.record(directionToSquare(wi), radiance / pdf);
+#pragma omp atomic
+	region->training.count += 1.0f;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// End an iteration: split leaves that got many records, then let every
+// leaf sample from what it learned and train a refined quadtree.
+///////////////////////////////////////////////////////////////////////////
+static void refine()
+{
+	const float threshold = spatial_threshold * sqrt(float(1 << current_iteration));
+	for(size_t i = 0; i < regions.size(); i++)
+	{
+		if(regions[i].children[0] != 0 || regions[i].training.count <= threshold
+		   || regions[i].depth >= max_spatial_depth)
+			continue;
+		// Both halves start out with what the parent has learned, and
+		// half of its records each
+		Region child;
+		child.depth = regions[i].depth + 1;
+		child.sampling = regions[i].sampling;
+		child.training = regions[i].training;
+		child.training.count *= 0.5f;
+		for(DTree::Node& node : child.training.nodes)
+		{
+			for(float& s : node.sum)
+				s *= 0.5f;
+		}
+		regions[i].children[0] = uint32_t(regions.size());
+		regions[i].children[1] = uint32_t(regions.size() + 1);
+		regions[i].sampling = DTree();
+		regions[i].training = DTree();
+		regions.push_back(child);
+		regions.push_back(child);
+	}
+
+#pragma omp parallel for schedule(dynamic, 16)
+	for(int i = 0; i < int(regions.size()); i++)
+	{
+		Region& region = regions[i];
+		if(region.children[0] != 0)
+			continue;
+		region.training.build();
+		region.sampling = region.training;
+		region.training = region.sampling.refined();
+	}
+}
+
+void endPass()
+{
+	if(!isTraining())
+		return;
+	if(++passes_in_iteration < (1 << current_iteration))
+		return;
+	passes_in_iteration = 0;
+	refine();
+	current_iteration++;
+}
+
+int iteration()
+{
+	return current_iteration;
+}
+} // namespace guiding
+} // namespace pathtracer
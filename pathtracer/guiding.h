@@ -0,0 +1,66 @@
+#pragma once
+#include <glm/glm.hpp>
+
+///////////////////////////////////////////////////////////////////////////
+// Path guiding with a spatial-directional tree (after Muller et al.,
+// "Practical Path Guiding for Efficient Light-Transport Simulation").
+// Space is split by a binary tree, and every leaf holds a quadtree over
+// the sphere of directions that learns the incident radiance there. The
+// tree is trained during progressive passes in iterations of 1, 2, 4,
+// ... passes; each iteration samples from what the previous one learned.
+// The integrator mixes sampling from the tree with brdf sampling.
+///////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+namespace guiding
+{
+extern struct Options
+{
+	bool enabled = false;
+	// Probability of sampling the brdf rather than the learned distribution
+	float brdf_sampling_fraction = 0.5f;
+	// Stop learning (and keep the distribution fixed) after this many
+	// iterations
+	int training_iterations = 10;
+} options;
+
+///////////////////////////////////////////////////////////////////////////
+// Set the region of space that is guided, and forget everything learned
+///////////////////////////////////////////////////////////////////////////
+void setSceneBounds(const glm::vec3& min, const glm::vec3& max);
+
+///////////////////////////////////////////////////////////////////////////
+// Forget everything learned, e.g. after lights or materials have changed
+///////////////////////////////////////////////////////////////////////////
+void reset();
+
+///////////////////////////////////////////////////////////////////////////
+// The leaf of the spatial tree that contains a point. Valid until the
+// next endPass().
+///////////////////////////////////////////////////////////////////////////
+struct Region;
+Region* lookup(const glm::vec3& p);
+
+///////////////////////////////////////////////////////////////////////////
+// Whether the region has learned anything to sample from, and sampling
+// and evaluating its distribution (pdf per unit solid angle)
+///////////////////////////////////////////////////////////////////////////
+bool canSample(const Region* region);
+glm::vec3 sample(const Region* region);
+float pdf(const Region* region, const glm::vec3& wi);
+
+///////////////////////////////////////////////////////////////////////////
+// Whether the current pass trains the tree, and record an estimate of
+// the incident radiance from direction wi, sampled with pdf. Thread safe.
+///////////////////////////////////////////////////////////////////////////
+bool isTraining();
+void record(Region* region, const glm::vec3& wi, float radiance, float pdf);
+
+///////////////////////////////////////////////////////////////////////////
+// Call after each pass over the whole image. Ends the current iteration
+// when it has had its passes, and refines the tree from what was learned.
+///////////////////////////////////////////////////////////////////////////
+void endPass();
+int iteration();
+} // namespace guiding
+} // namespace pathtracer
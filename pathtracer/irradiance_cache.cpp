@@ -0,0 +1,304 @@
+#include "irradiance_cache.h"
+#include "Pathtracer.h"
+#include "sampling.h"
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+namespace irradiance_cache
+{
+Options options;
+
+///////////////////////////////////////////////////////////////////////////
+// A cached irradiance value. Records are immutable once they have been
+// inserted.
+///////////////////////////////////////////////////////////////////////////
+struct Record
+{
+	vec3 p, n;
+	vec3 E;
+	float R; // Harmonic mean distance to the surroundings, clamped
+	// Gradients of each color channel
+	vec3 rotational_gradient[3];
+	vec3 translational_gradient[3];
+	Record* next;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// An octree node. A record is stored in the smallest node that contains
+// its position and is at least as large as its radius of influence, so
+// a lookup only has to visit nodes whose bounds, grown by half their
+// size, contain the point. Children and records are published with
+// compare-and-swap.
+///////////////////////////////////////////////////////////////////////////
+struct Node
+{
+	atomic<Node*> children[8];
+	atomic<Record*> records;
+	Node()
+	{
+		for(auto& c : children)
+			c.store(nullptr);
+		records.store(nullptr);
+	}
+	~Node()
+	{
+		for(auto& c : children)
+			delete c.load();
+		Record* r = records.load();
+		while(r != nullptr)
+		{
+			Record* next = r->next;
+			delete r;
+			r = next;
+		}
+	}
+};
+
+static Node* root = new Node;
+static vec3 root_center = vec3(0.0f);
+static float root_half_size = 1.0f;
+static float min_spacing = 0.001f, max_spacing = 0.1f;
+static atomic<int> number_of_records(0);
+
+void setSceneBounds(const vec3& min, const vec3& max)
+{
+	const vec3 extent = max - min;
+	const float size = 1.01f * std::max(extent.x, std::max(extent.y, extent.z)) + EPSILON;
+	root_center = 0.5f * (min + max);
+	root_half_size = 0.5f * size;
+	min_spacing = 0.0005f * size;
+	max_spacing = 0.05f * size;
+	reset();
+}
+
+void reset()
+{
+	delete root;
+	root = new Node;
+	number_of_records = 0;
+}
+
+int numberOfRecords()
+{
+	return number_of_records;
+}
+
+static int childIndex(const vec3& p, const vec3& center)
+{
+	return (p.x >= center.x ? 1 : 0) | (p.y >= center.y ? 2 : 0) | (p.z >= center.z ? 4 : 0);
+}
+
+static vec3 childCenter(const vec3& center, float half_size, int child)
+{
+	const float q = 0.5f * half_size;
+	return center + vec3(child & 1 ? q : -q, child & 2 ? q : -q, child & 4 ? q : -q);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Insert a record, creating nodes as needed. Concurrent inserts of the
+// same child keep the first one and discard the others.
+///////////////////////////////////////////////////////////////////////////
+static void insert(Record* record)
+{
+	// Records are used up to R / a away
+	const float radius = record->R / options.accuracy;
+	Node* node = root;
+	vec3 center = root_center;
+	float half_size = root_half_size;
+	while(0.5f * half_size >= radius)
+	{
+		const int c = childIndex(record->p, center);
+		Node* child = node->children[c].load(memory_order_acquire);
+		if(child == nullptr)
+		{
+			Node* created = new Node;
+			if(node->children[c].compare_exchange_strong(child, created, memory_order_acq_rel))
+				child = created;
+			else
+				delete created; // child now holds the node another thread made
+		}
+		node = child;
+		center = childCenter(center, half_size, c);
+		half_size *= 0.5f;
+	}
+	Record* head = node->records.load(memory_order_relaxed);
+	do
+	{
+		record->next = head;
+	} while(!node->records.compare_exchange_weak(head, record, memory_order_release, memory_order_relaxed));
+	number_of_records++;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Ward's weight of a record at p with normal n, or 0 if it should not be
+// used there
+///////////////////////////////////////////////////////////////////////////
+static float weight(const Record& r, const vec3& p, const vec3& n)
+{
+	const float normal_term = sqrt(std::max(0.0f, 1.0f - dot(n, r.n)));
+	const float error = length(p - r.p) / r.R + normal_term;
+	if(error * options.accuracy >= 1.0f)
+		return 0.0f;
+	// Records in front of p see things that p does not
+	if(dot(p - r.p, 0.5f * (n + r.n)) < -0.05f * r.R)
+		return 0.0f;
+	return 1.0f / std::max(error, 1e-4f);
+}
+
+static void lookup(const Node* node,
+                   const vec3& center,
+                   float half_size,
+                   const vec3& p,
+                   const vec3& n,
+                   vec3& E,
+                   float& total_weight)
+{
+	for(const Record* r = node->records.load(memory_order_acquire); r != nullptr; r = r->next)
+	{
+		const float w = weight(*r, p, n);
+		if(w <= 0.0f)
+			continue;
+		// Extrapolate the record to p with its gradients
+		const vec3 rotation = cross(r->n, n);
+		const vec3 translation = p - r->p;
+		vec3 e;
+		for(int c = 0; c < 3; c++)
+		{
+			e[c] = r->E[c] + dot(rotation, r->rotational_gradient[c]) + dot(translation, r->translational_gradient[c]);
+		}
+		E += w * max(e, vec3(0.0f));
+		total_weight += w;
+	}
+	for(int c = 0; c < 8; c++)
+	{
+		const Node* child = node->children[c].load(memory_order_acquire);
+		if(child == nullptr)
+			continue;
+		const vec3 child_center = childCenter(center, half_size, c);
+		const vec3 d = abs(p - child_center);
+		// Records in the child reach at most half its size outside it
+		if(std::max(d.x, std::max(d.y, d.z)) <= half_size)
+			lookup(child, child_center, 0.5f * half_size, p, n, E, total_weight);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Compute a new record by stratified cosine weighted sampling of the
+// hemisphere, with the gradients of Ward and Heckbert.
+///////////////////////////////////////////////////////////////////////////
+static Record* createRecord(const vec3& p, const vec3& n, RadianceFunction incident_radiance)
+{
+	const int M = std::max(2, options.theta_strata);
+	const int N = 4 * M;
+	vector<vec3> L(M * N);
+	vector<float> distance(M * N);
+	vector<float> sin_theta(M * N);
+	const vec3 tangent = normalize(perpendicular(n));
+	const vec3 bitangent = normalize(cross(n, tangent));
+
+	Record* record = new Record;
+	record->p = p;
+	record->n = n;
+	record->E = vec3(0.0f);
+	vec3 rotational[3] = { vec3(0.0f), vec3(0.0f), vec3(0.0f) };
+	float inverse_distance_sum = 0.0f;
+	for(int k = 0; k < N; k++)
+	{
+		for(int j = 0; j < M; j++)
+		{
+			// sin^2(theta) is uniform for cosine weighted directions
+			const float s = sqrt((float(j) + randf()) / float(M));
+			const float c = sqrt(std::max(0.0f, 1.0f - s * s));
+			const float phi = 2.0f * M_PI * (float(k) + randf()) / float(N);
+			const vec3 wi = s * cos(phi) * tangent + s * sin(phi) * bitangent + c * n;
+			const int i = k * M + j;
+			L[i] = incident_radiance(p, wi, distance[i]);
+			sin_theta[i] = s;
+			record->E += L[i];
+			inverse_distance_sum += 1.0f / std::max(distance[i], EPSILON);
+			// Rotational gradient: -tan(theta) L along the tangent at phi + pi/2
+			const vec3 v = -sin(phi) * tangent + cos(phi) * bitangent;
+			for(int ch = 0; ch < 3; ch++)
+				rotational[ch] += v * (-(s / std::max(c, 1e-3f)) * L[i][ch]);
+		}
+	}
+	record->E *= M_PI / float(M * N);
+	for(int ch = 0; ch < 3; ch++)
+		record->rotational_gradient[ch] = rotational[ch] * (M_PI / float(M * N));
+
+	///////////////////////////////////////////////////////////////////////
+	// Translational gradient, from the change in radiance between
+	// neighbouring strata and the distance to what is seen there
+	///////////////////////////////////////////////////////////////////////
+	vec3 translational[3] = { vec3(0.0f), vec3(0.0f), vec3(0.0f) };
+	for(int k = 0; k < N; k++)
+	{
+		const float phi_center = 2.0f * M_PI * (float(k) + 0.5f) / float(N);
+		const float phi_minus = 2.0f * M_PI * float(k) / float(N);
+		const vec3 u = cos(phi_center) * tangent + sin(phi_center) * bitangent;
+		const vec3 v_minus = -sin(phi_minus) * tangent + cos(phi_minus) * bitangent;
+		const int k_prev = (k + N - 1) % N;
+		for(int j = 0; j < M; j++)
+		{
+			const int i = k * M + j;
+			const float sin_minus = sqrt(float(j) / float(M));
+			const float cos_minus = sqrt(1.0f - float(j) / float(M));
+			const float cos_plus = sqrt(std::max(0.0f, 1.0f - float(j + 1) / float(M)));
+			if(j > 0)
+			{
+				const int below = k * M + j - 1;
+				const float factor = (2.0f * M_PI / float(N)) * sin_minus * cos_minus * cos_minus
+				                     / std::max(std::min(distance[i], distance[below]), EPSILON);
+				for(int ch = 0; ch < 3; ch++)
+					translational[ch] += u * (factor * (L[i][ch] - L[below][ch]));
+			}
+			const int previous = k_prev * M + j;
+			const float factor = (cos_minus - cos_plus)
+			                     / (std::max(sin_theta[i], 1e-3f)
+			                        * std::max(std::min(distance[i], distance[previous]), EPSILON));
+			for(int ch = 0; ch < 3; ch++)
+				translational[ch] += v_minus * (factor * (L[i][ch] - L[previous][ch]));
+		}
+	}
+	for(int ch = 0; ch < 3; ch++)
+		record->translational_gradient[ch] = translational[ch];
+
+	///////////////////////////////////////////////////////////////////////
+	// The radius of the record, limited so that extrapolating with the
+	// gradient can not change the irradiance by more than itself
+	///////////////////////////////////////////////////////////////////////
+	float R = float(M * N) / std::max(inverse_distance_sum, 1e-20f);
+	for(int ch = 0; ch < 3; ch++)
+	{
+		const float gradient = length(record->translational_gradient[ch]);
+		if(gradient > 0.0f && record->E[ch] > 0.0f)
+			R = std::min(R, record->E[ch] / gradient);
+	}
+	record->R = std::max(min_spacing, std::min(max_spacing, R));
+	return record;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Interpolate, or create a record if nothing is close enough
+///////////////////////////////////////////////////////////////////////////
+vec3 irradiance(const vec3& p, const vec3& n, RadianceFunction incident_radiance)
+{
+	vec3 E(0.0f);
+	float total_weight = 0.0f;
+	lookup(root, root_center, root_half_size, p, n, E, total_weight);
+	if(total_weight > 0.0f)
+		return E / total_weight;
+	Record* record = createRecord(p, n, incident_radiance);
+	insert(record);
+	return record->E;
+}
+} // namespace irradiance_cache
+} // namespace pathtracer
@@ -0,0 +1,54 @@
+#pragma once
+#include <glm/glm.hpp>
+
+///////////////////////////////////////////////////////////////////////////
+// An irradiance cache (Ward et al.) for fast, biased previews. Records
+// of the irradiance at a point, with its rotational and translational
+// gradients (Ward and Heckbert), are created lazily where no existing
+// record is close enough, and are interpolated everywhere else. Records
+// are kept in an octree that any number of threads can search and insert
+// into at the same time without locks.
+///////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+namespace irradiance_cache
+{
+extern struct Options
+{
+	bool enabled = false;
+	// Ward's a: lower is more accurate and creates more records
+	float accuracy = 0.3f;
+	// A record is computed from theta_strata x (4 * theta_strata) rays
+	int theta_strata = 8;
+} options;
+
+///////////////////////////////////////////////////////////////////////////
+// Set the region of space that is cached, and drop all records
+///////////////////////////////////////////////////////////////////////////
+void setSceneBounds(const glm::vec3& min, const glm::vec3& max);
+
+///////////////////////////////////////////////////////////////////////////
+// Drop all records, e.g. after lights or materials have changed. Must not
+// be called while other threads use the cache.
+///////////////////////////////////////////////////////////////////////////
+void reset();
+
+///////////////////////////////////////////////////////////////////////////
+// Returns the radiance arriving at origin from direction, and the
+// distance to where it came from
+///////////////////////////////////////////////////////////////////////////
+typedef glm::vec3 (*RadianceFunction)(const glm::vec3& origin, const glm::vec3& direction, float& distance);
+
+///////////////////////////////////////////////////////////////////////////
+// The irradiance at p on a surface with normal n, interpolated from the
+// cache or, if no record is close enough, from a new record computed by
+// sampling incident_radiance over the hemisphere.
+///////////////////////////////////////////////////////////////////////////
+glm::vec3 irradiance(const glm::vec3& p, const glm::vec3& n, RadianceFunction incident_radiance);
+
+///////////////////////////////////////////////////////////////////////////
+// The number of records in the cache
+///////////////////////////////////////////////////////////////////////////
+int numberOfRecords();
+} // namespace irradiance_cache
+} // namespace pathtracer
@@ -12,6 +12,19 @@
 #include <string>
 #include "Pathtracer.h"
 #include "embree.h"
+#include "bvh.h"
+#include "guiding.h"
+#include "irradiance_cache.h"
+#include "scene.h"
+#include "distributed.h"
+#include "checkpoint.h"
+#include "visibility_buffer.h"
+#include "statistics.h"
+#include "batch.h"
+#include "benchmark.h"
+#ifdef PATHTRACER_AVX2
+#include "material_simd.h"
+#endif
 
 using namespace glm;
 using namespace std;
@@ -28,6 +41,9 @@ static float deltaTime = 0.0f;
 // Mouse input
 ivec2 g_prevMouseCoords = { -1, -1 };
 bool g_isMouseDragging = false;
+// Right mouse button drags select a region of interest
+ivec2 g_regionStartCoords = { -1, -1 };
+bool g_isSelectingRegion = false;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Shader programs
@@ -39,6 +55,17 @@ GLuint shaderProgram;
 ///////////////////////////////////////////////////////////////////////////////
 uint32_t pathtracer_result_txt_id;
 
+///////////////////////////////////////////////////////////////////////////////
+// Per pixel cost, shown as a heatmap over the result. Costs are divided by
+// the maximum cost in the image, or by heatmapRange if that is positive.
+///////////////////////////////////////////////////////////////////////////////
+uint32_t heatmap_txt_id;
+float heatmapOpacity = 0.75f;
+float heatmapRange = 0.0f;
+float heatmapMaximum = 0.0f;
+// Workers neither count statistics nor measure costs for us
+bool passDistributed = false;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Camera parameters.
 ///////////////////////////////////////////////////////////////////////////////
@@ -50,6 +77,59 @@ vec3 worldUp(0.0f, 1.0f, 0.0f);
 // Models
 ///////////////////////////////////////////////////////////////////////////////
 vector<pair<labhelper::Model*, mat4>> models;
+pathtracer::SceneDescription scene;
+// Set when the scene and camera come from a job file (--scene)
+bool sceneFromJobFile = false;
+
+///////////////////////////////////////////////////////////////////////////////
+// Rasterize primary visibility with GL instead of tracing primary rays
+///////////////////////////////////////////////////////////////////////////////
+bool rasterizePrimaryHits = false;
+bool visibilityBufferAvailable = false;
+
+///////////////////////////////////////////////////////////////////////////////
+// If set, the pathtracer statistics are saved here on exit (.csv or .json)
+///////////////////////////////////////////////////////////////////////////////
+string statisticsFilename;
+
+///////////////////////////////////////////////////////////////////////////////
+// Checkpointing. If checkpointFilename is set, the progressive result is
+// saved there every checkpointInterval seconds.
+///////////////////////////////////////////////////////////////////////////////
+string checkpointFilename;
+float checkpointInterval = 60.0f;
+float lastCheckpointTime = 0.0f;
+
+void saveCheckpoint()
+{
+	if(checkpointFilename.empty() || pathtracer::rendered_image.number_of_samples == 0)
+	{
+		return;
+	}
+	pathtracer::CheckpointCamera camera = { cameraPosition, cameraDirection };
+	if(pathtracer::saveCheckpoint(checkpointFilename, camera))
+	{
+		cout << "Saved checkpoint with " << pathtracer::rendered_image.number_of_samples << " samples to "
+		     << checkpointFilename << "\n";
+	}
+	lastCheckpointTime = currentTime;
+}
+
+bool resumeCheckpoint(const string& filename)
+{
+	pathtracer::CheckpointCamera camera;
+	if(!pathtracer::loadCheckpoint(filename, camera))
+	{
+		return false;
+	}
+	cameraPosition = camera.position;
+	cameraDirection = camera.direction;
+	// Make the window match the image, so that resize() keeps it
+	SDL_SetWindowSize(g_window, pathtracer::rendered_image.width * pathtracer::settings.subsampling,
+	                  pathtracer::rendered_image.height * pathtracer::settings.subsampling);
+	cout << "Resumed " << filename << " at " << pathtracer::rendered_image.number_of_samples << " samples\n";
+	return true;
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 // Load shaders, environment maps, models and so on
@@ -66,42 +146,43 @@ void initialize()
 	///////////////////////////////////////////////////////////////////////////
 	pathtracer::settings.max_bounces = 8;
 	pathtracer::settings.max_paths_per_pixel = 0; // 0 = Infinite
+	pathtracer::settings.strata = 2;
+	pathtracer::settings.cache_primary_hits = true;
 #ifdef _DEBUG
 	pathtracer::settings.subsampling = 16;
 #else
 	pathtracer::settings.subsampling = 4;
 #endif
 
-	///////////////////////////////////////////////////////////////////////////
-	// Set up light
-	///////////////////////////////////////////////////////////////////////////
-	pathtracer::point_light.intensity_multiplier = 2500.0f;
-	pathtracer::point_light.color = vec3(1.f, 1.f, 1.f);
-	pathtracer::point_light.position = vec3(10.0f, 40.0f, 10.0f);
+	if(!sceneFromJobFile)
+	{
+		///////////////////////////////////////////////////////////////////////
+		// Set up light
+		///////////////////////////////////////////////////////////////////////
+		scene.point_light.intensity_multiplier = 2500.0f;
+		scene.point_light.color = vec3(1.f, 1.f, 1.f);
+		scene.point_light.position = vec3(10.0f, 40.0f, 10.0f);
 
-	///////////////////////////////////////////////////////////////////////////
-	// Load environment map
-	///////////////////////////////////////////////////////////////////////////
-	pathtracer::environment.map.load("../scenes/envmaps/001.hdr");
-	pathtracer::environment.multiplier = 1.0f;
+		///////////////////////////////////////////////////////////////////////
+		// Environment map
+		///////////////////////////////////////////////////////////////////////
+		scene.environment_map = "../scenes/envmaps/001.hdr";
+		scene.environment_multiplier = 1.0f;
 
-	///////////////////////////////////////////////////////////////////////////
-	// Load .obj models to scene
-	///////////////////////////////////////////////////////////////////////////
-	models.push_back(
-	    make_pair(labhelper::loadModelFromOBJ("../scenes/NewShip.obj"), translate(vec3(0.0f, 10.0f, 0.0f))));
-	models.push_back(make_pair(labhelper::loadModelFromOBJ("../scenes/landingpad2.obj"), mat4(1.0f)));
-	//models.push_back(make_pair(labhelper::loadModelFromOBJ("../scenes/tetra_balls.obj"), translate(vec3(10.f, 0.f, 0.f))));
-	//models.push_back(make_pair(labhelper::loadModelFromOBJ("../scenes/BigSphere.obj"), mat4(1.0f)));
+		///////////////////////////////////////////////////////////////////////
+		// .obj models in the scene
+		///////////////////////////////////////////////////////////////////////
+		scene.models.push_back({ "../scenes/NewShip.obj", translate(vec3(0.0f, 10.0f, 0.0f)) });
+		scene.models.push_back({ "../scenes/landingpad2.obj", mat4(1.0f) });
+		//scene.models.push_back({ "../scenes/tetra_balls.obj", translate(vec3(10.f, 0.f, 0.f)) });
+		//scene.models.push_back({ "../scenes/BigSphere.obj", mat4(1.0f) });
+	}
 
 	///////////////////////////////////////////////////////////////////////////
-	// Add models to pathtracer scene
+	// Load everything into the pathtracer
 	///////////////////////////////////////////////////////////////////////////
-	for(auto m : models)
-	{
-		pathtracer::addModel(m.first, m.second);
-	}
-	pathtracer::buildBVH();
+	models = pathtracer::loadScene(scene, true);
+	visibilityBufferAvailable = pathtracer::visibility_buffer::initialize();
 
 	///////////////////////////////////////////////////////////////////////////
 	// Generate result texture
@@ -114,6 +195,14 @@ void initialize()
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
+	glGenTextures(1, &heatmap_txt_id);
+	glBindTexture(GL_TEXTURE_2D, heatmap_txt_id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, pathtracer_result_txt_id);
+
 	///////////////////////////////////////////////////////////////////////////
 	// This is INCORRECT! But an easy way to get us a brighter image that
 	// just looks a little better...
@@ -147,7 +236,15 @@ void display(void)
 	                              float(pathtracer::rendered_image.width)
 	                                  / float(pathtracer::rendered_image.height),
 	                              0.1f, 100.0f);
-	pathtracer::tracePaths(viewMatrix, projMatrix);
+	if(rasterizePrimaryHits && visibilityBufferAvailable)
+	{
+		pathtracer::visibility_buffer::update(models, viewMatrix, projMatrix);
+	}
+	passDistributed = pathtracer::distributed::tracePathsDistributed(viewMatrix, projMatrix);
+	if(!passDistributed)
+	{
+		pathtracer::tracePaths(viewMatrix, projMatrix);
+	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// Copy pathtraced image to texture for display
@@ -155,6 +252,25 @@ void display(void)
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, pathtracer::rendered_image.width,
 	             pathtracer::rendered_image.height, 0, GL_RGB, GL_FLOAT, pathtracer::rendered_image.getPtr());
 
+	///////////////////////////////////////////////////////////////////////////
+	// And the cost of each pixel, if it is measured
+	///////////////////////////////////////////////////////////////////////////
+	const bool showHeatmap = !passDistributed && pathtracer::cost_image.measure != pathtracer::CostMeasure::None
+	                         && pathtracer::cost_image.data.size() == pathtracer::rendered_image.data.size();
+	if(showHeatmap)
+	{
+		heatmapMaximum = 0.0f;
+		for(float cost : pathtracer::cost_image.data)
+		{
+			heatmapMaximum = std::max(heatmapMaximum, cost);
+		}
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, heatmap_txt_id);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, pathtracer::rendered_image.width, pathtracer::rendered_image.height,
+		             0, GL_RED, GL_FLOAT, pathtracer::cost_image.data.data());
+		glActiveTexture(GL_TEXTURE0);
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// Render a fullscreen quad, textured with our pathtraced image.
 	///////////////////////////////////////////////////////////////////////////
@@ -165,6 +281,9 @@ void display(void)
 	glEnable(GL_CULL_FACE);
 	SDL_GetWindowSize(g_window, &windowWidth, &windowHeight);
 	glUseProgram(shaderProgram);
+	const float range = heatmapRange > 0.0f ? heatmapRange : heatmapMaximum;
+	labhelper::setUniformSlow(shaderProgram, "heatmap_opacity", showHeatmap ? heatmapOpacity : 0.0f);
+	labhelper::setUniformSlow(shaderProgram, "heatmap_scale", range > 0.0f ? 1.0f / range : 0.0f);
 	labhelper::drawFullScreenQuad();
 }
 
@@ -201,6 +320,26 @@ bool handleEvents(void)
 			g_isMouseDragging = false;
 		}
 
+		if(event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_RIGHT
+		   && !ImGui::GetIO().WantCaptureMouse)
+		{
+			g_isSelectingRegion = true;
+			g_regionStartCoords = ivec2(event.button.x, event.button.y);
+		}
+		else if(event.type == SDL_MOUSEBUTTONUP && event.button.button == SDL_BUTTON_RIGHT && g_isSelectingRegion)
+		{
+			g_isSelectingRegion = false;
+			int w, h;
+			SDL_GetWindowSize(g_window, &w, &h);
+			// Window coordinates have y down, the image has y up
+			vec2 a(float(g_regionStartCoords.x) / float(w), 1.0f - float(g_regionStartCoords.y) / float(h));
+			vec2 b(float(event.button.x) / float(w), 1.0f - float(event.button.y) / float(h));
+			if(a.x != b.x && a.y != b.y)
+			{
+				pathtracer::setRegionOfInterest(a, b);
+			}
+		}
+
 		if(event.type == SDL_MOUSEMOTION && g_isMouseDragging)
 		{
 			// More info at https://wiki.libsdl.org/SDL_MouseMotionEvent
@@ -307,10 +446,185 @@ void gui()
 		ImGui::SliderInt("Subsampling", &pathtracer::settings.subsampling, 1, 16);
 		ImGui::SliderInt("Max Bounces", &pathtracer::settings.max_bounces, 0, 16);
 		ImGui::SliderInt("Max Paths Per Pixel", &pathtracer::settings.max_paths_per_pixel, 0, 1024);
+		if(ImGui::SliderInt("Strata", &pathtracer::settings.strata, 1, 4))
+		{
+			pathtracer::restart();
+		}
+		ImGui::Checkbox("Cache Primary Hits", &pathtracer::settings.cache_primary_hits);
+		if(pathtracer::settings.cache_primary_hits && visibilityBufferAvailable)
+		{
+			ImGui::Checkbox("Rasterize Primary Hits", &rasterizePrimaryHits);
+		}
+		if(ImGui::Checkbox("Irradiance Cache (Preview)", &pathtracer::irradiance_cache::options.enabled))
+		{
+			pathtracer::restart();
+		}
+		if(pathtracer::irradiance_cache::options.enabled)
+		{
+			if(ImGui::SliderFloat("Cache Accuracy", &pathtracer::irradiance_cache::options.accuracy, 0.05f, 1.0f))
+			{
+				pathtracer::irradiance_cache::reset();
+				pathtracer::restart();
+			}
+			ImGui::Text("%d irradiance records", pathtracer::irradiance_cache::numberOfRecords());
+			ImGui::SameLine();
+			if(ImGui::Button("Reset Cache"))
+			{
+				pathtracer::irradiance_cache::reset();
+				pathtracer::restart();
+			}
+		}
+		if(ImGui::Checkbox("Path Guiding", &pathtracer::guiding::options.enabled))
+		{
+			pathtracer::restart();
+		}
+		if(pathtracer::guiding::options.enabled)
+		{
+			ImGui::SliderFloat("Guiding BRDF Fraction", &pathtracer::guiding::options.brdf_sampling_fraction, 0.0f, 1.0f);
+			ImGui::SliderInt("Guiding Iterations", &pathtracer::guiding::options.training_iterations, 0, 16);
+			if(pathtracer::region.enabled)
+			{
+				ImGui::Text("Not used while a region is enabled");
+			}
+			ImGui::Text("Guiding iteration %d", pathtracer::guiding::iteration());
+			ImGui::SameLine();
+			if(ImGui::Button("Reset Guiding"))
+			{
+				pathtracer::guiding::reset();
+				pathtracer::restart();
+			}
+		}
 		if(ImGui::Button("Restart Pathtracing"))
 		{
 			pathtracer::restart();
 		}
+		if(pathtracer::distributed::numberOfWorkers() > 0)
+		{
+			ImGui::Text("Distributed over %d workers", pathtracer::distributed::numberOfWorkers());
+			if(pathtracer::irradiance_cache::options.enabled || pathtracer::guiding::options.enabled)
+			{
+				ImGui::Text("(workers are idle while the irradiance cache or guiding is on)");
+			}
+		}
+		if(pathtracer::getAccelerationBackend() == pathtracer::AccelerationBackend::SAH_BVH)
+		{
+			pathtracer::bvh::Statistics stats = pathtracer::bvh::statistics();
+			float rays = float(std::max(stats.rays, uint64_t(1)));
+			ImGui::Text("BVH: %.1f nodes, %.1f triangles per ray", float(stats.node_visits) / rays,
+			            float(stats.triangle_tests) / rays);
+			ImGui::SameLine();
+			if(ImGui::Button("Reset"))
+			{
+				pathtracer::bvh::resetStatistics();
+			}
+		}
+		if(ImGui::Checkbox("Region of interest (right drag)", &pathtracer::region.enabled))
+		{
+			pathtracer::restart();
+		}
+		if(pathtracer::region.enabled)
+		{
+			bool changed = false;
+			changed |= ImGui::SliderFloat2("Region min", &pathtracer::region.min.x, 0.0f, 1.0f);
+			changed |= ImGui::SliderFloat2("Region max", &pathtracer::region.max.x, 0.0f, 1.0f);
+			changed |= ImGui::Checkbox("Bucket mode", &pathtracer::region.bucket_mode);
+			if(pathtracer::region.bucket_mode)
+			{
+				changed |= ImGui::SliderInt("Bucket size", &pathtracer::region.bucket_size, 8, 256);
+				changed |= ImGui::SliderInt("Bucket samples", &pathtracer::region.bucket_samples, 1, 4096);
+				ImGui::Text("Bucket %d of %d, %d samples", std::min(pathtracer::region.current_bucket + 1,
+				                                                     pathtracer::numberOfBuckets()),
+				            pathtracer::numberOfBuckets(), pathtracer::region.number_of_samples);
+			}
+			else
+			{
+				ImGui::Text("%d samples", pathtracer::region.number_of_samples);
+			}
+			if(changed)
+			{
+				pathtracer::setRegionOfInterest(pathtracer::region.min, pathtracer::region.max);
+			}
+		}
+		if(!checkpointFilename.empty() && ImGui::Button("Save Checkpoint"))
+		{
+			saveCheckpoint();
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Pathtracer statistics
+	///////////////////////////////////////////////////////////////////////////
+	if(ImGui::CollapsingHeader("Statistics", "statistics_ch", true, false))
+	{
+		namespace statistics = pathtracer::statistics;
+		ImGui::Checkbox("Collect Statistics", &statistics::options.enabled);
+		ImGui::SameLine();
+		ImGui::Checkbox("Timing", &statistics::options.timing);
+		if(passDistributed)
+		{
+			ImGui::Text("(passes traced by workers are not counted)");
+		}
+		const statistics::Summary& pass = statistics::lastPass();
+		const statistics::Summary& total = statistics::total();
+		ImGui::Text("%d samples per pixel, %d passes", pathtracer::rendered_image.number_of_samples, total.passes);
+		ImGui::Text("Last pass: %.1f ms, %.2f Mrays/s", pass.seconds * 1000.0, pass.raysPerSecond() * 1e-6);
+		ImGui::Text("Average: %.1f ms per pass, %.2f Mrays/s",
+		            total.passes > 0 ? total.seconds * 1000.0 / total.passes : 0.0, total.raysPerSecond() * 1e-6);
+		ImGui::Text("Rays: %.2fM primary, %.2fM shadow, %.2fM bounce", total.rays[statistics::PrimaryRay] * 1e-6,
+		            total.rays[statistics::ShadowRay] * 1e-6, total.rays[statistics::BounceRay] * 1e-6);
+		ImGui::Text("Cached primary hits: %.2fM", total.cached_primary_hits * 1e-6);
+		if(statistics::options.timing)
+		{
+			ImGui::Text("Thread time: %.2f s intersecting, %.2f s shading", total.intersection_seconds,
+			            total.shading_seconds);
+		}
+		float histogram[statistics::max_path_length + 1];
+		for(int i = 0; i <= statistics::max_path_length; i++)
+		{
+			histogram[i] = total.paths > 0 ? float(double(total.path_length[i]) / double(total.paths)) : 0.0f;
+		}
+		char overlay[64];
+		snprintf(overlay, sizeof(overlay), "%.2f hits per path", total.averagePathLength());
+		ImGui::PlotHistogram("Path length", histogram, statistics::max_path_length + 1, 0, overlay, 0.0f, 1.0f,
+		                     ImVec2(0, 60));
+		const char* measures[] = { "None", "Rays per path", "Time per path" };
+		int measure = int(pathtracer::cost_image.measure);
+		if(ImGui::Combo("Cost Heatmap", &measure, measures, 3))
+		{
+			pathtracer::cost_image.measure = pathtracer::CostMeasure(measure);
+			if(pathtracer::cost_image.measure == pathtracer::CostMeasure::Rays)
+			{
+				statistics::options.enabled = true;
+			}
+			pathtracer::restart();
+		}
+		if(pathtracer::cost_image.measure != pathtracer::CostMeasure::None && passDistributed)
+		{
+			ImGui::Text("(no heatmap while workers trace the passes)");
+		}
+		else if(pathtracer::cost_image.measure != pathtracer::CostMeasure::None)
+		{
+			ImGui::SliderFloat("Heatmap Opacity", &heatmapOpacity, 0.0f, 1.0f);
+			const bool rays = pathtracer::cost_image.measure == pathtracer::CostMeasure::Rays;
+			ImGui::SliderFloat("Heatmap Range (0 = max)", &heatmapRange, 0.0f, rays ? 64.0f : 1e6f, "%.1f",
+			                   rays ? 1.0f : 4.0f);
+			ImGui::Text("Red: %.1f %s, maximum %.1f", heatmapRange > 0.0f ? heatmapRange : heatmapMaximum,
+			            rays ? "rays" : "ns", heatmapMaximum);
+		}
+		if(ImGui::Button("Reset Statistics"))
+		{
+			statistics::reset();
+		}
+		ImGui::SameLine();
+		if(ImGui::Button("Export CSV"))
+		{
+			statistics::save("pathtracer_statistics.csv");
+		}
+		ImGui::SameLine();
+		if(ImGui::Button("Export JSON"))
+		{
+			statistics::save("pathtracer_statistics.json");
+		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -408,10 +722,213 @@ void gui()
 
 int main(int argc, char* argv[])
 {
+	///////////////////////////////////////////////////////////////////////////
+	// Distributed rendering options:
+	//   --worker <host>:<port>   Render tiles for a coordinator (no window)
+	//   --coordinator [<address>:]<port>
+	//                            Hand out tiles to workers that connect to
+	//                            address (default 127.0.0.1; 0.0.0.0 for
+	//                            workers on other machines)
+	//   --local-workers <n>      Also start n workers on this machine
+	//
+	// Checkpoint options:
+	//   --checkpoint <file>      Periodically save the progressive result
+	//   --checkpoint-interval <s> Seconds between checkpoints (default 60)
+	//   --resume <file>          Continue rendering from a checkpoint
+	//
+	//   --accel embree|bvh       Intersect with Embree (default) or the
+	//                            in-tree SAH BVH
+	//
+	//   --numa                   Pin threads to NUMA nodes and place image
+	//                            buffers on the nodes that write them
+	//   --numa-replicate         Also copy the BVH (--accel bvh) to each node
+	//
+	//   --raster-primary         Find primary hits by rasterizing with GL
+	//   --statistics <file>      Save ray and pass statistics on exit
+	//                            (.csv: one line per pass, else .json)
+	//
+	// Job files (see batch.h):
+	//   --batch <file.job>       Render all jobs of a job file (no window)
+	//   --scene <file.job>       Explore the scene of a job file, from the
+	//                            camera of its first job
+	//   --benchmark <file.job> <results.csv>
+	//                            Measure error against the references of a
+	//                            job file over time (see benchmark.h)
+	//   --benchmark-samples <n>  Samples per pixel per job (default 1024)
+	//   --benchmark-seconds <s>  Seconds per job (default 60)
+	//
+	//   --check-simd             Compare the 8-wide shading kernels with
+	//                            the scalar BRDFs and exit (PATHTRACER_AVX2)
+	///////////////////////////////////////////////////////////////////////////
+	string coordinator_address = "127.0.0.1";
+	int coordinator_port = 0;
+	int local_workers = 0;
+	string resume_filename;
+	string worker_address, batch_filename;
+	string benchmark_filename, benchmark_results_filename;
+	bool numa = false;
+	bool check_simd = false;
+	for(int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if(arg == "--worker" && i + 1 < argc)
+		{
+			worker_address = argv[++i];
+		}
+		else if(arg == "--batch" && i + 1 < argc)
+		{
+			batch_filename = argv[++i];
+		}
+		else if(arg == "--benchmark" && i + 2 < argc)
+		{
+			benchmark_filename = argv[++i];
+			benchmark_results_filename = argv[++i];
+		}
+		else if(arg == "--benchmark-samples" && i + 1 < argc)
+		{
+			pathtracer::benchmark::options.max_samples = atoi(argv[++i]);
+		}
+		else if(arg == "--check-simd")
+		{
+			check_simd = true;
+		}
+		else if(arg == "--benchmark-seconds" && i + 1 < argc)
+		{
+			pathtracer::benchmark::options.max_seconds = float(atof(argv[++i]));
+		}
+		else if(arg == "--scene" && i + 1 < argc)
+		{
+			pathtracer::batch::JobFile job_file;
+			if(!pathtracer::batch::loadJobFile(argv[++i], job_file))
+			{
+				return 1;
+			}
+			scene = job_file.scene;
+			sceneFromJobFile = true;
+			if(!job_file.jobs.empty())
+			{
+				cameraPosition = job_file.jobs[0].camera_position;
+				cameraDirection = normalize(job_file.jobs[0].camera_target - cameraPosition);
+			}
+		}
+		else if(arg == "--coordinator" && i + 1 < argc)
+		{
+			string address = argv[++i];
+			size_t colon = address.find_last_of(':');
+			if(colon != string::npos)
+			{
+				coordinator_address = address.substr(0, colon);
+				address = address.substr(colon + 1);
+			}
+			coordinator_port = atoi(address.c_str());
+		}
+		else if(arg == "--local-workers" && i + 1 < argc)
+		{
+			local_workers = atoi(argv[++i]);
+		}
+		else if(arg == "--checkpoint" && i + 1 < argc)
+		{
+			checkpointFilename = argv[++i];
+		}
+		else if(arg == "--checkpoint-interval" && i + 1 < argc)
+		{
+			checkpointInterval = float(atof(argv[++i]));
+		}
+		else if(arg == "--resume" && i + 1 < argc)
+		{
+			resume_filename = argv[++i];
+		}
+		else if(arg == "--numa")
+		{
+			numa = true;
+		}
+		else if(arg == "--numa-replicate")
+		{
+			numa = true;
+			pathtracer::numa::replicate_scene = true;
+		}
+		else if(arg == "--statistics" && i + 1 < argc)
+		{
+			statisticsFilename = argv[++i];
+		}
+		else if(arg == "--raster-primary")
+		{
+			rasterizePrimaryHits = true;
+		}
+		else if(arg == "--accel" && i + 1 < argc)
+		{
+			string accel = argv[++i];
+			if(accel == "bvh")
+			{
+				pathtracer::setAccelerationBackend(pathtracer::AccelerationBackend::SAH_BVH);
+			}
+			else if(accel != "embree")
+			{
+				cout << "Unknown acceleration structure " << accel << ", expected embree or bvh\n";
+				return 1;
+			}
+		}
+	}
+
+	if(numa)
+	{
+		pathtracer::numa::initialize();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Modes without a window, once all options have been applied
+	///////////////////////////////////////////////////////////////////////////
+	if(!worker_address.empty())
+	{
+		size_t colon = worker_address.find_last_of(':');
+		if(colon == string::npos)
+		{
+			cout << "Expected --worker <host>:<port>\n";
+			return 1;
+		}
+		return pathtracer::distributed::runWorker(worker_address.substr(0, colon),
+		                                          atoi(&worker_address[colon + 1]));
+	}
+
+	if(check_simd)
+	{
+#ifdef PATHTRACER_AVX2
+		return pathtracer::simd::checkAgainstScalar(100000) ? 0 : 1;
+#else
+		cout << "The 8-wide shading kernels are only built with PATHTRACER_AVX2.\n";
+		return 1;
+#endif
+	}
+
+	if(!batch_filename.empty())
+	{
+		return pathtracer::batch::run(batch_filename);
+	}
+
+	if(!benchmark_filename.empty())
+	{
+		return pathtracer::benchmark::run(benchmark_filename, benchmark_results_filename);
+	}
+
 	g_window = labhelper::init_window_SDL("Pathtracer", 1280, 720);
 
 	initialize();
 
+	if(!resume_filename.empty() && !resumeCheckpoint(resume_filename))
+	{
+		return 1;
+	}
+	if(checkpointFilename.empty())
+	{
+		// Keep checkpointing to the file we resumed from
+		checkpointFilename = resume_filename;
+	}
+
+	if(coordinator_port != 0)
+	{
+		pathtracer::distributed::startCoordinator(coordinator_address, coordinator_port, scene, local_workers, argv[0]);
+	}
+
 	bool stopRendering = false;
 	auto startTime = std::chrono::system_clock::now();
 
@@ -433,8 +950,23 @@ int main(int argc, char* argv[])
 
 		// check events (keyboard among other)
 		stopRendering = handleEvents();
+
+		if(!checkpointFilename.empty() && currentTime - lastCheckpointTime > checkpointInterval)
+		{
+			saveCheckpoint();
+		}
+	}
+
+	// Don't lose the samples since the last checkpoint
+	saveCheckpoint();
+	if(!statisticsFilename.empty())
+	{
+		pathtracer::statistics::save(statisticsFilename);
 	}
 
+	pathtracer::distributed::stopCoordinator();
+	pathtracer::visibility_buffer::destroy();
+
 	// Delete Models
 	for(auto& m : models)
 	{
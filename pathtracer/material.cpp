@@ -21,23 +21,43 @@ vec3 Diffuse::sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p)
 	vec3 bitangent = normalize(cross(tangent, n));
 	vec3 sample = cosineSampleHemisphere();
 	wi = normalize(sample.x * tangent + sample.y * bitangent + sample.z * n);
-	if(dot(wi, n) <= 0.0f)
-		p = 0.0f;
-	else
-		p = max(0.0f, dot(n, wi)) / M_PI;
+	p = pdf(wi, wo, n);
 	return f(wi, wo, n);
 }
 
+float Diffuse::pdf(const vec3& wi, const vec3& /*wo*/, const vec3& n)
+{
+	if(dot(wi, n) <= 0.0f)
+		return 0.0f;
+	return dot(n, wi) / M_PI;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // A Blinn Phong Dielectric Microfacet BRFD
 ///////////////////////////////////////////////////////////////////////////
 vec3 BlinnPhong::refraction_brdf(const vec3& wi, const vec3& wo, const vec3& n)
 {
-	return vec3(0.0f);
+	if(refraction_layer == NULL)
+		return vec3(0.0f);
+	if(dot(n, wi) <= 0.0f || dot(n, wo) <= 0.0f)
+		return vec3(0.0f);
+	const vec3 wh = normalize(wi + wo);
+	const float F = R0 + (1.0f - R0) * pow(1.0f - max(0.0f, dot(wh, wi)), 5.0f);
+	return (1.0f - F) * refraction_layer->f(wi, wo, n);
 }
 vec3 BlinnPhong::reflection_brdf(const vec3& wi, const vec3& wo, const vec3& n)
 {
-	return vec3(0.0f);
+	const float n_dot_wi = dot(n, wi);
+	const float n_dot_wo = dot(n, wo);
+	if(n_dot_wi <= 0.0f || n_dot_wo <= 0.0f)
+		return vec3(0.0f);
+	const vec3 wh = normalize(wi + wo);
+	const float n_dot_wh = max(0.0f, dot(n, wh));
+	const float wo_dot_wh = max(EPSILON, dot(wo, wh));
+	const float F = R0 + (1.0f - R0) * pow(1.0f - max(0.0f, dot(wh, wi)), 5.0f);
+	const float D = (shininess + 2.0f) / (2.0f * M_PI) * pow(n_dot_wh, shininess);
+	const float G = min(1.0f, min(2.0f * n_dot_wh * n_dot_wo / wo_dot_wh, 2.0f * n_dot_wh * n_dot_wi / wo_dot_wh));
+	return vec3(F * D * G / (4.0f * n_dot_wo * n_dot_wi));
 }
 
 vec3 BlinnPhong::f(const vec3& wi, const vec3& wo, const vec3& n)
@@ -45,23 +65,61 @@ vec3 BlinnPhong::f(const vec3& wi, const vec3& wo, const vec3& n)
 	return reflection_brdf(wi, wo, n) + refraction_brdf(wi, wo, n);
 }
 
+float BlinnPhong::reflection_probability(const vec3& wo, const vec3& n)
+{
+	if(refraction_layer == NULL)
+		return 1.0f;
+	// Pick the lobes in proportion to the Fresnel reflectance seen from wo,
+	// but never starve either of them completely.
+	const float F = R0 + (1.0f - R0) * pow(1.0f - max(0.0f, dot(n, wo)), 5.0f);
+	return clamp(F, 0.1f, 0.9f);
+}
+
 vec3 BlinnPhong::sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p)
 {
-	vec3 tangent = normalize(perpendicular(n));
-	vec3 bitangent = normalize(cross(tangent, n));
-	vec3 sample = cosineSampleHemisphere();
-	wi = normalize(sample.x * tangent + sample.y * bitangent + sample.z * n);
-	if(dot(wi, n) <= 0.0f)
-		p = 0.0f;
+	const float p_reflection = reflection_probability(wo, n);
+	if(p_reflection == 1.0f || randf() < p_reflection)
+	{
+		// Sample a half vector from the Blinn distribution, which has the
+		// pdf (shininess + 1) / (2 * pi) * dot(n, wh)^shininess, and
+		// reflect wo around it.
+		vec3 tangent = normalize(perpendicular(n));
+		vec3 bitangent = normalize(cross(tangent, n));
+		const float phi = 2.0f * M_PI * randf();
+		const float cos_theta = pow(randf(), 1.0f / (shininess + 1.0f));
+		const float sin_theta = sqrt(max(0.0f, 1.0f - cos_theta * cos_theta));
+		const vec3 wh = normalize(sin_theta * cos(phi) * tangent + sin_theta * sin(phi) * bitangent
+		                          + cos_theta * n);
+		wi = reflect(-wo, wh);
+	}
 	else
-		p = max(0.0f, dot(n, wi)) / M_PI;
+	{
+		refraction_layer->sample_wi(wi, wo, n, p);
+	}
+	p = pdf(wi, wo, n);
 	return f(wi, wo, n);
 }
 
+float BlinnPhong::pdf(const vec3& wi, const vec3& wo, const vec3& n)
+{
+	const float p_reflection = reflection_probability(wo, n);
+	float p = 0.0f;
+	if(p_reflection < 1.0f)
+		p = (1.0f - p_reflection) * refraction_layer->pdf(wi, wo, n);
+	if(dot(n, wi) <= 0.0f || dot(n, wo) <= 0.0f)
+		return p;
+	const vec3 wh = normalize(wi + wo);
+	const float wo_dot_wh = dot(wo, wh);
+	if(wo_dot_wh <= 0.0f)
+		return p;
+	const float p_wh = (shininess + 1.0f) / (2.0f * M_PI) * pow(max(0.0f, dot(n, wh)), shininess);
+	return p + p_reflection * p_wh / (4.0f * wo_dot_wh);
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // A Blinn Phong Metal Microfacet BRFD (extends the BlinnPhong class)
 ///////////////////////////////////////////////////////////////////////////
-vec3 BlinnPhongMetal::refraction_brdf(const vec3& wi, const vec3& wo, const vec3& n)
+vec3 BlinnPhongMetal::refraction_brdf(const vec3& /*wi*/, const vec3& /*wo*/, const vec3& /*n*/)
 {
 	return vec3(0.0f);
 }
@@ -69,19 +127,35 @@ vec3 BlinnPhongMetal::reflection_brdf(const vec3& wi, const vec3& wo, const vec3
 {
 	return BlinnPhong::reflection_brdf(wi, wo, n) * color;
 };
+float BlinnPhongMetal::reflection_probability(const vec3& /*wo*/, const vec3& /*n*/)
+{
+	// A metal has no refraction layer, so always sample the microfacet lobe
+	return 1.0f;
+}
 
 ///////////////////////////////////////////////////////////////////////////
 // A Linear Blend between two BRDFs
 ///////////////////////////////////////////////////////////////////////////
 vec3 LinearBlend::f(const vec3& wi, const vec3& wo, const vec3& n)
 {
-	return vec3(0.0);
+	return w * bsdf0->f(wi, wo, n) + (1.0f - w) * bsdf1->f(wi, wo, n);
 }
 
 vec3 LinearBlend::sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p)
 {
-	p = 0.0f;
-	return vec3(0.0f);
+	// Choose which BRDF to sample in proportion to its weight, but return
+	// the full blend and the pdf of the mixture.
+	if(randf() < w)
+		bsdf0->sample_wi(wi, wo, n, p);
+	else
+		bsdf1->sample_wi(wi, wo, n, p);
+	p = pdf(wi, wo, n);
+	return f(wi, wo, n);
+}
+
+float LinearBlend::pdf(const vec3& wi, const vec3& wo, const vec3& n)
+{
+	return w * bsdf0->pdf(wi, wo, n) + (1.0f - w) * bsdf1->pdf(wi, wo, n);
 }
 
 ///////////////////////////////////////////////////////////////////////////
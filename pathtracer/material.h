@@ -18,6 +18,8 @@ public:
 	// Sample a suitable direction and return the brdf in that direction as
 	// well as the pdf (~probability) that the direction was chosen.
 	virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) = 0;
+	// Return the pdf with which sample_wi() would choose the direction wi.
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) = 0;
 };
 
 ///////////////////////////////////////////////////////////////////////////
@@ -32,6 +34,7 @@ public:
 	}
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) override;
 	virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) override;
 };
 
 ///////////////////////////////////////////////////////////////////////////
@@ -49,8 +52,12 @@ public:
 	}
 	virtual vec3 refraction_brdf(const vec3& wi, const vec3& wo, const vec3& n);
 	virtual vec3 reflection_brdf(const vec3& wi, const vec3& wo, const vec3& n);
+	// The probability of sampling the microfacet lobe rather than the
+	// refraction layer.
+	virtual float reflection_probability(const vec3& wo, const vec3& n);
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) override;
 	virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) override;
 };
 
 ///////////////////////////////////////////////////////////////////////////
@@ -65,6 +72,7 @@ public:
 	}
 	virtual vec3 refraction_brdf(const vec3& wi, const vec3& wo, const vec3& n);
 	virtual vec3 reflection_brdf(const vec3& wi, const vec3& wo, const vec3& n);
+	virtual float reflection_probability(const vec3& wo, const vec3& n);
 };
 
 ///////////////////////////////////////////////////////////////////////////
@@ -79,6 +87,7 @@ public:
 	LinearBlend(float _w, BRDF* a, BRDF* b) : w(_w), bsdf0(a), bsdf1(b){};
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) override;
 	virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) override;
 };
 
 } // namespace pathtracer
\ No newline at end of file
@@ -0,0 +1,401 @@
+#include "material_simd.h"
+#include "Pathtracer.h"
+#include "material.h"
+#include <omp.h>
+#include <iostream>
+#include <random>
+
+namespace pathtracer
+{
+namespace simd
+{
+///////////////////////////////////////////////////////////////////////////
+// One 8-wide generator per thread, a cache line each, lazily seeded from
+// the thread number
+///////////////////////////////////////////////////////////////////////////
+struct alignas(cache_line_size) SeededRng8
+{
+	Rng8 rng;
+	bool seeded = false;
+};
+static std::vector<SeededRng8, CacheLineAllocator<SeededRng8>> generators8(maxThreads());
+
+Rng8& rng8()
+{
+	const int thread = omp_get_thread_num();
+	SeededRng8& g = generators8[thread];
+	if(!g.seeded)
+	{
+		g.rng.seed(uint32_t(thread) * 0x01000193u + 1u);
+		g.seeded = true;
+	}
+	return g.rng;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Generate uniform points on a disc (Shirley and Chiu's concentric map)
+///////////////////////////////////////////////////////////////////////////
+void concentricSampleDisk(Rng8& rng, floatx8& dx, floatx8& dy)
+{
+	const floatx8 sx = fmadd(rng.next(), floatx8(2.0f), floatx8(-1.0f));
+	const floatx8 sy = fmadd(rng.next(), floatx8(2.0f), floatx8(-1.0f));
+	// Pick the wedge the point is in, and the angle within that wedge
+	const maskx8 x_major = abs(sx) > abs(sy);
+	const floatx8 r = select(x_major, sx, sy);
+	const floatx8 num = select(x_major, sy, sx);
+	const floatx8 den = select(abs(r) > floatx8(0.0f), r, floatx8(1.0f));
+	floatx8 s, c;
+	sincos_pi4(floatx8(M_PI / 4.0f) * (num / den), s, c);
+	dx = r * select(x_major, c, s);
+	dy = r * select(x_major, s, c);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Generate points with a cosine distribution on the hemisphere
+///////////////////////////////////////////////////////////////////////////
+vec3x8 cosineSampleHemisphere(Rng8& rng)
+{
+	vec3x8 ret;
+	concentricSampleDisk(rng, ret.x, ret.y);
+	ret.z = sqrt(max(floatx8(0.0f), floatx8(1.0f) - ret.x * ret.x - ret.y * ret.y));
+	return ret;
+}
+
+void MaterialX8::load(const labhelper::Material* const materials[width])
+{
+	alignas(32) float cx[width], cy[width], cz[width], refl[width], metal[width], fres[width], shin[width];
+	for(int i = 0; i < width; i++)
+	{
+		const labhelper::Material* m = materials[i];
+		cx[i] = m != nullptr ? m->m_color.x : 0.0f;
+		cy[i] = m != nullptr ? m->m_color.y : 0.0f;
+		cz[i] = m != nullptr ? m->m_color.z : 0.0f;
+		refl[i] = m != nullptr ? m->m_reflectivity : 0.0f;
+		metal[i] = m != nullptr ? m->m_metalness : 0.0f;
+		fres[i] = m != nullptr ? m->m_fresnel : 0.0f;
+		shin[i] = m != nullptr ? m->m_shininess : 0.0f;
+	}
+	color = vec3x8(floatx8::load(cx), floatx8::load(cy), floatx8::load(cz));
+	reflectivity = floatx8::load(refl);
+	metalness = floatx8::load(metal);
+	fresnel = floatx8::load(fres);
+	shininess = floatx8::load(shin);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Sample a cosine distributed direction around n
+///////////////////////////////////////////////////////////////////////////
+static vec3x8 sampleAroundNormal(const vec3x8& n, Rng8& rng)
+{
+	vec3x8 tangent, bitangent;
+	tangentFrame(n, tangent, bitangent);
+	const vec3x8 sample = cosineSampleHemisphere(rng);
+	return sample.x * tangent + sample.y * bitangent + sample.z * n;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A Lambertian (diffuse) material
+///////////////////////////////////////////////////////////////////////////
+vec3x8 diffuse_f(const vec3x8& color, const vec3x8& wi, const vec3x8& wo, const vec3x8& n)
+{
+	const floatx8 zero(0.0f);
+	const maskx8 valid = (dot(wi, n) > zero) & (dot(wo, n) > zero);
+	return select(valid, floatx8(1.0f / M_PI), zero) * color;
+}
+
+floatx8 diffuse_pdf(const vec3x8& wi, const vec3x8& /*wo*/, const vec3x8& n)
+{
+	return max(floatx8(0.0f), dot(n, wi)) * floatx8(1.0f / M_PI);
+}
+
+vec3x8 diffuse_sample_wi(const vec3x8& color, vec3x8& wi, const vec3x8& wo, const vec3x8& n, floatx8& p, Rng8& rng)
+{
+	wi = sampleAroundNormal(n, rng);
+	p = diffuse_pdf(wi, wo, n);
+	return diffuse_f(color, wi, wo, n);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A Blinn Phong Dielectric Microfacet BRFD
+///////////////////////////////////////////////////////////////////////////
+static floatx8 schlick(const floatx8& R0, const vec3x8& wh, const vec3x8& wi)
+{
+	const floatx8 a = floatx8(1.0f) - max(floatx8(0.0f), dot(wh, wi));
+	const floatx8 a2 = a * a;
+	return fmadd(floatx8(1.0f) - R0, a2 * a2 * a, R0);
+}
+
+floatx8 blinnphong_reflection(const floatx8& shininess,
+                              const floatx8& R0,
+                              const vec3x8& wi,
+                              const vec3x8& wo,
+                              const vec3x8& n)
+{
+	const floatx8 zero(0.0f);
+	const floatx8 n_dot_wi = dot(n, wi);
+	const floatx8 n_dot_wo = dot(n, wo);
+	const maskx8 valid = (n_dot_wi > zero) & (n_dot_wo > zero);
+	const vec3x8 wh = normalize(wi + wo);
+	const floatx8 n_dot_wh = max(zero, dot(n, wh));
+	const floatx8 wo_dot_wh = max(floatx8(EPSILON), dot(wo, wh));
+	const floatx8 F = schlick(R0, wh, wi);
+	const floatx8 D = (shininess + floatx8(2.0f)) * floatx8(1.0f / (2.0f * M_PI)) * pow(n_dot_wh, shininess);
+	const floatx8 G_factor = floatx8(2.0f) * n_dot_wh / wo_dot_wh;
+	const floatx8 G = min(floatx8(1.0f), G_factor * min(n_dot_wo, n_dot_wi));
+	const floatx8 denominator = floatx8(4.0f) * n_dot_wo * n_dot_wi;
+	return select(valid, F * D * G / select(valid, denominator, floatx8(1.0f)), zero);
+}
+
+floatx8 blinnphong_transmission(const floatx8& R0, const vec3x8& wi, const vec3x8& wo, const vec3x8& n)
+{
+	const floatx8 zero(0.0f);
+	const maskx8 valid = (dot(n, wi) > zero) & (dot(n, wo) > zero);
+	const vec3x8 wh = normalize(wi + wo);
+	return select(valid, floatx8(1.0f) - schlick(R0, wh, wi), zero);
+}
+
+floatx8 blinnphong_pdf(const floatx8& shininess, const vec3x8& wi, const vec3x8& wo, const vec3x8& n)
+{
+	const floatx8 zero(0.0f);
+	const vec3x8 wh = normalize(wi + wo);
+	const floatx8 wo_dot_wh = dot(wo, wh);
+	const maskx8 valid = (dot(n, wi) > zero) & (dot(n, wo) > zero) & (wo_dot_wh > zero);
+	const floatx8 p_wh = (shininess + floatx8(1.0f)) * floatx8(1.0f / (2.0f * M_PI))
+	                     * pow(max(zero, dot(n, wh)), shininess);
+	return select(valid, p_wh / (floatx8(4.0f) * select(valid, wo_dot_wh, floatx8(1.0f))), zero);
+}
+
+vec3x8 blinnphong_sample_wi(const floatx8& shininess, const vec3x8& wo, const vec3x8& n, Rng8& rng)
+{
+	// A point on the unit disk gives both a uniform azimuth (its direction)
+	// and an independent uniform number (its squared radius), which saves
+	// us a full range sin/cos.
+	floatx8 dx, dy;
+	concentricSampleDisk(rng, dx, dy);
+	const floatx8 r2 = dx * dx + dy * dy;
+	const maskx8 nonzero = r2 > floatx8(0.0f);
+	const floatx8 inv_r = select(nonzero, floatx8(1.0f) / sqrt(select(nonzero, r2, floatx8(1.0f))), floatx8(0.0f));
+	const floatx8 cos_theta = pow(r2, floatx8(1.0f) / (shininess + floatx8(1.0f)));
+	const floatx8 sin_theta = sqrt(max(floatx8(0.0f), floatx8(1.0f) - cos_theta * cos_theta));
+	vec3x8 tangent, bitangent;
+	tangentFrame(n, tangent, bitangent);
+	const vec3x8 wh = (sin_theta * dx * inv_r) * tangent + (sin_theta * dy * inv_r) * bitangent + cos_theta * n;
+	return (floatx8(2.0f) * dot(wo, wh)) * wh - wo;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The complete material tree
+///////////////////////////////////////////////////////////////////////////
+vec3x8 material_f(const MaterialX8& m, const vec3x8& wi, const vec3x8& wo, const vec3x8& n)
+{
+	const floatx8 one(1.0f);
+	const vec3x8 diffuse = diffuse_f(m.color, wi, wo, n);
+	const floatx8 reflection = blinnphong_reflection(m.shininess, m.fresnel, wi, wo, n);
+	const floatx8 transmission = blinnphong_transmission(m.fresnel, wi, wo, n);
+	const vec3x8 dielectric = vec3x8(reflection, reflection, reflection) + transmission * diffuse;
+	const vec3x8 metal = reflection * m.color;
+	const vec3x8 metal_blend = m.metalness * metal + (one - m.metalness) * dielectric;
+	return m.reflectivity * metal_blend + (one - m.reflectivity) * diffuse;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The probability of sampling the microfacet lobe anywhere in the tree,
+// matching the lobe selection of LinearBlend and BlinnPhong.
+///////////////////////////////////////////////////////////////////////////
+static floatx8 microfacetProbability(const MaterialX8& m, const vec3x8& wo, const vec3x8& n)
+{
+	const floatx8 one(1.0f);
+	const floatx8 a = one - max(floatx8(0.0f), dot(n, wo));
+	const floatx8 a2 = a * a;
+	const floatx8 F = fmadd(one - m.fresnel, a2 * a2 * a, m.fresnel);
+	const floatx8 p_dielectric = min(max(F, floatx8(0.1f)), floatx8(0.9f));
+	return m.reflectivity * fmadd(one - m.metalness, p_dielectric, m.metalness);
+}
+
+floatx8 material_pdf(const MaterialX8& m, const vec3x8& wi, const vec3x8& wo, const vec3x8& n)
+{
+	const floatx8 p_microfacet = microfacetProbability(m, wo, n);
+	return fmadd(p_microfacet, blinnphong_pdf(m.shininess, wi, wo, n),
+	             (floatx8(1.0f) - p_microfacet) * diffuse_pdf(wi, wo, n));
+}
+
+vec3x8 material_sample_wi(const MaterialX8& m, vec3x8& wi, const vec3x8& wo, const vec3x8& n, floatx8& p, Rng8& rng)
+{
+	// Every lane picks its own lobe, so both are sampled and the choice is
+	// made with a blend.
+	const maskx8 sample_microfacet = rng.next() < microfacetProbability(m, wo, n);
+	const vec3x8 wi_diffuse = sampleAroundNormal(n, rng);
+	const vec3x8 wi_microfacet = blinnphong_sample_wi(m.shininess, wo, n, rng);
+	wi = select(sample_microfacet, wi_microfacet, wi_diffuse);
+	p = material_pdf(m, wi, wo, n);
+	return material_f(m, wi, wo, n);
+}
+///////////////////////////////////////////////////////////////////////////
+// Comparison of the kernels with the scalar BRDFs
+///////////////////////////////////////////////////////////////////////////
+namespace
+{
+struct Checker
+{
+	int failures = 0;
+	// Directions this close to the horizon may land on either side of it
+	// in the two implementations, so they are not compared
+	bool nearHorizon(const vec3& wi, const vec3& wo, const vec3& n) const
+	{
+		return std::abs(dot(wi, n)) < 1e-3f || std::abs(dot(wo, n)) < 1e-3f
+		       || std::abs(dot(normalize(wi + wo), wo)) < 1e-3f;
+	}
+	void compare(const char* what, int lane, float simd, float scalar)
+	{
+		const float tolerance = 2e-3f * std::max(1.0f, std::max(std::abs(simd), std::abs(scalar)));
+		if(std::abs(simd - scalar) <= tolerance)
+			return;
+		if(failures++ < 10)
+			std::cout << "SIMD check: " << what << " in lane " << lane << " is " << simd << ", scalar " << scalar
+			          << ".\n";
+	}
+	void compare(const char* what, int lane, const vec3& simd, const vec3& scalar)
+	{
+		for(int c = 0; c < 3; c++)
+			compare(what, lane, simd[c], scalar[c]);
+	}
+	void require(const char* what, int lane, bool ok)
+	{
+		if(!ok && failures++ < 10)
+			std::cout << "SIMD check: " << what << " fails in lane " << lane << ".\n";
+	}
+};
+
+// A scalar material tree, built as in tracePath()
+struct ScalarMaterial
+{
+	Diffuse diffuse;
+	BlinnPhong dielectric;
+	BlinnPhongMetal metal;
+	LinearBlend metal_blend;
+	LinearBlend reflectivity_blend;
+	ScalarMaterial(const labhelper::Material& m)
+	    : diffuse(m.m_color)
+	    , dielectric(m.m_shininess, m.m_fresnel, &diffuse)
+	    , metal(m.m_color, m.m_shininess, m.m_fresnel)
+	    , metal_blend(m.m_metalness, &metal, &dielectric)
+	    , reflectivity_blend(m.m_reflectivity, &metal_blend, &diffuse)
+	{
+	}
+};
+} // namespace
+
+bool checkAgainstScalar(int number_of_tests)
+{
+	std::mt19937 generator(1);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	auto randomDirection = [&]() {
+		const float z = 2.0f * uniform(generator) - 1.0f;
+		const float phi = 2.0f * float(M_PI) * uniform(generator);
+		const float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+		return vec3(r * std::cos(phi), r * std::sin(phi), z);
+	};
+
+	Checker check;
+	Rng8 rng;
+	rng.seed(1);
+	for(int test = 0; test < number_of_tests; test++)
+	{
+		///////////////////////////////////////////////////////////////////
+		// Eight random materials and configurations. wo is mostly above
+		// the surface, as it is for a hit, and wi anywhere.
+		///////////////////////////////////////////////////////////////////
+		labhelper::Material materials[width];
+		const labhelper::Material* material_pointers[width];
+		vec3 wi[width], wo[width], n[width];
+		for(int i = 0; i < width; i++)
+		{
+			labhelper::Material& m = materials[i];
+			m.m_color = vec3(uniform(generator), uniform(generator), uniform(generator));
+			m.m_reflectivity = uniform(generator);
+			m.m_metalness = uniform(generator);
+			m.m_fresnel = uniform(generator);
+			m.m_shininess = std::pow(2.0f, 12.0f * uniform(generator));
+			material_pointers[i] = &m;
+			n[i] = randomDirection();
+			wo[i] = randomDirection();
+			if(dot(wo[i], n[i]) < 0.0f && uniform(generator) < 0.9f)
+				wo[i] = -wo[i];
+			wi[i] = randomDirection();
+		}
+		MaterialX8 m8;
+		m8.load(material_pointers);
+		const vec3x8 wi8 = vec3x8::load(wi), wo8 = vec3x8::load(wo), n8 = vec3x8::load(n);
+		const floatx8 shininess = m8.shininess, R0 = m8.fresnel;
+
+		///////////////////////////////////////////////////////////////////
+		// Evaluation
+		///////////////////////////////////////////////////////////////////
+		const vec3x8 diffuse = diffuse_f(m8.color, wi8, wo8, n8);
+		const floatx8 diffuse_p = diffuse_pdf(wi8, wo8, n8);
+		const floatx8 reflection = blinnphong_reflection(shininess, R0, wi8, wo8, n8);
+		const floatx8 transmission = blinnphong_transmission(R0, wi8, wo8, n8);
+		const floatx8 microfacet_p = blinnphong_pdf(shininess, wi8, wo8, n8);
+		const vec3x8 f = material_f(m8, wi8, wo8, n8);
+		const floatx8 p = material_pdf(m8, wi8, wo8, n8);
+		for(int i = 0; i < width; i++)
+		{
+			if(check.nearHorizon(wi[i], wo[i], n[i]))
+				continue;
+			ScalarMaterial scalar(materials[i]);
+			check.compare("diffuse_f", i, diffuse.lane(i), scalar.diffuse.f(wi[i], wo[i], n[i]));
+			check.compare("diffuse_pdf", i, diffuse_p.lane(i), scalar.diffuse.pdf(wi[i], wo[i], n[i]));
+			check.compare("blinnphong_reflection", i, reflection.lane(i),
+			              scalar.dielectric.reflection_brdf(wi[i], wo[i], n[i]).x);
+			check.compare("blinnphong_transmission", i, transmission.lane(i) * diffuse.lane(i),
+			              scalar.dielectric.refraction_brdf(wi[i], wo[i], n[i]));
+			// The metal only samples its microfacet lobe
+			check.compare("blinnphong_pdf", i, microfacet_p.lane(i), scalar.metal.pdf(wi[i], wo[i], n[i]));
+			check.compare("material_f", i, f.lane(i), scalar.reflectivity_blend.f(wi[i], wo[i], n[i]));
+			check.compare("material_pdf", i, p.lane(i), scalar.reflectivity_blend.pdf(wi[i], wo[i], n[i]));
+		}
+
+		///////////////////////////////////////////////////////////////////
+		// Sampling. The random numbers differ from the scalar code, so
+		// check that the samples are directions and that the returned brdf
+		// and pdf are those of the scalar code in the sampled direction.
+		///////////////////////////////////////////////////////////////////
+		const vec3x8 hemisphere = cosineSampleHemisphere(rng);
+		vec3x8 sampled_diffuse_wi, sampled_wi;
+		floatx8 sampled_diffuse_p, sampled_p;
+		const vec3x8 sampled_diffuse_f = diffuse_sample_wi(m8.color, sampled_diffuse_wi, wo8, n8, sampled_diffuse_p, rng);
+		const vec3x8 sampled_f = material_sample_wi(m8, sampled_wi, wo8, n8, sampled_p, rng);
+		const vec3x8 sampled_wh = blinnphong_sample_wi(shininess, wo8, n8, rng);
+		for(int i = 0; i < width; i++)
+		{
+			const vec3 h = hemisphere.lane(i);
+			check.require("cosineSampleHemisphere", i, std::abs(length(h) - 1.0f) < 1e-3f && h.z >= 0.0f);
+			check.require("blinnphong_sample_wi", i, std::abs(length(sampled_wh.lane(i)) - 1.0f) < 1e-3f);
+			const vec3 dwi = sampled_diffuse_wi.lane(i);
+			check.require("diffuse_sample_wi", i, std::abs(length(dwi) - 1.0f) < 1e-3f && dot(dwi, n[i]) >= -1e-3f);
+			const vec3 swi = sampled_wi.lane(i);
+			check.require("material_sample_wi", i, std::abs(length(swi) - 1.0f) < 1e-3f);
+			ScalarMaterial scalar(materials[i]);
+			if(!check.nearHorizon(dwi, wo[i], n[i]))
+			{
+				check.compare("diffuse_sample_wi f", i, sampled_diffuse_f.lane(i), scalar.diffuse.f(dwi, wo[i], n[i]));
+				check.compare("diffuse_sample_wi pdf", i, sampled_diffuse_p.lane(i), scalar.diffuse.pdf(dwi, wo[i], n[i]));
+			}
+			if(!check.nearHorizon(swi, wo[i], n[i]))
+			{
+				check.compare("material_sample_wi f", i, sampled_f.lane(i), scalar.reflectivity_blend.f(swi, wo[i], n[i]));
+				check.compare("material_sample_wi pdf", i, sampled_p.lane(i),
+				              scalar.reflectivity_blend.pdf(swi, wo[i], n[i]));
+			}
+		}
+	}
+	if(check.failures > 0)
+	{
+		std::cout << "SIMD check: " << check.failures << " mismatches in " << number_of_tests * width << " lanes.\n";
+		return false;
+	}
+	std::cout << "SIMD check: " << number_of_tests * width << " lanes match the scalar BRDFs.\n";
+	return true;
+}
+} // namespace simd
+} // namespace pathtracer
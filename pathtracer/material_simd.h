@@ -0,0 +1,73 @@
+#pragma once
+#include <Model.h>
+#include "simd.h"
+
+namespace pathtracer
+{
+namespace simd
+{
+///////////////////////////////////////////////////////////////////////////
+// 8-wide versions of the BRDFs in material.h. Each lane may belong to a
+// different material, so instead of a tree of BRDF objects the
+// parameters of the whole material tree used by the integrator
+//
+//   reflectivity * (metalness * BlinnPhongMetal
+//                   + (1 - metalness) * BlinnPhong(over Diffuse))
+//   + (1 - reflectivity) * Diffuse
+//
+// are stored per lane. Lanes with invalid data (e.g. rays that missed)
+// should be masked off by the caller.
+///////////////////////////////////////////////////////////////////////////
+struct MaterialX8
+{
+	vec3x8 color;
+	floatx8 reflectivity;
+	floatx8 metalness;
+	floatx8 fresnel;
+	floatx8 shininess;
+	// Gather the parameters of eight (possibly different) materials
+	void load(const labhelper::Material* const materials[width]);
+};
+
+///////////////////////////////////////////////////////////////////////////
+// A Lambertian (diffuse) material
+///////////////////////////////////////////////////////////////////////////
+vec3x8 diffuse_f(const vec3x8& color, const vec3x8& wi, const vec3x8& wo, const vec3x8& n);
+floatx8 diffuse_pdf(const vec3x8& wi, const vec3x8& wo, const vec3x8& n);
+vec3x8 diffuse_sample_wi(const vec3x8& color, vec3x8& wi, const vec3x8& wo, const vec3x8& n, floatx8& p, Rng8& rng);
+
+///////////////////////////////////////////////////////////////////////////
+// The (uncolored) reflection and transmission terms of the Blinn Phong
+// dielectric microfacet BRDF. The transmission term is the factor that
+// the refraction layer is scaled with.
+///////////////////////////////////////////////////////////////////////////
+floatx8 blinnphong_reflection(const floatx8& shininess,
+                              const floatx8& R0,
+                              const vec3x8& wi,
+                              const vec3x8& wo,
+                              const vec3x8& n);
+floatx8 blinnphong_transmission(const floatx8& R0, const vec3x8& wi, const vec3x8& wo, const vec3x8& n);
+
+///////////////////////////////////////////////////////////////////////////
+// Sampling of the Blinn distribution of half vectors. Returns wo
+// reflected around the sampled half vector; blinnphong_pdf() gives the
+// resulting pdf of wi.
+///////////////////////////////////////////////////////////////////////////
+vec3x8 blinnphong_sample_wi(const floatx8& shininess, const vec3x8& wo, const vec3x8& n, Rng8& rng);
+floatx8 blinnphong_pdf(const floatx8& shininess, const vec3x8& wi, const vec3x8& wo, const vec3x8& n);
+
+///////////////////////////////////////////////////////////////////////////
+// The complete material tree
+///////////////////////////////////////////////////////////////////////////
+vec3x8 material_f(const MaterialX8& m, const vec3x8& wi, const vec3x8& wo, const vec3x8& n);
+floatx8 material_pdf(const MaterialX8& m, const vec3x8& wi, const vec3x8& wo, const vec3x8& n);
+vec3x8 material_sample_wi(const MaterialX8& m, vec3x8& wi, const vec3x8& wo, const vec3x8& n, floatx8& p, Rng8& rng);
+
+///////////////////////////////////////////////////////////////////////////
+// Compare every kernel above, lane by lane, with the scalar BRDFs of
+// material.h, on number_of_tests x 8 random materials and directions.
+// Prints the first mismatches and returns false if there were any.
+///////////////////////////////////////////////////////////////////////////
+bool checkAgainstScalar(int number_of_tests);
+} // namespace simd
+} // namespace pathtracer
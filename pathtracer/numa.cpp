@@ -0,0 +1,150 @@
+#include "numa.h"
+#include "sampling.h"
+#include <omp.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace pathtracer
+{
+namespace numa
+{
+///////////////////////////////////////////////////////////////////////////
+// Global variables
+///////////////////////////////////////////////////////////////////////////
+bool replicate_scene = false;
+static bool is_enabled = false;
+static vector<vector<int>> node_cpus;
+static vector<int> thread_node(maxThreads(), 0);
+
+bool enabled()
+{
+	return is_enabled;
+}
+
+int numberOfNodes()
+{
+	return is_enabled ? int(node_cpus.size()) : 1;
+}
+
+int threadNode()
+{
+	return nodeOfThread(omp_get_thread_num());
+}
+
+int nodeOfThread(int thread)
+{
+	return is_enabled ? thread_node[thread] : 0;
+}
+
+#ifdef __linux__
+///////////////////////////////////////////////////////////////////////////
+// Parse a sysfs cpu list, like "0-7,16-23"
+///////////////////////////////////////////////////////////////////////////
+static vector<int> parseCpuList(const string& list)
+{
+	vector<int> cpus;
+	stringstream ss(list);
+	string range;
+	while(getline(ss, range, ','))
+	{
+		int first, last;
+		if(sscanf(range.c_str(), "%d-%d", &first, &last) == 2)
+		{
+			for(int cpu = first; cpu <= last; cpu++)
+				cpus.push_back(cpu);
+		}
+		else if(sscanf(range.c_str(), "%d", &first) == 1)
+		{
+			cpus.push_back(first);
+		}
+	}
+	return cpus;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+// Detect the nodes and pin the OpenMP threads
+///////////////////////////////////////////////////////////////////////////
+bool initialize()
+{
+#ifdef __linux__
+	node_cpus.clear();
+	for(int node = 0;; node++)
+	{
+		ifstream file("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+		if(!file.is_open())
+			break;
+		string list;
+		getline(file, list);
+		vector<int> cpus = parseCpuList(list);
+		// Nodes without CPUs (memory only) get no threads
+		if(!cpus.empty())
+			node_cpus.push_back(cpus);
+	}
+	if(node_cpus.empty())
+	{
+		cout << "NUMA: no nodes found, running as a single node.\n";
+		return false;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Give each node a contiguous block of threads, so that a static
+	// schedule hands each node a contiguous part of every buffer. The
+	// OpenMP runtime keeps its threads, so they stay pinned.
+	///////////////////////////////////////////////////////////////////////
+	const int number_of_nodes = int(node_cpus.size());
+#pragma omp parallel
+	{
+		const int thread = omp_get_thread_num();
+		const int threads = omp_get_num_threads();
+		const int node = thread * number_of_nodes / threads;
+		const int first_thread = (node * threads + number_of_nodes - 1) / number_of_nodes;
+		const vector<int>& cpus = node_cpus[node];
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpus[(thread - first_thread) % cpus.size()], &set);
+		if(sched_setaffinity(0, sizeof(set), &set) != 0)
+		{
+			// Not allowed to use that CPU; stay on the node at least
+			CPU_ZERO(&set);
+			for(int cpu : cpus)
+				CPU_SET(cpu, &set);
+			sched_setaffinity(0, sizeof(set), &set);
+		}
+		thread_node[thread] = node;
+	}
+	is_enabled = true;
+	cout << "NUMA: pinned " << omp_get_max_threads() << " threads to " << number_of_nodes << " nodes.\n";
+	return true;
+#else
+	cout << "NUMA: thread pinning is not supported on this platform.\n";
+	return false;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Touch one byte per page with a static schedule
+///////////////////////////////////////////////////////////////////////////
+void firstTouch(void* data, size_t bytes)
+{
+	const size_t page_size = 4096;
+	char* p = static_cast<char*>(data);
+	const long pages = long((bytes + page_size - 1) / page_size);
+#pragma omp parallel for schedule(static)
+	for(long i = 0; i < pages; i++)
+	{
+		p[i * page_size] = 0;
+	}
+}
+} // namespace numa
+} // namespace pathtracer
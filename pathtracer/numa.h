@@ -0,0 +1,84 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////
+// NUMA awareness for multi-socket machines. When enabled, every OpenMP
+// thread is pinned to the CPUs of one NUMA node (threads are assigned to
+// nodes in contiguous blocks, matching the static schedule used when
+// tracing), and buffers allocated with FirstTouchAllocator are touched
+// first by the threads that will later write them. Without it, all
+// memory ends up on the node of the main thread.
+///////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+namespace numa
+{
+///////////////////////////////////////////////////////////////////////////
+// Detect the NUMA nodes and pin the OpenMP threads. Call before any
+// scene or image data is allocated. Returns false if the platform does
+// not support it (everything then behaves as a single node).
+///////////////////////////////////////////////////////////////////////////
+bool initialize();
+bool enabled();
+
+///////////////////////////////////////////////////////////////////////////
+// The number of nodes, and the node the calling OpenMP thread runs on
+///////////////////////////////////////////////////////////////////////////
+int numberOfNodes();
+int threadNode();
+int nodeOfThread(int thread);
+
+///////////////////////////////////////////////////////////////////////////
+// Whether read-only scene data should be replicated on every node
+///////////////////////////////////////////////////////////////////////////
+extern bool replicate_scene;
+
+///////////////////////////////////////////////////////////////////////////
+// Touch the pages of a buffer in parallel, with the same static schedule
+// as the tracing loops, so that each page is placed on the node of the
+// thread that works on it.
+///////////////////////////////////////////////////////////////////////////
+void firstTouch(void* data, size_t bytes);
+
+///////////////////////////////////////////////////////////////////////////
+// An allocator that places large buffers with firstTouch()
+///////////////////////////////////////////////////////////////////////////
+template<typename T>
+struct FirstTouchAllocator
+{
+	typedef T value_type;
+	FirstTouchAllocator()
+	{
+	}
+	template<typename U>
+	FirstTouchAllocator(const FirstTouchAllocator<U>&)
+	{
+	}
+	T* allocate(size_t n)
+	{
+		T* p = static_cast<T*>(::operator new(n * sizeof(T)));
+		if(enabled())
+		{
+			firstTouch(p, n * sizeof(T));
+		}
+		return p;
+	}
+	void deallocate(T* p, size_t)
+	{
+		::operator delete(p);
+	}
+};
+template<typename T, typename U>
+bool operator==(const FirstTouchAllocator<T>&, const FirstTouchAllocator<U>&)
+{
+	return true;
+}
+template<typename T, typename U>
+bool operator!=(const FirstTouchAllocator<T>&, const FirstTouchAllocator<U>&)
+{
+	return false;
+}
+} // namespace numa
+} // namespace pathtracer
@@ -2,7 +2,10 @@
 #include <random>
 #include "labhelper.h"
 #include <omp.h>
+#include <algorithm>
 #include <iostream>
+#include <sstream>
+#include <vector>
 #include <glm/glm.hpp>
 
 using namespace glm;
@@ -13,12 +16,53 @@ namespace pathtracer
 // Get a random float. Note that we need one "generator" per thread, or we
 // would need to lock everytime someone called randf().
 ///////////////////////////////////////////////////////////////////////////////
-std::mt19937 generators[24]; // Assuming no more than 24 cores
+int maxThreads()
+{
+	static const int max_threads = std::max(1, omp_get_max_threads());
+	return max_threads;
+}
+
+static std::vector<std::mt19937> generators(maxThreads());
 float randf()
 {
 	return float(generators[omp_get_thread_num()]() / double(generators[omp_get_thread_num()].max()));
 }
 
+void seedRandom(uint32_t seed)
+{
+	for(size_t i = 0; i < generators.size(); i++)
+	{
+		std::seed_seq sequence = { seed, uint32_t(i) };
+		generators[i].seed(sequence);
+	}
+}
+
+std::string saveRandomState()
+{
+	std::ostringstream out;
+	for(const std::mt19937& generator : generators)
+	{
+		out << generator << "\n";
+	}
+	return out.str();
+}
+
+bool loadRandomState(const std::string& state)
+{
+	// Only states saved with as many threads can be restored
+	std::istringstream in(state);
+	std::vector<std::mt19937> loaded;
+	std::mt19937 generator;
+	while(in >> generator)
+	{
+		loaded.push_back(generator);
+	}
+	if(loaded.size() != generators.size())
+		return false;
+	generators = loaded;
+	return true;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Generate uniform points on a disc
 ///////////////////////////////////////////////////////////////////////////
@@ -1,5 +1,9 @@
 #pragma once
 #include <glm/glm.hpp>
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <string>
 
 namespace pathtracer
 {
@@ -8,6 +12,61 @@ namespace pathtracer
 ///////////////////////////////////////////////////////////////////////////
 float randf();
 ///////////////////////////////////////////////////////////////////////////
+// The number of OpenMP threads that per thread state (random generators,
+// statistics and traversal counters) is made for: omp_get_max_threads()
+// the first time it is asked. Nothing may start more threads than this.
+///////////////////////////////////////////////////////////////////////////
+int maxThreads();
+///////////////////////////////////////////////////////////////////////////
+// Allocator for per thread state declared alignas(cache_line_size), so
+// that no two threads write to the same cache line. C++11 new only
+// aligns to alignof(max_align_t), so the block is over-allocated and the
+// pointer to free is kept just in front of the aligned storage.
+///////////////////////////////////////////////////////////////////////////
+const size_t cache_line_size = 64;
+template<typename T>
+struct CacheLineAllocator
+{
+	typedef T value_type;
+	CacheLineAllocator() {}
+	template<typename U>
+	CacheLineAllocator(const CacheLineAllocator<U>&)
+	{
+	}
+	T* allocate(size_t n)
+	{
+		char* block = static_cast<char*>(::operator new(n * sizeof(T) + sizeof(void*) + cache_line_size - 1));
+		uintptr_t aligned = (uintptr_t(block) + sizeof(void*) + cache_line_size - 1) & ~uintptr_t(cache_line_size - 1);
+		reinterpret_cast<void**>(aligned)[-1] = block;
+		return reinterpret_cast<T*>(aligned);
+	}
+	void deallocate(T* p, size_t)
+	{
+		::operator delete(reinterpret_cast<void**>(p)[-1]);
+	}
+};
+template<typename T, typename U>
+bool operator==(const CacheLineAllocator<T>&, const CacheLineAllocator<U>&)
+{
+	return true;
+}
+template<typename T, typename U>
+bool operator!=(const CacheLineAllocator<T>&, const CacheLineAllocator<U>&)
+{
+	return false;
+}
+///////////////////////////////////////////////////////////////////////////
+// Reseed the generators of all threads. Processes that render parts of
+// the same image must use different seeds.
+///////////////////////////////////////////////////////////////////////////
+void seedRandom(uint32_t seed);
+///////////////////////////////////////////////////////////////////////////
+// Save and restore the state of the generators of all threads. Restoring
+// fails unless the state was saved with as many threads.
+///////////////////////////////////////////////////////////////////////////
+std::string saveRandomState();
+bool loadRandomState(const std::string& state);
+///////////////////////////////////////////////////////////////////////////
 // Generate uniform points on a disc
 ///////////////////////////////////////////////////////////////////////////
 void concentricSampleDisk(float* dx, float* dy);
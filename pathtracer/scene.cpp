@@ -0,0 +1,78 @@
+#include "scene.h"
+#include "embree.h"
+#include "guiding.h"
+#include "irradiance_cache.h"
+#include <AssetLoader.h>
+#include <cfloat>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+vector<pair<labhelper::Model*, mat4>> loadScene(const SceneDescription& scene, bool upload_to_gpu)
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Set up light
+	///////////////////////////////////////////////////////////////////////////
+	point_light = scene.point_light;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Load the environment map and .obj models all at once
+	///////////////////////////////////////////////////////////////////////////
+	labhelper::AssetLoader loader;
+	shared_future<labhelper::HdrImage> environment_map = loader.loadHdrImage(scene.environment_map);
+	vector<shared_future<labhelper::Model*>> loaded_models;
+	for(const auto& instance : scene.models)
+	{
+		loaded_models.push_back(loader.loadModel(instance.filename, upload_to_gpu));
+	}
+	loader.finish();
+
+	const labhelper::HdrImage& map = environment_map.get();
+	if(environment.map.data != nullptr)
+		stbi_image_free(environment.map.data);
+	environment.map.width = map.width;
+	environment.map.height = map.height;
+	environment.map.components = 3;
+	environment.map.data = map.data;
+	environment.multiplier = scene.environment_multiplier;
+	initEnvironmentSampling();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Add the models to the pathtracer scene
+	///////////////////////////////////////////////////////////////////////////
+	vector<pair<labhelper::Model*, mat4>> models;
+	for(size_t i = 0; i < scene.models.size(); i++)
+	{
+		models.push_back(make_pair(loaded_models[i].get(), scene.models[i].model_matrix));
+	}
+	vec3 scene_min(FLT_MAX), scene_max(-FLT_MAX);
+	for(auto m : models)
+	{
+		addModel(m.first, m.second);
+		addAreaLights(m.first, m.second);
+		for(const vec3& p : m.first->m_positions)
+		{
+			const vec3 world = vec3(m.second * vec4(p, 1.0f));
+			scene_min = min(scene_min, world);
+			scene_max = max(scene_max, world);
+		}
+		// Intersections read the compressed copies made by addModel(). The
+		// GUI keeps the full arrays, which saveModelToOBJ() writes, but the
+		// headless modes never save models.
+		if(!upload_to_gpu)
+		{
+			vector<vec3>().swap(m.first->m_normals);
+			vector<vec2>().swap(m.first->m_texture_coordinates);
+		}
+	}
+	buildBVH();
+	if(!models.empty())
+	{
+		guiding::setSceneBounds(scene_min, scene_max);
+		irradiance_cache::setSceneBounds(scene_min, scene_max);
+	}
+	return models;
+}
+} // namespace pathtracer
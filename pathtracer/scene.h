@@ -0,0 +1,35 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include <Model.h>
+#include "Pathtracer.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Everything needed to set up a pathtracer scene, in a form that can be
+// shipped to other processes.
+///////////////////////////////////////////////////////////////////////////
+struct SceneDescription
+{
+	struct ModelInstance
+	{
+		std::string filename;
+		mat4 model_matrix;
+	};
+	std::vector<ModelInstance> models;
+	std::string environment_map;
+	float environment_multiplier = 1.0f;
+	PointLight point_light;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Set up the light and environment of a scene, load all its models, add
+// them to the embree scene and build the BVH. Returns the loaded models
+// together with their model matrices. Without upload_to_gpu (the headless
+// modes) the normals and texture coordinates of the models are freed, as
+// only the compressed copies in the ray tracing scene are used.
+///////////////////////////////////////////////////////////////////////////
+std::vector<std::pair<labhelper::Model*, mat4>> loadScene(const SceneDescription& scene, bool upload_to_gpu);
+} // namespace pathtracer
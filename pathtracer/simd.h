@@ -0,0 +1,385 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <stdint.h>
+
+#if !defined(__AVX2__)
+#error "simd.h requires AVX2 and FMA (configure the pathtracer with PATHTRACER_AVX2=ON)"
+#endif
+#include <immintrin.h>
+
+namespace pathtracer
+{
+namespace simd
+{
+///////////////////////////////////////////////////////////////////////////
+// Number of lanes in all the 8-wide types below
+///////////////////////////////////////////////////////////////////////////
+const int width = 8;
+
+///////////////////////////////////////////////////////////////////////////
+// A per-lane boolean, as produced by the comparison operators. All bits
+// of a lane are set if the lane is true.
+///////////////////////////////////////////////////////////////////////////
+struct maskx8
+{
+	__m256 v;
+	maskx8()
+	{
+	}
+	maskx8(__m256 _v) : v(_v)
+	{
+	}
+};
+
+inline maskx8 operator&(const maskx8& a, const maskx8& b)
+{
+	return _mm256_and_ps(a.v, b.v);
+}
+inline maskx8 operator|(const maskx8& a, const maskx8& b)
+{
+	return _mm256_or_ps(a.v, b.v);
+}
+inline maskx8 operator!(const maskx8& a)
+{
+	return _mm256_xor_ps(a.v, _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+}
+inline bool any(const maskx8& a)
+{
+	return _mm256_movemask_ps(a.v) != 0;
+}
+inline bool all(const maskx8& a)
+{
+	return _mm256_movemask_ps(a.v) == 0xFF;
+}
+// One bit per lane, lane 0 in the lowest bit
+inline int bits(const maskx8& a)
+{
+	return _mm256_movemask_ps(a.v);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Eight floats, one per lane
+///////////////////////////////////////////////////////////////////////////
+struct floatx8
+{
+	__m256 v;
+	floatx8()
+	{
+	}
+	floatx8(__m256 _v) : v(_v)
+	{
+	}
+	floatx8(float s) : v(_mm256_set1_ps(s))
+	{
+	}
+	static floatx8 load(const float* p)
+	{
+		return _mm256_loadu_ps(p);
+	}
+	void store(float* p) const
+	{
+		_mm256_storeu_ps(p, v);
+	}
+	float lane(int i) const
+	{
+		alignas(32) float tmp[width];
+		_mm256_store_ps(tmp, v);
+		return tmp[i];
+	}
+};
+
+inline floatx8 operator+(const floatx8& a, const floatx8& b)
+{
+	return _mm256_add_ps(a.v, b.v);
+}
+inline floatx8 operator-(const floatx8& a, const floatx8& b)
+{
+	return _mm256_sub_ps(a.v, b.v);
+}
+inline floatx8 operator*(const floatx8& a, const floatx8& b)
+{
+	return _mm256_mul_ps(a.v, b.v);
+}
+inline floatx8 operator/(const floatx8& a, const floatx8& b)
+{
+	return _mm256_div_ps(a.v, b.v);
+}
+inline floatx8 operator-(const floatx8& a)
+{
+	return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f));
+}
+inline maskx8 operator<(const floatx8& a, const floatx8& b)
+{
+	return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ);
+}
+inline maskx8 operator<=(const floatx8& a, const floatx8& b)
+{
+	return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ);
+}
+inline maskx8 operator>(const floatx8& a, const floatx8& b)
+{
+	return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ);
+}
+inline maskx8 operator>=(const floatx8& a, const floatx8& b)
+{
+	return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ);
+}
+// a * b + c, in a single rounding
+inline floatx8 fmadd(const floatx8& a, const floatx8& b, const floatx8& c)
+{
+	return _mm256_fmadd_ps(a.v, b.v, c.v);
+}
+inline floatx8 min(const floatx8& a, const floatx8& b)
+{
+	return _mm256_min_ps(a.v, b.v);
+}
+inline floatx8 max(const floatx8& a, const floatx8& b)
+{
+	return _mm256_max_ps(a.v, b.v);
+}
+inline floatx8 sqrt(const floatx8& a)
+{
+	return _mm256_sqrt_ps(a.v);
+}
+inline floatx8 abs(const floatx8& a)
+{
+	return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v);
+}
+inline floatx8 floor(const floatx8& a)
+{
+	return _mm256_floor_ps(a.v);
+}
+// Returns a where mask is set, b elsewhere
+inline floatx8 select(const maskx8& mask, const floatx8& a, const floatx8& b)
+{
+	return _mm256_blendv_ps(b.v, a.v, mask.v);
+}
+// The magnitude of a with the sign of b
+inline floatx8 copysign(const floatx8& a, const floatx8& b)
+{
+	const __m256 sign_bit = _mm256_set1_ps(-0.0f);
+	return _mm256_or_ps(_mm256_andnot_ps(sign_bit, a.v), _mm256_and_ps(sign_bit, b.v));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Natural logarithm, for x > 0 (Cephes polynomial, ~1 ulp in [1e-30, 1e30])
+///////////////////////////////////////////////////////////////////////////
+inline floatx8 log(const floatx8& x)
+{
+	// Split x into a mantissa m in [0.5, 1) and an exponent e
+	__m256i xi = _mm256_castps_si256(max(x, floatx8(1.17549435e-38f)).v);
+	__m256i ei = _mm256_sub_epi32(_mm256_srli_epi32(xi, 23), _mm256_set1_epi32(126));
+	floatx8 m = _mm256_castsi256_ps(
+	    _mm256_or_si256(_mm256_and_si256(xi, _mm256_set1_epi32(0x007FFFFF)), _mm256_set1_epi32(0x3F000000)));
+	floatx8 e = _mm256_cvtepi32_ps(ei);
+	// Move m into [sqrt(0.5), sqrt(2)) to keep the polynomial accurate
+	maskx8 small = m < floatx8(0.707106781186547524f);
+	e = e - select(small, floatx8(1.0f), floatx8(0.0f));
+	m = m + select(small, m, floatx8(0.0f)) - floatx8(1.0f);
+	floatx8 z = m * m;
+	floatx8 y = 7.0376836292e-2f;
+	y = fmadd(y, m, -1.1514610310e-1f);
+	y = fmadd(y, m, 1.1676998740e-1f);
+	y = fmadd(y, m, -1.2420140846e-1f);
+	y = fmadd(y, m, 1.4249322787e-1f);
+	y = fmadd(y, m, -1.6668057665e-1f);
+	y = fmadd(y, m, 2.0000714765e-1f);
+	y = fmadd(y, m, -2.4999993993e-1f);
+	y = fmadd(y, m, 3.3333331174e-1f);
+	y = y * m * z;
+	y = fmadd(e, floatx8(-2.12194440e-4f), y);
+	y = fmadd(z, floatx8(-0.5f), y);
+	return fmadd(e, floatx8(0.693359375f), m + y);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Exponential function (Cephes polynomial), clamped to the float range
+///////////////////////////////////////////////////////////////////////////
+inline floatx8 exp(const floatx8& _x)
+{
+	floatx8 x = min(max(_x, floatx8(-87.3365447f)), floatx8(88.3762626f));
+	// exp(x) = 2^n * exp(r), with r = x - n * ln(2)
+	floatx8 n = floor(fmadd(x, floatx8(1.44269504088896341f), floatx8(0.5f)));
+	x = fmadd(n, floatx8(-0.693359375f), x);
+	x = fmadd(n, floatx8(2.12194440e-4f), x);
+	floatx8 z = x * x;
+	floatx8 y = 1.9875691500e-4f;
+	y = fmadd(y, x, 1.3981999507e-3f);
+	y = fmadd(y, x, 8.3334519073e-3f);
+	y = fmadd(y, x, 4.1665795894e-2f);
+	y = fmadd(y, x, 1.6666665459e-1f);
+	y = fmadd(y, x, 5.0000001201e-1f);
+	y = fmadd(y, z, x + floatx8(1.0f));
+	__m256i pow2n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n.v), _mm256_set1_epi32(127)), 23);
+	return y * floatx8(_mm256_castsi256_ps(pow2n));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// x^y for x >= 0. Returns 0 where x == 0.
+///////////////////////////////////////////////////////////////////////////
+inline floatx8 pow(const floatx8& x, const floatx8& y)
+{
+	return select(x > floatx8(0.0f), exp(y * log(x)), floatx8(0.0f));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Sine and cosine, only valid for |x| <= pi/4 (Cephes polynomials)
+///////////////////////////////////////////////////////////////////////////
+inline void sincos_pi4(const floatx8& x, floatx8& s, floatx8& c)
+{
+	floatx8 z = x * x;
+	floatx8 ps = -1.9515295891e-4f;
+	ps = fmadd(ps, z, 8.3321608736e-3f);
+	ps = fmadd(ps, z, -1.6666654611e-1f);
+	s = fmadd(ps * z, x, x);
+	floatx8 pc = 2.443315711809948e-5f;
+	pc = fmadd(pc, z, -1.388731625493765e-3f);
+	pc = fmadd(pc, z, 4.166664568298827e-2f);
+	c = fmadd(pc * z, z, fmadd(z, floatx8(-0.5f), floatx8(1.0f)));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Eight vec3s in structure-of-arrays layout
+///////////////////////////////////////////////////////////////////////////
+struct vec3x8
+{
+	floatx8 x, y, z;
+	vec3x8()
+	{
+	}
+	vec3x8(const floatx8& _x, const floatx8& _y, const floatx8& _z) : x(_x), y(_y), z(_z)
+	{
+	}
+	vec3x8(const glm::vec3& v) : x(v.x), y(v.y), z(v.z)
+	{
+	}
+	// Transpose eight consecutive vec3s into SoA layout
+	static vec3x8 load(const glm::vec3* p)
+	{
+		alignas(32) float tx[width], ty[width], tz[width];
+		for(int i = 0; i < width; i++)
+		{
+			tx[i] = p[i].x;
+			ty[i] = p[i].y;
+			tz[i] = p[i].z;
+		}
+		return vec3x8(_mm256_load_ps(tx), _mm256_load_ps(ty), _mm256_load_ps(tz));
+	}
+	void store(glm::vec3* p) const
+	{
+		alignas(32) float tx[width], ty[width], tz[width];
+		_mm256_store_ps(tx, x.v);
+		_mm256_store_ps(ty, y.v);
+		_mm256_store_ps(tz, z.v);
+		for(int i = 0; i < width; i++)
+		{
+			p[i] = glm::vec3(tx[i], ty[i], tz[i]);
+		}
+	}
+	glm::vec3 lane(int i) const
+	{
+		return glm::vec3(x.lane(i), y.lane(i), z.lane(i));
+	}
+};
+
+inline vec3x8 operator+(const vec3x8& a, const vec3x8& b)
+{
+	return vec3x8(a.x + b.x, a.y + b.y, a.z + b.z);
+}
+inline vec3x8 operator-(const vec3x8& a, const vec3x8& b)
+{
+	return vec3x8(a.x - b.x, a.y - b.y, a.z - b.z);
+}
+inline vec3x8 operator-(const vec3x8& a)
+{
+	return vec3x8(-a.x, -a.y, -a.z);
+}
+inline vec3x8 operator*(const vec3x8& a, const vec3x8& b)
+{
+	return vec3x8(a.x * b.x, a.y * b.y, a.z * b.z);
+}
+inline vec3x8 operator*(const floatx8& s, const vec3x8& a)
+{
+	return vec3x8(s * a.x, s * a.y, s * a.z);
+}
+inline vec3x8 operator*(const vec3x8& a, const floatx8& s)
+{
+	return s * a;
+}
+inline floatx8 dot(const vec3x8& a, const vec3x8& b)
+{
+	return fmadd(a.x, b.x, fmadd(a.y, b.y, a.z * b.z));
+}
+inline vec3x8 cross(const vec3x8& a, const vec3x8& b)
+{
+	return vec3x8(fmadd(a.y, b.z, -(a.z * b.y)), fmadd(a.z, b.x, -(a.x * b.z)), fmadd(a.x, b.y, -(a.y * b.x)));
+}
+inline vec3x8 normalize(const vec3x8& a)
+{
+	return (floatx8(1.0f) / sqrt(dot(a, a))) * a;
+}
+inline vec3x8 select(const maskx8& mask, const vec3x8& a, const vec3x8& b)
+{
+	return vec3x8(select(mask, a.x, b.x), select(mask, a.y, b.y), select(mask, a.z, b.z));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Build an orthonormal basis (tangent, bitangent, n) around unit vectors
+// n without any normalization or branching (Duff et al. 2017).
+///////////////////////////////////////////////////////////////////////////
+inline void tangentFrame(const vec3x8& n, vec3x8& tangent, vec3x8& bitangent)
+{
+	const floatx8 sign = copysign(floatx8(1.0f), n.z);
+	const floatx8 a = floatx8(-1.0f) / (sign + n.z);
+	const floatx8 b = n.x * n.y * a;
+	tangent = vec3x8(fmadd(sign * n.x * n.x, a, floatx8(1.0f)), sign * b, -(sign * n.x));
+	bitangent = vec3x8(b, fmadd(n.y * n.y, a, sign), -n.y);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Eight independent xorshift32 generators, one per lane. As with randf(),
+// use one Rng8 per thread (see rng8()). The state is kept as plain
+// integers, so that generators can live in std::vector (which does not
+// align to 32 bytes before C++17).
+///////////////////////////////////////////////////////////////////////////
+struct Rng8
+{
+	uint32_t lanes[width];
+	void seed(uint32_t s)
+	{
+		for(int i = 0; i < width; i++)
+		{
+			// splitmix32 so that neighbouring seeds give unrelated streams
+			uint32_t z = (s += 0x9E3779B9u);
+			z = (z ^ (z >> 16)) * 0x85EBCA6Bu;
+			z = (z ^ (z >> 13)) * 0xC2B2AE35u;
+			z = z ^ (z >> 16);
+			lanes[i] = z != 0 ? z : 0x6D2B79F5u;
+		}
+	}
+	// Uniform floats in [0, 1)
+	floatx8 next()
+	{
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lanes));
+		x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+		x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+		x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), x);
+		__m256i mantissa = _mm256_or_si256(_mm256_srli_epi32(x, 9), _mm256_set1_epi32(0x3F800000));
+		return floatx8(_mm256_castsi256_ps(mantissa)) - floatx8(1.0f);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The calling thread's 8-wide random number generator
+///////////////////////////////////////////////////////////////////////////
+Rng8& rng8();
+
+///////////////////////////////////////////////////////////////////////////
+// Generate uniform points on a disc, and cosine distributed directions
+// on the hemisphere around +z, for all lanes.
+///////////////////////////////////////////////////////////////////////////
+void concentricSampleDisk(Rng8& rng, floatx8& dx, floatx8& dy);
+vec3x8 cosineSampleHemisphere(Rng8& rng);
+} // namespace simd
+} // namespace pathtracer
@@ -5,9 +5,24 @@ precision highp float;
 
 layout(location = 0) out vec4 fragmentColor;
 layout(binding = 0) uniform sampler2D image;
+// Optional per pixel cost, shown in false colour over the image
+layout(binding = 1) uniform sampler2D heatmap;
+uniform float heatmap_opacity = 0.0;
+uniform float heatmap_scale = 1.0;
 in vec2 texCoord;
 
+// Blue for cheap, through cyan, green and yellow, to red for expensive
+vec3 falseColour(float t)
+{
+	return clamp(vec3(1.5 - abs(4.0 * t - 3.0), 1.5 - abs(4.0 * t - 2.0), 1.5 - abs(4.0 * t - 1.0)), 0.0, 1.0);
+}
+
 void main()
 {
 	fragmentColor = texture(image, texCoord);
+	if(heatmap_opacity > 0.0)
+	{
+		float cost = clamp(texture(heatmap, texCoord).r * heatmap_scale, 0.0, 1.0);
+		fragmentColor.rgb = mix(fragmentColor.rgb, falseColour(cost), heatmap_opacity);
+	}
 }
@@ -0,0 +1,193 @@
+#include "statistics.h"
+#include "sampling.h"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+namespace pathtracer
+{
+namespace statistics
+{
+Options options;
+std::vector<Counters, CacheLineAllocator<Counters>> thread_counters(maxThreads());
+
+static Summary total_summary;
+static Summary last_pass_summary;
+
+///////////////////////////////////////////////////////////////////////////
+// What is kept of every pass for saving
+///////////////////////////////////////////////////////////////////////////
+struct PassRecord
+{
+	uint64_t pixel_samples;
+	double seconds;
+	uint64_t rays[NumberOfRayTypes];
+	uint64_t cached_primary_hits;
+	double intersection_seconds;
+	double shading_seconds;
+};
+static vector<PassRecord> passes;
+
+uint64_t now()
+{
+	return uint64_t(
+	    chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+uint64_t Summary::totalRays() const
+{
+	uint64_t sum = 0;
+	for(int i = 0; i < NumberOfRayTypes; i++)
+		sum += rays[i];
+	return sum;
+}
+
+double Summary::raysPerSecond() const
+{
+	return seconds > 0.0 ? double(totalRays()) / seconds : 0.0;
+}
+
+float Summary::averagePathLength() const
+{
+	uint64_t hits = 0;
+	for(int i = 0; i <= max_path_length; i++)
+		hits += uint64_t(i) * path_length[i];
+	return paths > 0 ? float(double(hits) / double(paths)) : 0.0f;
+}
+
+void discardPass()
+{
+	for(Counters& c : thread_counters)
+		c = Counters();
+}
+
+void endPass(uint64_t pixel_samples, double seconds)
+{
+	Summary pass;
+	pass.passes = 1;
+	pass.pixel_samples = pixel_samples;
+	pass.seconds = seconds;
+	uint64_t intersection_ns = 0, path_ns = 0;
+	for(Counters& c : thread_counters)
+	{
+		for(int i = 0; i < NumberOfRayTypes; i++)
+			pass.rays[i] += c.rays[i];
+		pass.cached_primary_hits += c.cached_primary_hits;
+		pass.paths += c.paths;
+		for(int i = 0; i <= max_path_length; i++)
+			pass.path_length[i] += c.path_length[i];
+		intersection_ns += c.intersection_ns;
+		path_ns += c.path_ns;
+		c = Counters();
+	}
+	pass.intersection_seconds = double(intersection_ns) * 1e-9;
+	// Shading is everything on a path that is not intersecting
+	pass.shading_seconds = double(path_ns > intersection_ns ? path_ns - intersection_ns : 0) * 1e-9;
+	last_pass_summary = pass;
+
+	Summary& t = total_summary;
+	t.passes += 1;
+	t.pixel_samples += pass.pixel_samples;
+	t.seconds += pass.seconds;
+	for(int i = 0; i < NumberOfRayTypes; i++)
+		t.rays[i] += pass.rays[i];
+	t.cached_primary_hits += pass.cached_primary_hits;
+	t.paths += pass.paths;
+	for(int i = 0; i <= max_path_length; i++)
+		t.path_length[i] += pass.path_length[i];
+	t.intersection_seconds += pass.intersection_seconds;
+	t.shading_seconds += pass.shading_seconds;
+
+	PassRecord record = { pass.pixel_samples,       pass.seconds,
+		                  { pass.rays[PrimaryRay], pass.rays[ShadowRay], pass.rays[BounceRay] },
+		                  pass.cached_primary_hits, pass.intersection_seconds,
+		                  pass.shading_seconds };
+	passes.push_back(record);
+}
+
+const Summary& total()
+{
+	return total_summary;
+}
+
+const Summary& lastPass()
+{
+	return last_pass_summary;
+}
+
+void reset()
+{
+	total_summary = Summary();
+	last_pass_summary = Summary();
+	passes.clear();
+	for(Counters& c : thread_counters)
+	{
+		c = Counters();
+	}
+}
+
+static bool saveCSV(ofstream& file)
+{
+	file << "pass,pixel_samples,seconds,primary_rays,shadow_rays,bounce_rays,cached_primary_hits,"
+	        "rays_per_second,intersection_seconds,shading_seconds\n";
+	for(size_t i = 0; i < passes.size(); i++)
+	{
+		const PassRecord& p = passes[i];
+		const uint64_t rays = p.rays[PrimaryRay] + p.rays[ShadowRay] + p.rays[BounceRay];
+		file << i << "," << p.pixel_samples << "," << p.seconds << "," << p.rays[PrimaryRay] << ","
+		     << p.rays[ShadowRay] << "," << p.rays[BounceRay] << "," << p.cached_primary_hits << ","
+		     << (p.seconds > 0.0 ? double(rays) / p.seconds : 0.0) << "," << p.intersection_seconds << ","
+		     << p.shading_seconds << "\n";
+	}
+	return bool(file);
+}
+
+static bool saveJSON(ofstream& file)
+{
+	const Summary& t = total_summary;
+	file << "{\n";
+	file << "  \"passes\": " << t.passes << ",\n";
+	file << "  \"pixel_samples\": " << t.pixel_samples << ",\n";
+	file << "  \"seconds\": " << t.seconds << ",\n";
+	file << "  \"primary_rays\": " << t.rays[PrimaryRay] << ",\n";
+	file << "  \"shadow_rays\": " << t.rays[ShadowRay] << ",\n";
+	file << "  \"bounce_rays\": " << t.rays[BounceRay] << ",\n";
+	file << "  \"cached_primary_hits\": " << t.cached_primary_hits << ",\n";
+	file << "  \"rays_per_second\": " << t.raysPerSecond() << ",\n";
+	file << "  \"intersection_seconds\": " << t.intersection_seconds << ",\n";
+	file << "  \"shading_seconds\": " << t.shading_seconds << ",\n";
+	file << "  \"average_path_length\": " << t.averagePathLength() << ",\n";
+	file << "  \"path_length_histogram\": [";
+	for(int i = 0; i <= max_path_length; i++)
+		file << (i > 0 ? ", " : "") << t.path_length[i];
+	file << "],\n";
+	file << "  \"pass_seconds\": [";
+	for(size_t i = 0; i < passes.size(); i++)
+		file << (i > 0 ? ", " : "") << passes[i].seconds;
+	file << "]\n";
+	file << "}\n";
+	return bool(file);
+}
+
+bool save(const string& filename)
+{
+	ofstream file(filename);
+	if(!file)
+	{
+		cout << "Could not open " << filename << " for writing.\n";
+		return false;
+	}
+	const bool csv = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".csv") == 0;
+	if(!(csv ? saveCSV(file) : saveJSON(file)))
+	{
+		cout << "Could not write statistics to " << filename << ".\n";
+		return false;
+	}
+	cout << "Saved statistics of " << total_summary.passes << " passes to " << filename << "\n";
+	return true;
+}
+} // namespace statistics
+} // namespace pathtracer
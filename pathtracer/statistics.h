@@ -0,0 +1,105 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include "sampling.h"
+#include <omp.h>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////
+// Counters of what the pathtracer does: rays by type, path lengths and,
+// optionally, time spent intersecting and shading. Every thread counts
+// into its own counters without atomics; they are merged into per pass
+// records at the end of each pass.
+///////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+namespace statistics
+{
+extern struct Options
+{
+	bool enabled = true;
+	// Time every ray and path. Costs two clock reads per ray.
+	bool timing = false;
+} options;
+
+enum RayType
+{
+	PrimaryRay,
+	ShadowRay,
+	BounceRay,
+	NumberOfRayTypes
+};
+
+// Paths with more hits than this are counted in the last bin
+const int max_path_length = 32;
+
+///////////////////////////////////////////////////////////////////////////
+// Per thread counters, only to be touched through the functions below.
+// One per maxThreads(), each starting on a cache line of its own.
+///////////////////////////////////////////////////////////////////////////
+struct alignas(cache_line_size) Counters
+{
+	uint64_t rays[NumberOfRayTypes];
+	uint64_t cached_primary_hits;
+	uint64_t paths;
+	uint64_t path_length[max_path_length + 1]; // Number of hits along paths
+	uint64_t intersection_ns;
+	uint64_t path_ns;
+};
+extern std::vector<Counters, CacheLineAllocator<Counters>> thread_counters;
+
+inline Counters& threadCounters()
+{
+	return thread_counters[omp_get_thread_num()];
+}
+
+// Nanoseconds since some fixed point in time
+uint64_t now();
+
+///////////////////////////////////////////////////////////////////////////
+// Totals over a range of passes. Times are summed over all threads,
+// except seconds, which is wall clock time.
+///////////////////////////////////////////////////////////////////////////
+struct Summary
+{
+	int passes = 0;
+	uint64_t pixel_samples = 0;
+	double seconds = 0.0;
+	uint64_t rays[NumberOfRayTypes] = {};
+	uint64_t cached_primary_hits = 0;
+	uint64_t paths = 0;
+	uint64_t path_length[max_path_length + 1] = {};
+	double intersection_seconds = 0.0;
+	double shading_seconds = 0.0;
+
+	uint64_t totalRays() const;
+	double raysPerSecond() const;
+	float averagePathLength() const;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Merge the thread counters into a new pass, that traced pixel_samples
+// paths in seconds (wall clock time)
+///////////////////////////////////////////////////////////////////////////
+void endPass(uint64_t pixel_samples, double seconds);
+
+///////////////////////////////////////////////////////////////////////////
+// Clear the thread counters without recording a pass, for passes that
+// are only partly traced here (see distributed.h)
+///////////////////////////////////////////////////////////////////////////
+void discardPass();
+
+///////////////////////////////////////////////////////////////////////////
+// Everything since the last reset(), and the last pass
+///////////////////////////////////////////////////////////////////////////
+const Summary& total();
+const Summary& lastPass();
+void reset();
+
+///////////////////////////////////////////////////////////////////////////
+// Write one line per pass (.csv) or the totals, the path length histogram
+// and all passes (.json, or any other extension)
+///////////////////////////////////////////////////////////////////////////
+bool save(const std::string& filename);
+} // namespace statistics
+} // namespace pathtracer
@@ -0,0 +1,191 @@
+#include "tiled_image.h"
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+static const char magic[8] = { 'P', 'T', 'T', 'I', 'L', 'E', 'S', '2' };
+
+struct TiledImageHeader
+{
+	char magic[8];
+	int32_t width, height, tile_size, reserved;
+	uint64_t content_hash;
+};
+
+Tile TiledImageFile::tile(int index) const
+{
+	const int x0 = (index % tilesX()) * tile_size;
+	const int y0 = (index / tilesX()) * tile_size;
+	Tile result = { x0, y0, std::min(width, x0 + tile_size), std::min(height, y0 + tile_size) };
+	return result;
+}
+
+uint64_t TiledImageFile::tileOffset(int index) const
+{
+	return sizeof(TiledImageHeader) + uint64_t(numberOfTiles())
+	       + uint64_t(index) * tile_size * tile_size * sizeof(vec3);
+}
+
+bool TiledImageFile::create(const string& filename, int w, int h, int t, uint64_t hash)
+{
+	close();
+	width = w;
+	height = h;
+	tile_size = t;
+	content_hash = hash;
+	file.open(filename, ios::in | ios::out | ios::binary | ios::trunc);
+	if(!file)
+	{
+		cout << "Could not create " << filename << ".\n";
+		return false;
+	}
+	TiledImageHeader header;
+	memcpy(header.magic, magic, sizeof(magic));
+	header.width = width;
+	header.height = height;
+	header.tile_size = tile_size;
+	header.reserved = 0;
+	header.content_hash = content_hash;
+	written.assign(numberOfTiles(), 0);
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(written.data()), written.size());
+	file.flush();
+	return bool(file);
+}
+
+bool TiledImageFile::open(const string& filename)
+{
+	close();
+	file.open(filename, ios::in | ios::out | ios::binary);
+	if(!file)
+	{
+		return false;
+	}
+	TiledImageHeader header;
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if(!file || memcmp(header.magic, magic, sizeof(magic)) != 0 || header.width <= 0 || header.height <= 0
+	   || header.tile_size <= 0)
+	{
+		cout << filename << " is not a tiled image.\n";
+		close();
+		return false;
+	}
+	width = header.width;
+	height = header.height;
+	tile_size = header.tile_size;
+	content_hash = header.content_hash;
+	written.resize(numberOfTiles());
+	file.read(reinterpret_cast<char*>(written.data()), written.size());
+	if(!file)
+	{
+		cout << filename << " is truncated.\n";
+		close();
+		return false;
+	}
+	return true;
+}
+
+void TiledImageFile::close()
+{
+	if(file.is_open())
+	{
+		file.close();
+	}
+	file.clear();
+	written.clear();
+}
+
+int TiledImageFile::numberOfWrittenTiles() const
+{
+	int n = 0;
+	for(uint8_t w : written)
+		n += w != 0 ? 1 : 0;
+	return n;
+}
+
+bool TiledImageFile::writeTile(int index, const vec3* pixels)
+{
+	const Tile t = tile(index);
+	for(int y = 0; y < t.height(); y++)
+	{
+		file.seekp(tileOffset(index) + uint64_t(y) * tile_size * sizeof(vec3));
+		file.write(reinterpret_cast<const char*>(pixels + y * t.width()), t.width() * sizeof(vec3));
+	}
+	// Only mark the tile as written once all of it is on disk, so that an
+	// interrupted render can be continued
+	file.flush();
+	written[index] = 1;
+	file.seekp(sizeof(TiledImageHeader) + index);
+	file.write(reinterpret_cast<const char*>(&written[index]), 1);
+	file.flush();
+	return bool(file);
+}
+
+bool TiledImageFile::readTile(int index, vec3* pixels)
+{
+	const Tile t = tile(index);
+	for(int y = 0; y < t.height(); y++)
+	{
+		file.seekg(tileOffset(index) + uint64_t(y) * tile_size * sizeof(vec3));
+		file.read(reinterpret_cast<char*>(pixels + y * t.width()), t.width() * sizeof(vec3));
+	}
+	return bool(file);
+}
+
+bool convertToPFM(const string& tiles_filename, const string& pfm_filename)
+{
+	TiledImageFile tiles;
+	if(!tiles.open(tiles_filename))
+	{
+		cout << "Could not open " << tiles_filename << ".\n";
+		return false;
+	}
+	if(tiles.numberOfWrittenTiles() != tiles.numberOfTiles())
+	{
+		cout << tiles_filename << " has only " << tiles.numberOfWrittenTiles() << " of " << tiles.numberOfTiles()
+		     << " tiles.\n";
+		return false;
+	}
+	ofstream pfm(pfm_filename, ios::binary);
+	if(!pfm)
+	{
+		cout << "Could not open " << pfm_filename << " for writing.\n";
+		return false;
+	}
+	// A negative scale means little endian. Rows are stored bottom first.
+	pfm << "PF\n" << tiles.width << " " << tiles.height << "\n-1.0\n";
+	vector<vec3> rows(size_t(tiles.width) * tiles.tile_size);
+	vector<vec3> pixels(size_t(tiles.tile_size) * tiles.tile_size);
+	for(int ty = 0; ty < tiles.tilesY(); ty++)
+	{
+		int rows_in_tile = 0;
+		for(int tx = 0; tx < tiles.tilesX(); tx++)
+		{
+			const int index = ty * tiles.tilesX() + tx;
+			const Tile t = tiles.tile(index);
+			if(!tiles.readTile(index, pixels.data()))
+			{
+				cout << "Could not read tile " << index << " of " << tiles_filename << ".\n";
+				return false;
+			}
+			for(int y = 0; y < t.height(); y++)
+			{
+				copy(&pixels[size_t(y) * t.width()], &pixels[size_t(y) * t.width()] + t.width(),
+				     &rows[size_t(y) * tiles.width + t.x0]);
+			}
+			rows_in_tile = t.height();
+		}
+		pfm.write(reinterpret_cast<const char*>(rows.data()), size_t(rows_in_tile) * tiles.width * sizeof(vec3));
+	}
+	if(!pfm)
+	{
+		cout << "Could not write " << pfm_filename << ".\n";
+		return false;
+	}
+	return true;
+}
+} // namespace pathtracer
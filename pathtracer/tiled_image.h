@@ -0,0 +1,66 @@
+#pragma once
+#include <stdint.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "Pathtracer.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// A float RGB image on disk, stored as square tiles, so that it can be
+// written one tile at a time in any order with only the tiles in flight
+// in memory. The file is a header, a table with a byte per tile that is
+// set once the tile has been written, and then the tiles, each padded to
+// tile_size x tile_size pixels. Tiles, and the rows within them, are
+// stored bottom row first, like rendered_image. The header also holds a
+// hash of whatever the image is rendered from, so that a render is only
+// continued in a file of the same render.
+///////////////////////////////////////////////////////////////////////////
+struct TiledImageFile
+{
+	int width = 0, height = 0, tile_size = 0;
+	uint64_t content_hash = 0;
+
+	int tilesX() const
+	{
+		return (width + tile_size - 1) / tile_size;
+	}
+	int tilesY() const
+	{
+		return (height + tile_size - 1) / tile_size;
+	}
+	int numberOfTiles() const
+	{
+		return tilesX() * tilesY();
+	}
+	// The pixels of a tile
+	Tile tile(int index) const;
+
+	// Create a new file, or open an existing one to continue writing it
+	bool create(const std::string& filename, int width, int height, int tile_size, uint64_t content_hash);
+	bool open(const std::string& filename);
+	void close();
+
+	bool isWritten(int index) const
+	{
+		return written[index] != 0;
+	}
+	int numberOfWrittenTiles() const;
+	// pixels holds tile(index).width() x tile(index).height() pixels
+	bool writeTile(int index, const glm::vec3* pixels);
+	bool readTile(int index, glm::vec3* pixels);
+
+private:
+	std::fstream file;
+	std::vector<uint8_t> written;
+	uint64_t tileOffset(int index) const;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Write a completely written tiled image as a .pfm (portable float map),
+// reading one row of tiles at a time
+///////////////////////////////////////////////////////////////////////////
+bool convertToPFM(const std::string& tiles_filename, const std::string& pfm_filename);
+} // namespace pathtracer
@@ -0,0 +1,11 @@
+#version 330
+// Writes which triangle covers the fragment. The buffer is cleared to
+// ~0u, which is what embree uses for "no geometry".
+layout(location = 0) out uvec2 visibility;
+
+uniform uint geom_ID;
+
+void main()
+{
+	visibility = uvec2(geom_ID, uint(gl_PrimitiveID));
+}
@@ -0,0 +1,10 @@
+#version 330
+// Transforms the vertices of a mesh for the visibility buffer
+layout(location = 0) in vec3 position;
+
+uniform mat4 modelViewProjectionMatrix;
+
+void main()
+{
+	gl_Position = modelViewProjectionMatrix * vec4(position, 1.0);
+}
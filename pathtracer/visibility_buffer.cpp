@@ -0,0 +1,206 @@
+#include "visibility_buffer.h"
+#include <GL/glew.h>
+#include <labhelper.h>
+#include <iostream>
+#include "Pathtracer.h"
+#include "embree.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+namespace visibility_buffer
+{
+static GLuint program = 0;
+static GLuint framebuffer = 0, id_texture = 0, depth_renderbuffer = 0;
+static GLuint pixel_buffer = 0;
+static GLsync fence = nullptr;
+static int buffer_width = 0, buffer_height = 0;
+
+///////////////////////////////////////////////////////////////////////////
+// What a visibility buffer was made for
+///////////////////////////////////////////////////////////////////////////
+struct View
+{
+	mat4 V, P;
+	int width = 0, height = 0, strata = 0;
+};
+static View pending;   // The one being read back, if fence is set
+static View delivered; // The last one handed to the pathtracer
+
+static bool sameView(const View& a, const View& b)
+{
+	return a.V == b.V && a.P == b.P && a.width == b.width && a.height == b.height && a.strata == b.strata;
+}
+
+bool initialize()
+{
+	program = labhelper::loadShaderProgram("../pathtracer/visibility.vert", "../pathtracer/visibility.frag", true);
+	if(program == 0)
+	{
+		cout << "Could not build the visibility buffer shaders.\n";
+		return false;
+	}
+	glGenFramebuffers(1, &framebuffer);
+	glGenTextures(1, &id_texture);
+	glGenRenderbuffers(1, &depth_renderbuffer);
+	glGenBuffers(1, &pixel_buffer);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// (Re)allocate the render targets and the readback buffer
+///////////////////////////////////////////////////////////////////////////
+static bool resize(int width, int height)
+{
+	if(width == buffer_width && height == buffer_height)
+	{
+		return true;
+	}
+	buffer_width = width;
+	buffer_height = height;
+	glBindTexture(GL_TEXTURE_2D, id_texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, width, height, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindRenderbuffer(GL_RENDERBUFFER, depth_renderbuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, id_texture, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_renderbuffer);
+	const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if(status != GL_FRAMEBUFFER_COMPLETE)
+	{
+		cout << "The visibility buffer framebuffer is incomplete (" << status << ").\n";
+		buffer_width = buffer_height = 0;
+		return false;
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_buffer);
+	glBufferData(GL_PIXEL_PACK_BUFFER, GLsizeiptr(width) * height * sizeof(VisibilitySample), nullptr, GL_STREAM_READ);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Draw every mesh with its embree geometry ID, and start copying the
+// result to the pixel buffer object
+///////////////////////////////////////////////////////////////////////////
+static void rasterize(const vector<pair<labhelper::Model*, mat4>>& models, const View& view)
+{
+	if(!resize(view.width * view.strata, view.height * view.strata))
+	{
+		return;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glViewport(0, 0, buffer_width, buffer_height);
+	const GLuint nothing[4] = { RTC_INVALID_GEOMETRY_ID, RTC_INVALID_GEOMETRY_ID, 0, 0 };
+	glClearBufferuiv(GL_COLOR, 0, nothing);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glEnable(GL_DEPTH_TEST);
+	// Rays hit both sides of triangles, and are not clipped by the near
+	// and far planes
+	glDisable(GL_CULL_FACE);
+	glEnable(GL_DEPTH_CLAMP);
+	glUseProgram(program);
+	const GLint geom_ID_location = glGetUniformLocation(program, "geom_ID");
+	// Geometries are numbered in the order addModel() adds them
+	uint32_t geom_ID = 0;
+	for(auto& m : models)
+	{
+		labhelper::setUniformSlow(program, "modelViewProjectionMatrix", view.P * view.V * m.second);
+		glBindVertexArray(m.first->m_vaob);
+		for(auto& mesh : m.first->m_meshes)
+		{
+			glUniform1ui(geom_ID_location, geom_ID++);
+			glDrawArrays(GL_TRIANGLES, mesh.m_start_index, mesh.m_number_of_vertices);
+		}
+	}
+	glBindVertexArray(0);
+	glDisable(GL_DEPTH_CLAMP);
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_buffer);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, buffer_width, buffer_height, GL_RG_INTEGER, GL_UNSIGNED_INT, nullptr);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	// Make sure the work is started before we wait for it next frame
+	glFlush();
+	pending = view;
+}
+
+void update(const vector<pair<labhelper::Model*, mat4>>& models, const mat4& V, const mat4& P)
+{
+	if(program == 0 || !settings.cache_primary_hits)
+	{
+		return;
+	}
+	for(auto& m : models)
+	{
+		// Models that only live on the CPU can not be rasterized
+		if(m.first->m_vaob == 0)
+			return;
+	}
+	View current;
+	current.V = V;
+	current.P = P;
+	current.width = rendered_image.width;
+	current.height = rendered_image.height;
+	current.strata = std::max(1, settings.strata);
+
+	if(fence != nullptr)
+	{
+		if(glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+		{
+			return;
+		}
+		glDeleteSync(fence);
+		fence = nullptr;
+		// Results for a camera that has moved since are dropped
+		if(sameView(pending, current))
+		{
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_buffer);
+			const void* samples = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+			                                       GLsizeiptr(buffer_width) * buffer_height * sizeof(VisibilitySample),
+			                                       GL_MAP_READ_BIT);
+			if(samples != nullptr)
+			{
+				setPrimaryVisibility(V, P, current.width, current.height, current.strata,
+				                     static_cast<const VisibilitySample*>(samples));
+				delivered = current;
+			}
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		}
+	}
+	if(!sameView(delivered, current))
+	{
+		rasterize(models, current);
+	}
+}
+
+void destroy()
+{
+	if(fence != nullptr)
+	{
+		glDeleteSync(fence);
+		fence = nullptr;
+	}
+	glDeleteBuffers(1, &pixel_buffer);
+	glDeleteRenderbuffers(1, &depth_renderbuffer);
+	glDeleteTextures(1, &id_texture);
+	glDeleteFramebuffers(1, &framebuffer);
+	glDeleteProgram(program);
+	program = framebuffer = id_texture = depth_renderbuffer = pixel_buffer = 0;
+	buffer_width = buffer_height = 0;
+	delivered = View();
+}
+} // namespace visibility_buffer
+} // namespace pathtracer
@@ -0,0 +1,40 @@
+#pragma once
+#include <vector>
+#include <glm/glm.hpp>
+#include <Model.h>
+
+///////////////////////////////////////////////////////////////////////////
+// Rasterized primary visibility. The scene is drawn with OpenGL into a
+// buffer with one texel per stratum of every pixel, that stores which
+// triangle is seen there. The buffer is read back asynchronously through
+// a pixel buffer object, and handed to setPrimaryVisibility() when it is
+// ready, so that primary rays do not have to be traced. Only needs
+// OpenGL 3.3, and so also runs on software implementations such as Mesa
+// llvmpipe.
+///////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+namespace visibility_buffer
+{
+///////////////////////////////////////////////////////////////////////////
+// Load the shaders. Returns false if they could not be built.
+///////////////////////////////////////////////////////////////////////////
+bool initialize();
+
+///////////////////////////////////////////////////////////////////////////
+// Call once per frame, before tracing, with the models returned by
+// loadScene() and the camera of the frame. Delivers a finished readback
+// if it was made for this camera, and starts rasterizing the current
+// camera if the primary hit cache has not been given it yet. Needs
+// settings.cache_primary_hits.
+///////////////////////////////////////////////////////////////////////////
+void update(const std::vector<std::pair<labhelper::Model*, glm::mat4>>& models,
+            const glm::mat4& V,
+            const glm::mat4& P);
+
+///////////////////////////////////////////////////////////////////////////
+// Free all GL objects
+///////////////////////////////////////////////////////////////////////////
+void destroy();
+} // namespace visibility_buffer
+} // namespace pathtracer
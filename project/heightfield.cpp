@@ -6,6 +6,7 @@
 #include <vector>
 #include <glm/glm.hpp>
 #include <stb_image.h>
+#include <ModelCache.h>
 
 using namespace glm;
 using std::string;
@@ -54,10 +55,9 @@ void HeightField::loadHeightField(const std::string& heigtFieldPath)
 
 void HeightField::loadDiffuseTexture(const std::string& diffusePath)
 {
-	int width, height, components;
 	stbi_set_flip_vertically_on_load(true);
-	uint8_t* data = stbi_load(diffusePath.c_str(), &width, &height, &components, 3);
-	if(data == nullptr)
+	labhelper::CompressedTexture texture;
+	if(!labhelper::loadCompressedTexture(diffusePath, 3, texture))
 	{
 		std::cout << "Failed to load image: " << diffusePath << ".\n";
 		return;
@@ -74,8 +74,7 @@ void HeightField::loadDiffuseTexture(const std::string& diffusePath)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data); // plain RGB
-	glGenerateMipmap(GL_TEXTURE_2D);
+	labhelper::uploadCompressedTexture(texture); // BC1 with all mip levels
 
 	std::cout << "Successfully loaded diffuse texture: " << diffusePath << ".\n";
 }
@@ -22,6 +22,7 @@ extern "C" _declspec(dllexport) unsigned int NvOptimusEnablement = 0x00000001;
 using namespace glm;
 
 #include <Model.h>
+#include <AssetLoader.h>
 #include "hdr.h"
 #include "fbo.h"
 
@@ -134,27 +135,36 @@ void initGL()
 	particleShaderProgram = labhelper::loadShaderProgram("../project/particle.vert", "../project/particle.frag");
 
 	///////////////////////////////////////////////////////////////////////
-	// Load models and set up model matrices
+	// Load models and environment maps, all at once
 	///////////////////////////////////////////////////////////////////////
-	fighterModel = labhelper::loadModelFromOBJ("../scenes/NewShip.obj");
-	landingpadModel = labhelper::loadModelFromOBJ("../scenes/landingpad.obj");
-	sphereModel = labhelper::loadModelFromOBJ("../scenes/sphere.obj");
+	labhelper::AssetLoader loader;
+	auto fighter = loader.loadModel("../scenes/NewShip.obj");
+	auto landingpad = loader.loadModel("../scenes/landingpad.obj");
+	auto sphere = loader.loadModel("../scenes/sphere.obj");
 
-	roomModelMatrix = mat4(1.0f);
-	fighterModelMatrix = translate(15.0f * worldUp);
-	landingPadModelMatrix = mat4(1.0f);
-
-	///////////////////////////////////////////////////////////////////////
-	// Load environment map
-	///////////////////////////////////////////////////////////////////////
 	const int roughnesses = 8;
 	std::vector<std::string> filenames;
 	for(int i = 0; i < roughnesses; i++)
 		filenames.push_back("../scenes/envmaps/" + envmap_base_name + "_dl_" + std::to_string(i) + ".hdr");
 
-	reflectionMap = labhelper::loadHdrMipmapTexture(filenames);
-	environmentMap = labhelper::loadHdrTexture("../scenes/envmaps/" + envmap_base_name + ".hdr");
-	irradianceMap = labhelper::loadHdrTexture("../scenes/envmaps/" + envmap_base_name + "_irradiance.hdr");
+	auto reflection = loader.loadHdrMipmapTexture(filenames);
+	auto environment = loader.loadHdrTexture("../scenes/envmaps/" + envmap_base_name + ".hdr");
+	auto irradiance = loader.loadHdrTexture("../scenes/envmaps/" + envmap_base_name + "_irradiance.hdr");
+	loader.finish();
+
+	fighterModel = fighter.get();
+	landingpadModel = landingpad.get();
+	sphereModel = sphere.get();
+	reflectionMap = reflection.get();
+	environmentMap = environment.get();
+	irradianceMap = irradiance.get();
+
+	///////////////////////////////////////////////////////////////////////
+	// Set up model matrices
+	///////////////////////////////////////////////////////////////////////
+	roomModelMatrix = mat4(1.0f);
+	fighterModelMatrix = translate(15.0f * worldUp);
+	landingPadModelMatrix = mat4(1.0f);
 
 	///////////////////////////////////////////////////////////////////////////
 	// Particle system
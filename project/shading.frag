@@ -1,4 +1,4 @@
-#version 420
+#version 430
 
 // required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
 precision highp float;
@@ -6,17 +6,40 @@ precision highp float;
 ///////////////////////////////////////////////////////////////////////////////
 // Material
 ///////////////////////////////////////////////////////////////////////////////
-uniform vec3 material_color;
-uniform float material_reflectivity;
-uniform float material_metalness;
-uniform float material_fresnel;
-uniform float material_shininess;
-uniform float material_emission;
-
-uniform int has_emission_texture;
-uniform int has_color_texture;
-layout(binding = 0) uniform sampler2D colorMap;
-layout(binding = 5) uniform sampler2D emissiveMap;
+struct MaterialData
+{
+	vec3 color;
+	float reflectivity;
+	float metalness;
+	float fresnel;
+	float shininess;
+	float emission;
+	// The layer of each texture, or -1 where there is none
+	int color_layer;
+	int reflectivity_layer;
+	int metalness_layer;
+	int fresnel_layer;
+	int shininess_layer;
+	int emission_layer;
+};
+
+// All materials of the model, indexed by materialIndex
+layout(std430) readonly buffer Materials
+{
+	MaterialData materials[];
+};
+
+layout(binding = 0) uniform sampler2DArray colorMap;
+layout(binding = 5) uniform sampler2DArray emissiveMap;
+
+// The material of this fragment, read by main()
+MaterialData material;
+vec3 material_color;
+float material_reflectivity;
+float material_metalness;
+float material_fresnel;
+float material_shininess;
+float material_emission;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Environment
@@ -43,6 +66,7 @@ uniform float point_light_intensity_multiplier = 50.0;
 in vec2 texCoord;
 in vec3 viewSpaceNormal;
 in vec3 viewSpacePosition;
+flat in int materialIndex;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Input uniform variables
@@ -159,6 +183,14 @@ vec3 calculateIndirectIllumination(vec3 wo, vec3 n)
 
 void main()
 {
+	material = materials[materialIndex];
+	material_color = material.color;
+	material_reflectivity = material.reflectivity;
+	material_metalness = material.metalness;
+	material_fresnel = material.fresnel;
+	material_shininess = material.shininess;
+	material_emission = material.emission;
+
 	float visibility = 1.0;
 	float attenuation = 1.0;
 
@@ -175,9 +207,9 @@ void main()
 	// Add emissive term. If emissive texture exists, sample this term.
 	///////////////////////////////////////////////////////////////////////////
 	vec3 emission_term = material_emission * material_color;
-	if(has_emission_texture == 1)
+	if(material.emission_layer >= 0)
 	{
-		emission_term = texture(emissiveMap, texCoord).xyz;
+		emission_term = texture(emissiveMap, vec3(texCoord, material.emission_layer)).xyz;
 	}
 
 	vec3 shading = direct_illumination_term + indirect_illumination_term + emission_term;
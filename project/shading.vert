@@ -1,10 +1,12 @@
-#version 420
+#version 430
 ///////////////////////////////////////////////////////////////////////////////
 // Input vertex attributes
 ///////////////////////////////////////////////////////////////////////////////
 layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 normalIn;
 layout(location = 2) in vec2 texCoordIn;
+// The index of the material in the Materials buffer, per draw command
+layout(location = 3) in int materialIndexIn;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Input uniform variables
@@ -19,6 +21,7 @@ uniform mat4 modelViewProjectionMatrix;
 out vec2 texCoord;
 out vec3 viewSpaceNormal;
 out vec3 viewSpacePosition;
+flat out int materialIndex;
 
 
 void main()
@@ -27,5 +30,6 @@ void main()
 	texCoord = texCoordIn;
 	viewSpaceNormal = (normalMatrix * vec4(normalIn, 0.0)).xyz;
 	viewSpacePosition = (modelViewMatrix * vec4(position, 1.0)).xyz;
+	materialIndex = materialIndexIn;
 
 }